@@ -0,0 +1,126 @@
+#include <ior8c22_23.h>
+#include <intrinsics.h>
+#include "button_out_internal.h"
+#include "scheduler.h"
+
+void ButtonOutInit(void)
+{
+  P0 &= ~BUTTONOUT_PD0MASK;         // the lines are only ever driven low, so the outputs are left at 0 and the
+  P6_bit.P6_0 = 0;                  // direction bits do the pressing
+  P1_bit.P1_1 = 0;
+  P3_bit.P3_3 = 0;
+  ButtonOutApply(BUTTONLINE_NONE);
+
+  TRACR = 0;
+  TRAIOC = 0;
+  TRAMR = 0x10;                     // timer mode, f8 as a source
+  TRAPRE = BUTTONOUT_TRAPRE;
+  TRA = BUTTONOUT_TRA;
+  TRAIC = 1;                        // enable interrupt, the timer is only started when there is something to play
+}
+/********************************************************************************************************************************/
+
+bool ButtonOutPush(u8 lines, u16 ms)
+{
+  __istate_t state;
+  u8 next = ( ButtonOut.In + 1 ) & ( BUTTONOUTSTEPS - 1 );
+
+  if ( next == ButtonOut.Out )
+  {
+    return false;
+  }
+  ButtonOut.Steps[ButtonOut.In].Lines = lines;
+  ButtonOut.Steps[ButtonOut.In].Time = ms ? ms : 1;
+  ButtonOut.In = next;
+
+  state = __get_interrupt_state();
+  __disable_interrupt();
+  if ( !ButtonOut.Running )
+  {
+    // nothing playing, so put it on the lines now rather than on the next tick
+    ButtonOutNext();
+    TRA = BUTTONOUT_TRA;
+    TRACR = TRACR_TSTART;
+    ButtonOut.Running = true;
+  }
+  __set_interrupt_state(state);
+  return true;
+}
+/********************************************************************************************************************************/
+
+u8 ButtonOutSpace(void)
+{
+  return ( ButtonOut.Out - ButtonOut.In - 1 ) & ( BUTTONOUTSTEPS - 1 );
+}
+/********************************************************************************************************************************/
+
+u8 ButtonOutQueued(void)
+{
+  return ( ButtonOut.In - ButtonOut.Out ) & ( BUTTONOUTSTEPS - 1 );
+}
+/********************************************************************************************************************************/
+
+bool ButtonOutIdle(void)
+{
+  return !ButtonOut.Running;
+}
+/********************************************************************************************************************************/
+
+void ButtonOutStop(void)
+{
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  TRACR = 0;
+  ButtonOut.Running = false;
+  ButtonOut.Out = ButtonOut.In;
+  ButtonOut.Left = 0;
+  ButtonOutApply(BUTTONLINE_NONE);
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+void ButtonOutTick(void)
+{
+  if ( ButtonOut.Left && --ButtonOut.Left )
+  {
+    return;
+  }
+  if ( ButtonOut.In == ButtonOut.Out )
+  {
+    // the last step has had its time, it stays on the lines till there is another
+    TRACR = 0;
+    ButtonOut.Running = false;
+    return;
+  }
+  ButtonOutNext();
+  TaskReady(TASK_RADIO);            // there is room for another
+}
+/********************************************************************************************************************************/
+
+// Interrupts off. Takes the next step off the queue and puts it on the lines.
+static void ButtonOutNext(void)
+{
+  TBUTTONSTEP * step = &ButtonOut.Steps[ButtonOut.Out];
+
+  ButtonOutApply(step->Lines);
+  ButtonOut.Left = step->Time;
+  ButtonOut.Out = ( ButtonOut.Out + 1 ) & ( BUTTONOUTSTEPS - 1 );
+}
+/********************************************************************************************************************************/
+
+// Interrupts off, so nothing can use up the port 0 unprotect before PD0 is written
+static void ButtonOutApply(u8 lines)
+{
+  u8 pd0 = ( PD0 & ~BUTTONOUT_PD0MASK ) | ( ( lines & BUTTONOUT_P0LINES ) << BUTTONOUT_P0SHIFT );
+
+  while ( PD0 != pd0 )              // keep trying till it's set!
+  {
+    PRCR = 4;                       // unprotect port 0
+    PD0 = pd0;
+  }
+  PD6_bit.PD6_0 = ( lines & BUTTONLINE_TRACKDOWN ) ? 1 : 0;
+  PD1_bit.PD1_1 = ( lines & BUTTONLINE_SHIFT ) ? 1 : 0;
+  PD3_bit.PD3_3 = ( lines & BUTTONLINE_DISP ) ? 1 : 0;
+}
+/********************************************************************************************************************************/
@@ -0,0 +1,37 @@
+#ifndef BUTTON_OUT_H
+#define BUTTON_OUT_H
+
+#include "common.h"
+
+// Drives the head unit's resistor ladder button lines. Each step pulls a set of lines low and lets the rest float for
+// a time in ms, the steps are played back to back from the timer RA interrupt so their timing doesn't depend on how
+// busy the main loop is. The last step played stays on the lines until the next one is pushed.
+// Timer RA is only the sleep tick once we have gone to sleep, by then this has been stopped.
+
+// A line in a step's mask is pulled low, so a mask of 0 is everything released
+#define BUTTONLINE_VOLDOWN      0x01      // P0_2
+#define BUTTONLINE_VOLUP        0x02      // P0_3
+#define BUTTONLINE_TRACKUP      0x04      // P0_4
+#define BUTTONLINE_PICKUP       0x08      // P0_5
+#define BUTTONLINE_SOURCE       0x10      // P0_6
+#define BUTTONLINE_TRACKDOWN    0x20      // P6_0
+#define BUTTONLINE_SHIFT        0x40      // P1_1
+#define BUTTONLINE_DISP         0x80      // P3_3
+#define BUTTONLINE_NONE         0
+
+// Every line released, timer RA set up for its 1ms tick but not started
+void ButtonOutInit(void);
+// Queue a step, it starts straight away if nothing is playing. False if there is no room for it.
+bool ButtonOutPush(u8 lines, u16 ms);
+// How many more steps can be pushed
+u8 ButtonOutSpace(void);
+// How many steps are waiting behind the one on the lines
+u8 ButtonOutQueued(void);
+// Nothing queued and the last step has had its time
+bool ButtonOutIdle(void);
+// Throws away anything queued and releases every line, eg. before we sleep
+void ButtonOutStop(void);
+// Timer RA interrupt while we are awake
+void ButtonOutTick(void);
+
+#endif
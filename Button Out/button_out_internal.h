@@ -0,0 +1,33 @@
+#ifndef BUTTON_OUT_INTERNAL_H
+#define BUTTON_OUT_INTERNAL_H
+
+#include "button_out.h"
+
+#define BUTTONOUTSTEPS          8         // power of 2
+#define BUTTONOUT_P0LINES       0x1f      // BUTTONLINE_ bits that are port 0
+#define BUTTONOUT_P0SHIFT       2         // and how far up port 0 they are
+#define BUTTONOUT_PD0MASK       ( BUTTONOUT_P0LINES << BUTTONOUT_P0SHIFT )
+
+#define BUTTONOUT_TRAPRE        199       // f8 (2MHz) / 200
+#define BUTTONOUT_TRA           9         // / 10, a 1ms tick
+#define TRACR_TSTART            0x01
+
+static void ButtonOutApply(u8 lines);
+static void ButtonOutNext(void);
+
+typedef struct
+{
+  u8 Lines;
+  u16 Time;                         // ms
+}TBUTTONSTEP;
+
+static struct
+{
+  TBUTTONSTEP Steps[BUTTONOUTSTEPS];
+  volatile u8 In;
+  volatile u8 Out;
+  volatile u16 Left;                // ms still to go on the step on the lines
+  volatile bool Running;            // timer RA is ticking
+}ButtonOut;
+
+#endif
@@ -0,0 +1,96 @@
+#include <ior8c22_23.h>
+#include "can_monitor_internal.h"
+#include "diags.h"
+
+void CanMonitorRun(void)
+{
+  u8 tec = C0TEC;
+  u8 rec = C0REC;
+  u32 load;
+  u16 elapsed;
+
+  CanMon.Metrics.Tec = tec;
+  CanMon.Metrics.Rec = rec;
+  if ( tec > CanMon.Metrics.PeakTec )
+  {
+    CanMon.Metrics.PeakTec = tec;
+  }
+  if ( rec > CanMon.Metrics.PeakRec )
+  {
+    CanMon.Metrics.PeakRec = rec;
+  }
+
+  if ( !TimerRunning(&CanMon.Window) )
+  {
+    // the window only has to be roughly a second, the load is worked out from how long it really was
+    elapsed = TimerSince(CanMon.WindowStart);
+    if ( elapsed )
+    {
+      load = ( CanMon.Bits * 100 ) / ( (u32)( CANBITRATE / 1000 ) * elapsed );
+      CanMon.Metrics.Load = ( load > 100 ) ? 100 : load;
+      if ( CanMon.Metrics.Load > CanMon.Metrics.PeakLoad )
+      {
+        CanMon.Metrics.PeakLoad = CanMon.Metrics.Load;
+      }
+      CanMon.Metrics.Frames = CanMon.Frames;
+    }
+    CanMon.WindowStart = TimerNow();
+    CanMon.Bits = 0;
+    CanMon.Frames = 0;
+    TimerArm(&CanMon.Window,CANMONITORWINDOW);
+  }
+}
+/********************************************************************************************************************************/
+
+void CanMonitorFrame(u8 dlc)
+{
+  u16 took;
+
+  CanMon.Bits += CanFrameBits[( dlc > 8 ) ? 8 : dlc];
+  CanMon.Frames++;
+  if ( CanMon.Recovering )
+  {
+    // something has got through, so we are back on the bus
+    CanMon.Recovering = false;
+    took = TimerSince(CanMon.BusOffAt);
+    CanMon.Metrics.LastRecovery = took;
+    if ( took > CanMon.Metrics.MaxRecovery )
+    {
+      CanMon.Metrics.MaxRecovery = took;
+    }
+    DiagsLog(LOG_BUSRECOVERED,0,took);
+  }
+}
+/********************************************************************************************************************************/
+
+void CanMonitorBusOff(void)
+{
+  CanMonitorCount(&CanMon.Metrics.BusOffs);
+  if ( !CanMon.Recovering )
+  {
+    CanMon.Recovering = true;
+    CanMon.BusOffAt = TimerNow();
+  }
+}
+/********************************************************************************************************************************/
+
+void CanMonitorOverrun(void)
+{
+  CanMonitorCount(&CanMon.Metrics.Overruns);
+}
+/********************************************************************************************************************************/
+
+const TCANMONITOR * CanMonitor(void)
+{
+  return &CanMon.Metrics;
+}
+/********************************************************************************************************************************/
+
+static void CanMonitorCount(u16 * count)
+{
+  if ( *count < 0xffff )
+  {
+    ( *count )++;
+  }
+}
+/********************************************************************************************************************************/
@@ -0,0 +1,33 @@
+#ifndef CAN_MONITOR_H
+#define CAN_MONITOR_H
+
+#include "common.h"
+
+// Live health of the CAN bus, so a tester can tell a saturated or noisy vehicle bus from frames we have dropped
+// ourselves. The load is worked out from the frames we see, the ones that get through our acceptance filters and the
+// ones we send, so it is a lower bound on the real bus load.
+
+typedef struct
+{
+  u8 Load;                          // % of the bus our frames took over the last window
+  u8 PeakLoad;
+  u16 Frames;                       // in and out in the last window
+  u8 Tec;                           // the controller's error counters, now
+  u8 Rec;
+  u8 PeakTec;                       // and the highest they have been
+  u8 PeakRec;
+  u16 BusOffs;                      // these all stick at 0xffff
+  u16 LastRecovery;                 // ms from going bus off to the next frame in or out
+  u16 MaxRecovery;
+  u16 Overruns;                     // frames the controller had that we didn't get to in time
+}TCANMONITOR;
+
+// Receive task, every time round. Samples the error counters and closes the load window when it is due.
+void CanMonitorRun(void);
+// CAN driver, every frame in or out
+void CanMonitorFrame(u8 dlc);
+void CanMonitorBusOff(void);
+void CanMonitorOverrun(void);
+const TCANMONITOR * CanMonitor(void);
+
+#endif
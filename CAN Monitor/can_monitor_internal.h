@@ -0,0 +1,32 @@
+#ifndef CAN_MONITOR_INTERNAL_H
+#define CAN_MONITOR_INTERNAL_H
+
+#include "can_monitor.h"
+#include "timer.h"
+
+#define CANMONITORWINDOW    1000                    // ms
+#define CANBITRATE          95238                   // 16MHz / 4 / 2 / 21tq, see caninitdata
+
+// Bits on the wire for a standard frame by dlc, 47 of frame and 8 a byte, plus half the worst case for stuffing
+#define CANFRAMEBITS(dlc)   ( 47 + ( 8 * (dlc) ) + ( ( 34 + ( 8 * (dlc) ) ) / 8 ) )
+
+static const u8 CanFrameBits[9] =
+{
+  CANFRAMEBITS(0), CANFRAMEBITS(1), CANFRAMEBITS(2), CANFRAMEBITS(3), CANFRAMEBITS(4),
+  CANFRAMEBITS(5), CANFRAMEBITS(6), CANFRAMEBITS(7), CANFRAMEBITS(8)
+};
+
+static void CanMonitorCount(u16 * count);
+
+static struct
+{
+  TCANMONITOR Metrics;
+  u32 Bits;                         // so far this window
+  u16 Frames;
+  TTimer Window;
+  u16 WindowStart;                  // TimerNow()
+  u16 BusOffAt;                     // TimerNow() it went bus off
+  bool Recovering;
+}CanMon;
+
+#endif
@@ -0,0 +1,192 @@
+#include "can_trace_internal.h"
+#include "timer.h"
+#include "diags.h"
+
+void CanTraceInit(void)
+{
+#ifdef CANTRACE_ENABLED
+  CanTraceArm(CANTRACETRIG_BUSOFF,0,CANTRACE_DEFAULTPOST);
+#endif
+}
+/********************************************************************************************************************************/
+
+bool CanTraceArm(u8 trigger, u16 id, u8 post)
+{
+#ifdef CANTRACE_ENABLED
+  if ( ( trigger >= CANTRACETRIG_END ) || ( post > CANTRACEENTRIES ) )
+  {
+    return false;
+  }
+  CanTrace.In = 0;
+  CanTrace.Count = 0;
+  CanTrace.Trigger = trigger;
+  CanTrace.TriggerId = id;
+  CanTrace.Post = post;
+  CanTrace.Dumped = 0;
+  CanTrace.State = CANTRACE_ARMED;
+  return true;
+#else
+  return false;
+#endif
+}
+/********************************************************************************************************************************/
+
+void CanTraceStop(void)
+{
+#ifdef CANTRACE_ENABLED
+  if ( CanTrace.State != CANTRACE_OFF )
+  {
+    CanTrace.State = CANTRACE_STOPPED;
+  }
+#endif
+}
+/********************************************************************************************************************************/
+
+CANTRACESTATE CanTraceState(void)
+{
+#ifdef CANTRACE_ENABLED
+  return (CANTRACESTATE)CanTrace.State;
+#else
+  return CANTRACE_OFF;
+#endif
+}
+/********************************************************************************************************************************/
+
+u8 CanTraceCount(void)
+{
+#ifdef CANTRACE_ENABLED
+  return CanTrace.Count;
+#else
+  return 0;
+#endif
+}
+/********************************************************************************************************************************/
+
+u8 CanTraceRead(u8 start, u8 * out, u8 max)
+{
+#ifdef CANTRACE_ENABLED
+  u8 copied;
+
+  for ( copied = 0 ; ( copied < max ) && ( start < CanTrace.Count ) ; copied++, start++ )
+  {
+    CanTracePack(start,out);
+    out += CANTRACE_ENTRYLEN;
+  }
+  return copied;
+#else
+  return 0;
+#endif
+}
+/********************************************************************************************************************************/
+
+void CanTraceRun(void)
+{
+#ifdef CANTRACE_ENABLED
+  u8 entry[CANTRACE_ENTRYLEN];
+
+  if ( ( CanTrace.State != CANTRACE_STOPPED ) || ( CanTrace.Dumped >= CanTrace.Count ) )
+  {
+    return;
+  }
+  if ( !CanTrace.Dumped )
+  {
+    if ( !DiagsLogRoom(LOG_ARGSLEN) )
+    {
+      return;
+    }
+    DiagsLog(LOG_CANTRACE,CanTrace.Trigger,CanTrace.Count);
+  }
+  // only as much as the UART ring will take now, the rest goes on later ticks
+  while ( ( CanTrace.Dumped < CanTrace.Count ) && DiagsLogRoom(CANTRACE_ENTRYLEN + 1) )
+  {
+    CanTracePack(CanTrace.Dumped++,entry);
+    DiagsLogData(LOG_CANFRAME,entry,CANTRACE_ENTRYLEN);
+  }
+#endif
+}
+/********************************************************************************************************************************/
+
+#ifdef CANTRACE_ENABLED
+// Runs for every frame at full bus load, so it does no more than copy 8 bytes unless it is the trigger
+void CanTraceFrame(u16 id, u8 dlc, volatile u8 * data, bool tx)
+{
+  if ( ( CanTrace.State != CANTRACE_ARMED ) && ( CanTrace.State != CANTRACE_TRIGGERED ) )
+  {
+    return;
+  }
+  CanTraceAdd( id | ( (u16)dlc << CANTRACE_DLCSHIFT ) | ( tx ? CANTRACE_TX : 0 ), data );
+  if ( ( CanTrace.Trigger == CANTRACETRIG_ID ) && ( id == CanTrace.TriggerId ) )
+  {
+    CanTraceTrigger();
+  }
+}
+/********************************************************************************************************************************/
+
+void CanTraceMark(CANTRACEMARK mark)
+{
+  static u8 none[4];
+
+  if ( ( CanTrace.State != CANTRACE_ARMED ) && ( CanTrace.State != CANTRACE_TRIGGERED ) )
+  {
+    return;
+  }
+  CanTraceAdd( mark | ( (u16)CANTRACE_DLCMARK << CANTRACE_DLCSHIFT ), none );
+  if ( ( ( CanTrace.Trigger == CANTRACETRIG_BUSOFF ) && ( mark == CANTRACEMARK_BUSOFF ) ) ||
+       ( ( CanTrace.Trigger == CANTRACETRIG_ISOTIMEOUT ) && ( mark == CANTRACEMARK_ISOTIMEOUT ) ) )
+  {
+    CanTraceTrigger();
+  }
+}
+/********************************************************************************************************************************/
+
+static void CanTraceAdd(u16 iddlc, volatile u8 * data)
+{
+  TCANTRACEENTRY * entry = &CanTrace.Entry[CanTrace.In];
+
+  entry->Stamp = TimerNowFine();
+  entry->IdDlc = iddlc;
+  entry->Data[0] = data[0];
+  entry->Data[1] = data[1];
+  entry->Data[2] = data[2];
+  entry->Data[3] = data[3];
+  CanTrace.In = ( CanTrace.In + 1 ) & ( CANTRACEENTRIES - 1 );
+  if ( CanTrace.Count < CANTRACEENTRIES )
+  {
+    CanTrace.Count++;
+  }
+  if ( CanTrace.State == CANTRACE_TRIGGERED )
+  {
+    if ( !CanTrace.Post || !--CanTrace.Post )
+    {
+      CanTrace.State = CANTRACE_STOPPED;
+    }
+  }
+}
+/********************************************************************************************************************************/
+
+static void CanTraceTrigger(void)
+{
+  if ( CanTrace.State == CANTRACE_ARMED )
+  {
+    CanTrace.State = CanTrace.Post ? CANTRACE_TRIGGERED : CANTRACE_STOPPED;
+  }
+}
+/********************************************************************************************************************************/
+
+// The index'th oldest entry, little endian whatever the compiler does with the struct
+static void CanTracePack(u8 index, u8 * out)
+{
+  TCANTRACEENTRY * entry = &CanTrace.Entry[( CanTrace.In - CanTrace.Count + index ) & ( CANTRACEENTRIES - 1 )];
+
+  out[0] = entry->Stamp;
+  out[1] = entry->Stamp >> 8;
+  out[2] = entry->IdDlc;
+  out[3] = entry->IdDlc >> 8;
+  out[4] = entry->Data[0];
+  out[5] = entry->Data[1];
+  out[6] = entry->Data[2];
+  out[7] = entry->Data[3];
+}
+/********************************************************************************************************************************/
+
+#endif
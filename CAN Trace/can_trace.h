@@ -0,0 +1,75 @@
+#ifndef CAN_TRACE_H
+#define CAN_TRACE_H
+
+#include "common.h"
+
+// Optional trace of every CAN frame in and out, for when a car misbehaves. Only built in with CANTRACE_ENABLED, the
+// hooks in the CAN driver compile away to nothing otherwise. Recording goes round a RAM ring until the trigger, carries
+// on for the post trigger count and then stops, so the ring holds what led up to it and what came after. It can then
+// be read over the diagnostic ISO channel, and is dumped out of the debug UART as well.
+
+#define CANTRACEENTRIES   16          // power of 2, 8 bytes each out of not much RAM
+
+// One entry, oldest first when read out. Little endian on the UART and over ISO.
+typedef struct
+{
+  u16 Stamp;                          // TimerNowFine(), 0.1ms
+  u16 IdDlc;                          // id in bits 0-10, dlc in 11-14, CANTRACE_TX. A dlc of CANTRACE_DLCMARK is one of ours.
+  u8 Data[4];                         // the first bytes of the frame
+}TCANTRACEENTRY;
+
+#define CANTRACE_TX         0x8000
+#define CANTRACE_DLCSHIFT   11
+#define CANTRACE_DLCMARK    0x0f      // not a real dlc, the id is a CANTRACEMARK
+
+typedef enum
+{
+  CANTRACEMARK_BUSOFF = 1,
+  CANTRACEMARK_ISOTIMEOUT,
+  CANTRACEMARK_OVERRUN              // the controller had frames we didn't get to in time
+}CANTRACEMARK;
+
+typedef enum
+{
+  CANTRACE_OFF,
+  CANTRACE_ARMED,                   // recording, waiting for the trigger
+  CANTRACE_TRIGGERED,               // recording the frames after it
+  CANTRACE_STOPPED                  // full, ready to read
+}CANTRACESTATE;
+
+// Never renumber, a tester sends these
+typedef enum
+{
+  CANTRACETRIG_NONE,                // runs until CanTraceStop()
+  CANTRACETRIG_BUSOFF,
+  CANTRACETRIG_ISOTIMEOUT,
+  CANTRACETRIG_ID,                  // a frame with the given id, either way
+  CANTRACETRIG_END
+}CANTRACETRIG;
+
+#ifdef CANTRACE_ENABLED
+#define CANTRACE_FRAME(id,dlc,data,tx)  CanTraceFrame(id,dlc,data,tx)
+#define CANTRACE_MARK(mark)             CanTraceMark(mark)
+#else
+#define CANTRACE_FRAME(id,dlc,data,tx)
+#define CANTRACE_MARK(mark)
+#endif
+
+// Armed on a bus off, the thing we most want to see the lead up to
+void CanTraceInit(void);
+// Starts a new trace, post is how many entries to keep after the trigger. False if the trigger isn't one we know.
+bool CanTraceArm(u8 trigger, u16 id, u8 post);
+// Stops it where it is
+void CanTraceStop(void);
+CANTRACESTATE CanTraceState(void);
+// How many entries there are to read
+u8 CanTraceCount(void);
+// Copies out up to max entries from the start'th oldest, returns how many
+u8 CanTraceRead(u8 start, u8 * out, u8 max);
+// CAN driver, every frame in or out
+void CanTraceFrame(u16 id, u8 dlc, volatile u8 * data, bool tx);
+void CanTraceMark(CANTRACEMARK mark);
+// Diagnostics task, sends a stopped trace out of the debug UART as the room comes up
+void CanTraceRun(void);
+
+#endif
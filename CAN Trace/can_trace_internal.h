@@ -0,0 +1,27 @@
+#ifndef CAN_TRACE_INTERNAL_H
+#define CAN_TRACE_INTERNAL_H
+
+#include "can_trace.h"
+
+#define CANTRACE_ENTRYLEN     sizeof(TCANTRACEENTRY)
+#define CANTRACE_DEFAULTPOST  ( CANTRACEENTRIES / 4 )
+
+#ifdef CANTRACE_ENABLED
+static void CanTraceAdd(u16 iddlc, volatile u8 * data);
+static void CanTraceTrigger(void);
+static void CanTracePack(u8 index, u8 * out);
+
+static struct
+{
+  TCANTRACEENTRY Entry[CANTRACEENTRIES];
+  u8 In;                            // where the next one goes
+  u8 Count;                         // up to CANTRACEENTRIES
+  u8 State;                         // CANTRACESTATE
+  u8 Trigger;                       // CANTRACETRIG
+  u16 TriggerId;
+  u8 Post;                          // entries still to record once triggered
+  u8 Dumped;                        // how many have gone out of the UART
+}CanTrace;
+#endif
+
+#endif
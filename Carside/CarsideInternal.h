@@ -9,6 +9,13 @@
 #include "iso15765.h"
 #include "string.h"
 #include "vauxhall_stalk.h"
+#include "flash_store.h"
+#include "timer.h"
+#include "events.h"
+#include "speed_pulse.h"
+#include "can_trace.h"
+#include "can_monitor.h"
+#include "radioside.h"
 
 // the following line controls the programming sequence and sets if we are going to program the country code or not.
 //#define PROGRAM_COUNTRY_CODE
@@ -23,15 +30,27 @@
 #define CAN_DIAGS_ISO_RX      0x241
 #define CAN_DIAGS_ISO_TX      0x641
 #define CAN_DIAGS_DTC_TX      0x541
+#define CAN_DIAGS_PERIODIC_TX 0x5c1
 #define CAN_PROG_ISO_TX       0x246
 #define CAN_PROG_ISO_RX       0x646
 #define CAN_TECH2_ID          0x101
 #define CAN_GEAR_SPEED        0x4e8
+
+// local identifiers for write data ( service 0x3b )
+#define DIAG_LID_SPEEDPROFILE 0x50      // [SPEEDPROFILE]
+#define DIAG_LID_STALKVARIANT 0x51      // [STALKVARIANT]
+#define DIAG_LID_STALKMAP     0x52      // upto STALKUSERMAPMAX mappings of STALKMAPLEN bytes, none to clear them
+#define DIAG_LID_STALKGESTURE 0x53      // STALKGESTURELEN bytes of gesture thresholds, none for the defaults
+#define DIAG_LID_CANTRACE     0x60      // [CANTRACETRIG][id hi][id lo][entries after the trigger], read ( 0x21 ) [first]
+#define DIAG_LID_CANTRACESTOP 0x61      // no data
+#define DIAG_LID_CANMONITOR   0x62      // read only, TCANMONITOR big endian
           
 
 
 #define NM_MATCH_ID           0x500
 #define NM_MASK_ID            0x7f0
+#define NM_DISPLAY_NODE       6
+#define NM_PHONE_NODE         7
 
 #ifdef DIAGS_ENABLED
 #define ISOTXQUEUEDEPTH       3
@@ -42,6 +61,33 @@
 #define ISOMAXMESSAGESIZE     128
 #define DISPLAY_REFRESH_TIME  5000  
 #define ISO_TX_DELAY          20
+#define CANQUIETTIME          10000     // no CAN for this long and we can go to sleep
+#define SPEEDFILTER           4         // each speed frame moves the filtered speed this fraction of the way
+#define PARKBRAKE_ON_Q6       ( 4 << 6 )          // 4 km/h
+#define PARKBRAKE_OFF_Q6      ( ( 4 << 6 ) + 32 ) // 4.5 km/h, so it doesn't chatter at the threshold
+
+// bus off recovery. The controller comes back by itself after 128*11 recessive bits ( about 15ms at 95k ), the first bus
+// off we rejoin as soon as it has. Each one after that within BUSOFF_STABLETIME holds us off the bus twice as long again,
+// so a node with a wiring fault doesn't keep knocking the bus over. Still bus off after BUSOFF_STUCKTIME and we start again.
+#define BUSOFF_HOLDMIN        25
+#define BUSOFF_HOLDMAX        400       // short enough for a segmented transfer to carry on afterwards
+#define BUSOFF_STABLETIME     5000
+#define BUSOFF_STUCKTIME      1000
+
+typedef enum
+{
+  BUSOFF_NONE,
+  BUSOFF_HOLD,              // waiting out the backoff
+  BUSOFF_WAIT               // waiting for the controller to come back
+}BUSOFF_STATE;
+
+static struct
+{
+  BUSOFF_STATE State;
+  u8 Count;                 // bus offs without BUSOFF_STABLETIME between them
+  TTimer Timer;
+  TTimer Stable;
+}BusOff;
 
 static const u8 NMDataOff[] = {0x00,0x00,0x00,0x00};
 static const u8 NMDataOn[] = {0x01,0x00,0x40,0x01};
@@ -75,7 +121,7 @@ typedef struct
 
 static struct
 {
-  u32 gap_timer;
+  TTimer gap_timer;
   u8 in;
   u8 out;
   u8 used;
@@ -96,7 +142,7 @@ static const u8 TextStringProgramFailed[] = "PROG FAIL";
 static struct
 {
   char * TextString;
-  u16 OverlayTimer;
+  TTimer OverlayTimer;
 }DisplayText;
 
 // diagnostic packets
@@ -114,10 +160,59 @@ static const u8 DiagPartNumber[] =            {0x5a,0xcb,0x30,0x30,0x30,0x30,0x3
 static const u8 DiagHardwareNumber[] =        {0x5a,0xcc,0x30,0x30,0x30,0x30,0x30,0x30,0x30,0x30,0x30};
 static const u8 DiagAlphaCode[] =             {0x5a,0xdb,'A','A'};
 
+// periodic diagnostic data ( service 0x2a )
+// the tester registers upto PERIODICMAXDIDS identifiers, each at one of three rates. Any identifiers that fall due are packed
+// together into a single UUDT frame on CAN_DIAGS_PERIODIC_TX as [did][data..][did][data..]. Frames are never sent closer
+// together than PERIODIC_FRAME_GAP so we can't flood the bus however the tester sets us up.
+
+#define PERIODICMAXDIDS       4
+#define PERIODIC_FRAME_GAP    10
+#define PERIODIC_RATE_SLOW    1000
+#define PERIODIC_RATE_MEDIUM  250
+#define PERIODIC_RATE_FAST    50
+
+typedef enum
+{
+  PERIODIC_MODE_SLOW = 0x01,
+  PERIODIC_MODE_MEDIUM = 0x02,
+  PERIODIC_MODE_FAST = 0x03,
+  PERIODIC_MODE_STOP = 0x04
+}PERIODIC_MODE;
+
+typedef enum
+{
+  PDID_NONE,
+  PDID_SPEED,               // speed Km/h, 2 bytes
+  PDID_VEHICLE_INPUTS,      // ignition / illumination / reverse / parkbrake bits, display mode
+  PDID_STALK,               // current stalk button, time held in 100ms units
+  PDID_NM,                  // NM status, display and phone kit presence
+  PDID_KEYQUEUE,            // radio key queue depth, max depth, dropped, max latency in 10ms units
+  PDID_CANBUS,              // CAN load %, transmit and receive error counts, bus offs
+  PDID_END
+}PERIODIC_DID;
+
+static const u8 PeriodicDIDLength[PDID_END] = {0,2,2,2,1,4,4};
+
+typedef struct
+{
+  u8 did;
+  u16 rate;
+  TTimer timer;
+  bool due;
+}PERIODIC_ENTRY;
+
+static struct
+{
+  PERIODIC_ENTRY Entry[PERIODICMAXDIDS];
+  TTimer gap_timer;
+}PeriodicDiags;
+
 
 
 static void ProcessPacket(TCANPacket * packet);
 static void ConfigureCAN(void);
+static void BusOffRecovery(void);
+static void DecodeSpeed(TCANPacket * packet);
 static void process_nm(void);
 static void initialise_iso(void);
 static void send_status(void);
@@ -129,49 +224,26 @@ static void process_ISO_packets(void);
 static u8 ISOAddMessageToBuffer( u8 * data, u16 length );
 static void SendDIAGInfoString(u8 string_no);
 static void ProcessDiags(void);
+static void DiagsWriteData(u8 * request, u16 length);
+static void DiagsReadData(u8 * request, u16 length);
+static void PeriodicDiagsRequest(u8 * request, u16 length);
+static void PeriodicDiagsRun(void);
+static u8 PeriodicDiagsFill(u8 did, u8 * data);
 static void ProgrammingStateMachine(void);
 static u8 FindCountryCode (u8 * code);
 static u8 CheckDisplayCompatible (u16 DisplayID);
 static void ForceCANWake(void);
+static void LoadFlashStore(void);
+static u8 WarmBootCheck(void);
+static void IgnitionChanged(EVENT event, u16 value);
+static void NMNodesChanged(EVENT event, u16 value);
 
 typedef enum
 {
   PGM_IGN_OFF,
   PGM_STARTUP,
   PGM_CHECK_DISPLAY_PRESENT,
-  PGM_WAIT_DISPLAY_READY,
-  PGM_GET_IDENTIFIER,
-  PGM_WAIT_IDENTIFIER,
-
-  // mid can config
-  PGM_GET_MIDCANCONFIG1,
-  PGM_WAIT_MIDCANCONFIG1,
-  PGM_GET_MIDCANCONFIG2,
-  PGM_WAIT_MIDCANCONFIG2,
-  PGM_PROGRAMMIDCANSTART,
-  PGM_PROGRAMMIDCANWAIT1,
-  PGM_PROGRAMMIDCANWAIT2,
-  
-#ifdef PROGRAM_COUNTRY_CODE
-// country code
-  PGM_GET_VARIANTCOUNTRYCODE1,
-  PGM_WAIT_VARIANTCOUNTRYCODE1,
-  PGM_GET_VARIANTCOUNTRYCODE2,
-  PGM_WAIT_VARIANTCOUNTRYCODE2,
-  PGM_PROGRAMVARIANTCOUNTRYCODESTART,
-  PGM_PROGRAMVARIANTCOUNTRYCODEWAIT1,
-  PGM_PROGRAMVARIANTCOUNTRYCODEWAIT2,
-#endif
-
-  // radio present
-  PGM_GET_VARIANTEHUPRESENT1,
-  PGM_WAIT_VARIANTEHUPRESENT1,
-  PGM_GET_VARIANTEHUPRESENT2,
-  PGM_WAIT_VARIANTEHUPRESENT2,
-  PGM_PROGRAMVARIANTEHUPRESENTSTART,
-  PGM_PROGRAMVARIANTEHUPRESENTWAIT1,
-  PGM_PROGRAMVARIANTEHUPRESENTWAIT2,
-  
+  PGM_SEQUENCE,             // running through ProgramSteps[], driven by the responses from the display
   PGM_COMPLETE_OK,
   PGM_FAILED,
   
@@ -180,6 +252,87 @@ typedef enum
   PGM_END
 }PROGRAM_STATE;
 
+// The programming sequence. Each step is one request to the display and the response we expect back from it.
+// The next request is sent as soon as the response to the last one arrives, so the display is programmed back to back.
+// The config blocks are handled as one transaction: every block in ProgramBlocks[] is read, all the changes are worked
+// out, then only the blocks that need changing are written, each one read back to verify it.
+typedef enum
+{
+  PSTEP_ARE_YOU_THERE,
+  PSTEP_IDENTIFIER,
+  PSTEP_READ_BLOCK,
+  PSTEP_WRITE_BLOCK,
+  PSTEP_VERIFY_BLOCK,
+
+  PSTEP_END,
+
+  // these finish the sequence rather than being steps in it
+  PSTEP_COMPLETE_OK = PSTEP_END,
+  PSTEP_FAILED,
+  PSTEP_FINISHED
+}PROGRAM_STEP;
+
+#define PGM_RESPONSE_TIMEOUT  2000
+
+typedef struct
+{
+  u8 Request[2];                                        // fixed start of the request
+  u8 RequestLength;                                     // total length of the request when there is no Prepare
+  u8 Response[2];                                       // expected start of the positive response
+  u8 ResponseMatch;                                     // how many bytes of Response[] to check
+  u8 ResponseLength;                                    // exact length of the response, 0 = any length
+  u8 (*Prepare)(u8 * request);                          // builds the rest of the request and returns its length, may be null
+  PROGRAM_STEP (*Transform)(u8 * response, u16 length); // works on the block data and decides the next step, may be null
+  PROGRAM_STEP Next;                                    // next step when there is no Transform
+}PROGRAM_STEP_DEF;
+
+typedef struct
+{
+  u8 Id;                                                // local identifier of the block
+  u8 Length;                                            // data bytes in the block
+  bool (*Modify)(u8 * data);                            // makes the changes we want, returns true if anything changed
+}PROGRAM_BLOCK_DEF;
+
+static PROGRAM_STEP PgmIdentifier(u8 * response, u16 length);
+static u8 PgmPrepareBlockRead(u8 * request);
+static u8 PgmPrepareBlockWrite(u8 * request);
+static PROGRAM_STEP PgmBlockRead(u8 * response, u16 length);
+static PROGRAM_STEP PgmBlockWritten(u8 * response, u16 length);
+static PROGRAM_STEP PgmBlockVerify(u8 * response, u16 length);
+static PROGRAM_STEP PgmNextWrite(void);
+static bool PgmModifyMidCAN(u8 * data);
+#ifdef PROGRAM_COUNTRY_CODE
+static bool PgmModifyCountryCode(u8 * data);
+#endif
+static bool PgmModifyEHUPresent(u8 * data);
+static void ProgrammingNextStep(PROGRAM_STEP next);
+static void ProgrammingStartStep(void);
+static void ProgrammingResponse(void);
+
+static const PROGRAM_STEP_DEF ProgramSteps[PSTEP_END] = {
+  //  request       len  response     match len  prepare                 transform           next
+  { {0x20,0x00},    1,   {0x60,0x00}, 1,    1,   0,                      0,                  PSTEP_IDENTIFIER },                  // are you there
+  { {0x1a,0x9a},    2,   {0x5a,0x9a}, 2,    0,   0,                      PgmIdentifier,      PSTEP_READ_BLOCK },
+  { {0x1a,0x00},    2,   {0x5a,0x00}, 1,    0,   PgmPrepareBlockRead,    PgmBlockRead,       PSTEP_READ_BLOCK },
+  { {0x3b,0x00},    2,   {0x7b,0x00}, 1,    0,   PgmPrepareBlockWrite,   PgmBlockWritten,    PSTEP_VERIFY_BLOCK },
+  { {0x1a,0x00},    2,   {0x5a,0x00}, 1,    0,   PgmPrepareBlockRead,    PgmBlockVerify,     PSTEP_WRITE_BLOCK },
+};
+
+static const PROGRAM_BLOCK_DEF ProgramBlocks[] = {
+  { 0xbb,   2,    PgmModifyMidCAN },            // mid can config
+#ifdef PROGRAM_COUNTRY_CODE
+  { 0x44,   7,    PgmModifyCountryCode },       // variant A, country code
+#endif
+  { 0x4c,   4,    PgmModifyEHUPresent },        // variant B, radio present
+};
+
+#define PGM_NUMBLOCKS     ( sizeof(ProgramBlocks) / sizeof(ProgramBlocks[0]) )
+#define PGM_MAXBLOCKLEN   7
+
+static void PgmStoreConfig(void);
+static bool PgmKnownDisplay(void);
+static bool PgmStoredBlock(u8 block, const u8 * data);
+
 typedef struct
 {
   u8  Code[4];
@@ -223,5 +376,20 @@ typedef enum
   CW_NotRequired,
 }CANWAKESTATE;
 
+// FSK_CAR_VARIANT bits
+#define CARVARIANT_FORCEWAKE  0x01    // the bus didn't come up on its own after an ignition wake, we had to wake it
+
+// What we hand over to ourselves through the reset when we come out of sleep. Only used if Token and Check are good.
+typedef struct
+{
+  u32 Token;                  // WARMBOOTTOKEN
+  u16 NetList;                // NM netlist from when the ring was last running, 0 if it never was
+  u8  CarVariant;
+  u8  Check;
+}WARMBOOTDATA;
+
+// how long the NM ring has to be running before we keep its netlist
+#define NETLISTSAVEDELAY      5000
+
 
 #endif
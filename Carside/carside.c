@@ -25,8 +25,29 @@ static struct
   u8 Buffer[PROGRAMISOBUFFLEN];
   bool Enabled;
 }ProgramISO;
+static struct
+{
+  PROGRAM_STATE State;
+  PROGRAM_STEP Step;
+  bool RequestSent;
+  TTimer Timer;
+  u8 Block;                                   // index into ProgramBlocks[]
+  u8 Dirty;                                   // one bit per block that needs writing
+  u8 Data[PGM_NUMBLOCKS][PGM_MAXBLOCKLEN];
+  u16 DisplayID;
+  bool Known;                                 // this display holds what we left in the last one, so far
+}Pgm;
 static bool ProgramIgnOn = false;
 static u16 CANDataReceived = 0;
+static u8 CarVariant = 0;
+static u16 ActiveNetList = 0;               // netlist while the ring was last running
+static bool CANStarted = false;
+static bool WarmBooted = false;
+static TTimer CANQuiet;                     // runs out after CANQUIETTIME with nothing received
+static TTimer StatusTimer;                  // till the next radio status frame
+static u16 SpeedQ6 = 0;                     // filtered speed, 1/64 km/h
+static u32 SpeedSum = 0;                    // SpeedQ6 * SPEEDFILTER, so the filter keeps its remainder
+__no_init static WARMBOOTDATA WarmBoot;
 
 static const TCANInitData caninitdata =
 {
@@ -56,10 +77,103 @@ static const TCANInitData caninitdata =
 /********************************************************************************************************************************/
 void InitCarSide(void)
 {
-  ConfigureCAN();
+  if ( !CANStarted )
+  {
+    ConfigureCAN();
+  }
+  vaux_nm_init(&NMPlatformVauxhall);
   initialise_iso();
   VauxhallStalkInit();
   DisplayText.TextString = (char*)TextStringPioneer;
+  TimerArm(&CANQuiet,CANQUIETTIME);
+  EventSubscribe(EV_IGNITION,IgnitionChanged);
+  EventSubscribe(EV_NMNODES,NMNodesChanged);
+  LoadFlashStore();
+}
+/********************************************************************************************************************************/
+
+// Warm boot only. Get the CAN controller going before anything else so we ACK the frames that woke us up,
+// InitCarSide() does the rest later.
+void InitCarSideCAN(void)
+{
+  ConfigureCAN();
+  CANStarted = true;
+}
+/********************************************************************************************************************************/
+
+// Returns true if we have come through the reset at the end of our own sleep with good data in WarmBoot.
+// Only answers true once, so a crash later on gets a proper cold start.
+bool CarSideWarmBoot(void)
+{
+  WarmBooted = ( WarmBoot.Token == WARMBOOTTOKEN ) && ( WarmBoot.Check == WarmBootCheck() );
+  WarmBoot.Token = 0;
+  return WarmBooted;
+}
+/********************************************************************************************************************************/
+
+// Called on the way into sleep, everything we want back after the reset goes in here
+void CarSidePrepareWarmBoot(void)
+{
+  WarmBoot.NetList = ActiveNetList;
+  WarmBoot.CarVariant = CarVariant;
+  WarmBoot.Token = WARMBOOTTOKEN;
+  WarmBoot.Check = WarmBootCheck();
+}
+/********************************************************************************************************************************/
+
+static u8 WarmBootCheck(void)
+{
+  u8 * data = (u8*)&WarmBoot;
+  u8 sum = 0;
+  u8 loop;
+
+  for ( loop = 0 ; loop < ( sizeof(WarmBoot) - 1 ) ; loop++ )
+  {
+    sum += data[loop];
+  }
+  return ~sum;
+}
+/********************************************************************************************************************************/
+
+// pick up what we learnt about the car last time round, so we don't have to wait to learn it again.
+// After a warm boot what we had in ram is newer than the flash.
+static void LoadFlashStore(void)
+{
+  u16 netlist;
+  u8 profile;
+  u8 map[STALKUSERMAPMAX * STALKMAPLEN];
+  u8 timing[STALKGESTURELEN];
+  u8 length;
+
+  if ( FlashStoreRead(FSK_SPEED_PROFILE,&profile,sizeof(profile)) == sizeof(profile) )
+  {
+    SpeedPulseProfile(profile);
+  }
+  if ( FlashStoreRead(FSK_STALK_VARIANT,&profile,sizeof(profile)) == sizeof(profile) )
+  {
+    VauxhallStalkVariant(profile);
+  }
+  length = FlashStoreRead(FSK_STALK_MAP,map,sizeof(map));
+  VauxhallStalkUserMap(map,length);
+  length = FlashStoreRead(FSK_STALK_GESTURES,timing,sizeof(timing));
+  VauxhallStalkGestureTiming(timing,length);
+  if ( WarmBooted )
+  {
+    CarVariant = WarmBoot.CarVariant;
+    if ( WarmBoot.NetList )
+    {
+      vaux_nm_seed_netlist(WarmBoot.NetList);
+      return;
+    }
+  }
+  else
+  {
+    FlashStoreRead(FSK_CAR_VARIANT,&CarVariant,sizeof(CarVariant));
+  }
+  if ( FlashStoreRead(FSK_NM_NETLIST,(u8*)&netlist,sizeof(netlist)) == sizeof(netlist) )
+  {
+    vaux_nm_seed_netlist(netlist);
+  }
 }
 /********************************************************************************************************************************/
 
@@ -73,89 +187,117 @@ static void initialise_iso(void)
 }
 /********************************************************************************************************************************/
 
-void CarSide(void)
+// Task, every frame received, transmit report or CAN error gets dealt with here as soon as it turns up
+void CarSideReceive(void)
 {
   TCANPacket pkt;
-  static u16 busofftimer = 0;
+  CANErr err;
 
-  global.sleeptimer++;
-
-  if (busofftimer)
-  {
-    busofftimer --;
-  }
-  
-  pkt.cplen = sizeof(TCANPacket);
-  switch (CANRx(&pkt))
+  can_int(); // pull anything new out of the controller
+  CanMonitorRun();
+  do
   {
-    case CANERR_RX_OK:
-      switch ( pkt.tag >> 8 )
-      {
-      case ISODisplayID:
-        ISO15765_ReportSuccess(&DisplayISO.ChannelData,pkt.tag);
-        break;
-      case ISODiagsID:
-        ISO15765_ReportSuccess(&DiagsISO.ChannelData,pkt.tag);
-        break;
-      case ISOProgramID:
-        if ( ProgramISO.Enabled )
-          ISO15765_ReportSuccess(&ProgramISO.ChannelData,pkt.tag);
+    pkt.cplen = sizeof(TCANPacket);
+    err = CANRx(&pkt);
+    switch (err)
+    {
+      case CANERR_RX_OK:
+        switch ( pkt.tag >> 8 )
+        {
+        case ISODisplayID:
+          ISO15765_ReportSuccess(&DisplayISO.ChannelData,pkt.tag);
+          break;
+        case ISODiagsID:
+          ISO15765_ReportSuccess(&DiagsISO.ChannelData,pkt.tag);
+          break;
+        case ISOProgramID:
+          if ( ProgramISO.Enabled )
+            ISO15765_ReportSuccess(&ProgramISO.ChannelData,pkt.tag);
+          break;
+        }
+        ProcessPacket(&pkt);
+        TimerArm(&CANQuiet,CANQUIETTIME);  // restart as we are receiving CAN
+        CANDataReceived++; // number of packets received
         break;
-      }
-      ProcessPacket(&pkt);
-      global.sleeptimer = 0;      // reset counter as we are receiving CAN
-      CANDataReceived++; // number of packets received
-      break;
-    case CANERR_RX_BUSOFF:
-      if (busofftimer == 0)
-      {
-        ConfigureCAN();
-        busofftimer = 250;
-      }
-      break;
-    case CANERR_RX_BUSERR:
-    case CANERR_RX_INVALIDPKT:
-    case CANERR_RX_NODATA:
-      switch ( pkt.tag >> 8 )
-      {
-      case ISODisplayID:
-        ISO15765_ReportSuccess(&DisplayISO.ChannelData,pkt.tag);
+      case CANERR_RX_BUSOFF:
+        BusOffRecovery();
         break;
-      case ISODiagsID:
-        ISO15765_ReportSuccess(&DiagsISO.ChannelData,pkt.tag);
+      case CANERR_RX_BUSERR:
+      case CANERR_RX_INVALIDPKT:
+      case CANERR_RX_NODATA:
+        switch ( pkt.tag >> 8 )
+        {
+        case ISODisplayID:
+          ISO15765_ReportSuccess(&DisplayISO.ChannelData,pkt.tag);
+          break;
+        case ISODiagsID:
+          ISO15765_ReportSuccess(&DiagsISO.ChannelData,pkt.tag);
+          break;
+        case ISOProgramID:
+          if ( ProgramISO.Enabled )
+            ISO15765_ReportSuccess(&ProgramISO.ChannelData,pkt.tag);
+          break;
+        }
         break;
-      case ISOProgramID:
-        if ( ProgramISO.Enabled )
-          ISO15765_ReportSuccess(&ProgramISO.ChannelData,pkt.tag);
+      case CANERR_RX_OVRUN:
+      case CANERR_RX_TXTIMEOUT:
+      default:
         break;
-      }
-      break;
-    case CANERR_RX_OVRUN:
-    case CANERR_RX_TXTIMEOUT:
-    default:
-      break;
-  }
-  if ( (global.sleeptimer >= 10000) )   // 10 seconds of no CAN data
+    }
+  } while ( ( err == CANERR_RX_OK ) || ( ( err == CANERR_RX_NODATA ) && pkt.tag ) ); // until there is nothing left to report
+}
+/********************************************************************************************************************************/
+
+// Task, tick
+void CarSideNM(void)
+{
+  if ( !TimerRunning(&CANQuiet) )   // 10 seconds of no CAN data
   {
     global.ignition = 0;
+    EventPublish(EV_IGNITION,global.ignition);
     if ( vaux_nm_status() == NME_SLEEPING )
     {
-      global.sleeptimer = 0;
+      TimerArm(&CANQuiet,CANQUIETTIME);
       global.sleep = 1;
     }
   }
 
   vaux_nm_1ms();
   process_nm();
+}
+/********************************************************************************************************************************/
+
+// Task, tick
+void CarSideISO(void)
+{
   ISO15765_RunCycle(&DisplayISO.ChannelData);
   ISO15765_RunCycle(&DiagsISO.ChannelData);
   if ( ProgramISO.Enabled )
     ISO15765_RunCycle(&ProgramISO.ChannelData);
+}
+/********************************************************************************************************************************/
+
+// Task, tick
+void CarSideDiags(void)
+{
+  ProcessDiags();
+  PeriodicDiagsRun();
+  CanTraceRun();
+}
+/********************************************************************************************************************************/
+
+// Task, tick
+void CarSideDisplay(void)
+{
   send_status();
   display_text();
   process_ISO_packets();
-  ProcessDiags();
-  VauxhallStalkSide();
+}
+/********************************************************************************************************************************/
+
+// Task, tick
+void CarSideProgramming(void)
+{
   ProgrammingStateMachine();
   ForceCANWake();
 }
@@ -199,6 +341,8 @@ static void ProcessPacket( TCANPacket * packet )
     {
       global.illumination = 0;
     }
+    EventPublish(EV_IGNITION,global.ignition);
+    EventPublish(EV_ILLUMINATION,global.illumination);
     break;
   case CAN_RADIO_ISO_RX:
     ISO15765_ProcessPkt(&DisplayISO.ChannelData,packet);
@@ -215,19 +359,10 @@ static void ProcessPacket( TCANPacket * packet )
     {
       global.reverse = 0;
     }
-    global.speed = (packet->data[4] <<1);  // speed in Km/h
-    if (packet->data[5] & 0x80)
-    {
-      global.speed |= 0x0001;
-    }
-    if (global.speed <= 0x03)           // No Parkbrake data, so we'll apply parkbrake below 4km/h
-    {
-      global.parkbrake = 1;
-    }
-    else
-    {
-      global.parkbrake = 0;
-    }
+    DecodeSpeed(packet);
+    EventPublish(EV_REVERSE,global.reverse);
+    EventPublish(EV_SPEED,SpeedQ6);
+    EventPublish(EV_PARKBRAKE,global.parkbrake);
     break;
   case CAN_STALK_ID:
     process_stalk_packet(packet);
@@ -237,7 +372,10 @@ static void ProcessPacket( TCANPacket * packet )
     break;
   case CAN_PROG_ISO_RX:
     if ( ProgramISO.Enabled )
+    {
       ISO15765_ProcessPkt(&ProgramISO.ChannelData,packet);
+      ProgrammingResponse();
+    }
     break;
   default:
     break;
@@ -245,6 +383,93 @@ static void ProcessPacket( TCANPacket * packet )
 }
 /********************************************************************************************************************************/
 
+// data[4..5] is speed in 1/128 km/h. It is filtered down to 1/64 km/h to take out the jitter between frames.
+static void DecodeSpeed(TCANPacket * packet)
+{
+  u16 raw = ( ( (u16)packet->data[4] << 8 ) | packet->data[5] ) >> 1;
+
+  if ( !raw )
+  {
+    SpeedSum = 0;                       // stopped means stopped, don't let the filter creep the pulses out
+  }
+  else
+  {
+    SpeedSum += raw - SpeedSum / SPEEDFILTER;
+  }
+  SpeedQ6 = SpeedSum / SPEEDFILTER;   // settles on exactly raw, the remainder is never thrown away
+  global.speed = SpeedQ6 >> 6;        // speed in Km/h
+
+  // No Parkbrake data, so we'll apply parkbrake below 4km/h
+  if ( SpeedQ6 < PARKBRAKE_ON_Q6 )
+  {
+    global.parkbrake = 1;
+  }
+  else if ( SpeedQ6 >= PARKBRAKE_OFF_Q6 )
+  {
+    global.parkbrake = 0;
+  }
+}
+/********************************************************************************************************************************/
+
+// Called for as long as CANRx() reports bus off, once it has handed over everything received. Only transmit is held, nothing
+// is flushed and whatever was queued goes once we are back on.
+static void BusOffRecovery(void)
+{
+  u16 hold;
+
+  switch ( BusOff.State )
+  {
+  case BUSOFF_NONE:
+    if ( !TimerRunning(&BusOff.Stable) )
+    {
+      BusOff.Count = 0;
+    }
+    if ( BusOff.Count < 0xff )
+    {
+      BusOff.Count++;
+    }
+    hold = 0;
+    if ( BusOff.Count > 1 )
+    {
+      hold = BUSOFF_HOLDMAX;
+      if ( ( BusOff.Count < 10 ) && ( ( BUSOFF_HOLDMIN << ( BusOff.Count - 2 ) ) < BUSOFF_HOLDMAX ) )
+      {
+        hold = BUSOFF_HOLDMIN << ( BusOff.Count - 2 );
+      }
+      TimerArm(&BusOff.Timer,hold);
+      BusOff.State = BUSOFF_HOLD;
+    }
+    else
+    {
+      TimerArm(&BusOff.Timer,BUSOFF_STUCKTIME);
+      BusOff.State = BUSOFF_WAIT;
+    }
+    DiagsLog(LOG_BUSOFF,BusOff.Count,hold);
+    break;
+  case BUSOFF_HOLD:
+    if ( !TimerRunning(&BusOff.Timer) )
+    {
+      TimerArm(&BusOff.Timer,BUSOFF_STUCKTIME);
+      BusOff.State = BUSOFF_WAIT;
+    }
+    break;
+  case BUSOFF_WAIT:
+    if ( CANBusOffRecover() == CANERR_BUSOFF_RECOVERED )
+    {
+      TimerArm(&BusOff.Stable,BUSOFF_STABLETIME);
+      BusOff.State = BUSOFF_NONE;
+    }
+    else if ( !TimerRunning(&BusOff.Timer) )
+    {
+      ConfigureCAN();
+      TimerArm(&BusOff.Stable,BUSOFF_STABLETIME);
+      BusOff.State = BUSOFF_NONE;
+    }
+    break;
+  }
+}
+/********************************************************************************************************************************/
+
 static void ConfigureCAN(void)
 {
 
@@ -262,22 +487,40 @@ static void ConfigureCAN(void)
 }
 /******************************************************************************************/
 
-static void process_nm(void)
+static void IgnitionChanged(EVENT event, u16 value)
 {
-  static bool old_ign = false;
-  
-  if ( global.ignition && !old_ign )
+  vaux_nm_cmd( value ? NMC_WAKE : NMC_SLEEP );
+  TimerStop(&StatusTimer); // force the change out now
+}
+/******************************************************************************************/
+
+// The display has gone, so anything still queued for it would only be ISO retries into nothing. When it comes back
+// it gets the text straight away rather than at the next refresh.
+static void NMNodesChanged(EVENT event, u16 value)
+{
+  static u16 last = 0;
+
+  if ( ( last & ~value ) & ( 1 << NM_DISPLAY_NODE ) )
   {
-    old_ign = true;
-    vaux_nm_cmd(NMC_WAKE);
+    ISOTxMessageQueue.out = ISOTxMessageQueue.in;
+    ISOTxMessageQueue.used = 0;
   }
-  else if ( !global.ignition && old_ign )
+  else if ( ( value & ~last ) & ( 1 << NM_DISPLAY_NODE ) )
   {
-    old_ign = false;
-    vaux_nm_cmd(NMC_SLEEP);
+    vauxhall_display.text_refresh = true;
   }
+  last = value;
+}
+/******************************************************************************************/
+
+static void process_nm(void)
+{
+  static TTimer netlist_timer;
+  static bool netlist_saved = false;
+  u16 netlist;
 
-  if ( vaux_node_avail(6) && ( vaux_nm_status() == NME_ACTIVE ) )
+  EventPublish(EV_NMNODES,vaux_nm_present());
+  if ( vaux_node_present(NM_DISPLAY_NODE) && ( vaux_nm_status() == NME_ACTIVE ) )
   {
     vauxhall_display.display_on = true;
   }
@@ -286,7 +529,7 @@ static void process_nm(void)
     vauxhall_display.display_on = false;
     vauxhall_display.display_ready = false;
   }
-  if ( vaux_node_avail(7) && ( vaux_nm_status() == NME_ACTIVE ) )
+  if ( vaux_node_present(NM_PHONE_NODE) && ( vaux_nm_status() == NME_ACTIVE ) )
   {
     global.phone_kit_present = true;
   }
@@ -294,32 +537,47 @@ static void process_nm(void)
   {
     global.phone_kit_present = false;
   }
+
+  // once the ring has settled keep the netlist for next time, the store only writes it if it has changed
+  if ( vaux_nm_status() == NME_ACTIVE )
+  {
+    ActiveNetList = vaux_nm_netlist();
+    if ( !netlist_saved )
+    {
+      if ( TimerExpired(&netlist_timer) )
+      {
+        netlist = vaux_nm_netlist();
+        FlashStoreWrite(FSK_NM_NETLIST,(u8*)&netlist,sizeof(netlist));
+        netlist_saved = true;
+      }
+      else if ( !TimerRunning(&netlist_timer) )
+      {
+        TimerArm(&netlist_timer,NETLISTSAVEDELAY);
+      }
+    }
+  }
+  else
+  {
+    TimerStop(&netlist_timer);
+    netlist_saved = false;
+  }
 }
 /******************************************************************************************/
 
 static void send_status(void)
 {
   TCANPacket pkt;
-  static u16 status_timer;
-  static u8 old_radio_on;
 
   pkt.cplen = sizeof(TCANPacket);
 
   if ( vaux_nm_status() != NME_ACTIVE )
   {
-    status_timer = 0;
+    TimerStop(&StatusTimer);
     return;
   }
 
-  if ( global.ignition != old_radio_on ) // need to send the change
-  {
-    status_timer = 0; // force the change out now
-    old_radio_on = global.ignition;
-  }
-
-  if ( status_timer )
+  if ( TimerRunning(&StatusTimer) )
   {
-    status_timer--;
     return;
   }
 
@@ -342,19 +600,15 @@ static void send_status(void)
   }
   // send the packet
   CANTx(&pkt);
-  status_timer = 2500;
+  TimerArm(&StatusTimer,2500);
 }
 /******************************************************************************************/
 
 static void display_text(void)
 {
-  static u16 refresh_timer;
+  static TTimer refresh_timer;
 
-  if ( DisplayText.OverlayTimer )
-  {
-    DisplayText.OverlayTimer--;
-  }
-  else
+  if ( !TimerRunning(&DisplayText.OverlayTimer) )
   {
     DisplayText.TextString = (char*)TextStringPioneer;
   }
@@ -364,18 +618,16 @@ static void display_text(void)
   }
   if ( global.ignition )
   {
-    refresh_timer++;
-
     if ( strcmp( (char*)vauxhall_display.output_text,DisplayText.TextString ) )
     {
       strcpy((char*)vauxhall_display.output_text,DisplayText.TextString);
-      refresh_timer = 0;
+      TimerArm(&refresh_timer,DISPLAY_REFRESH_TIME);
       vauxhall_display.text_changed = true;
       vauxhall_display.text_refresh = false;
     }
-    if ( refresh_timer > DISPLAY_REFRESH_TIME )
+    if ( !TimerRunning(&refresh_timer) )
     {
-      refresh_timer = 0;
+      TimerArm(&refresh_timer,DISPLAY_REFRESH_TIME);
       vauxhall_display.text_refresh = true;
     }
 
@@ -478,7 +730,7 @@ static void  process_can_display_mode(TCANPacket * canpkt)
   }
   else
     global.display_mode = DISPLAY_MODE_RADIO;
-
+  EventPublish(EV_DISPLAY_MODE,global.display_mode);
 
 }
 /******************************************************************************************/
@@ -509,15 +761,11 @@ static void process_ISO_packets(void)
     if ( ISO15765_Status(&DisplayISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
     {
       ISOTxMessageQueue.iso_state = ISOTX_WAIT_TIMER;
-      ISOTxMessageQueue.gap_timer = ISO_TX_DELAY;
+      TimerArm(&ISOTxMessageQueue.gap_timer,ISO_TX_DELAY);
     }
     break;
   case ISOTX_WAIT_TIMER:
-    if ( ISOTxMessageQueue.gap_timer )
-    {
-      ISOTxMessageQueue.gap_timer--;
-    }
-    else
+    if ( !TimerRunning(&ISOTxMessageQueue.gap_timer) )
     {
       ISOTxMessageQueue.iso_state = ISOTX_IDLE;
     }
@@ -683,6 +931,15 @@ static void ProcessDiags(void)
       ISO15765_ChTx ( &DiagsISO.ChannelData,DiagsISO.Buffer, 1);
     }
     break;
+  case 0x21: // read data by local identifier
+    DiagsReadData(DiagsISO.Buffer, length);
+    break;
+  case 0x2a: // periodic data
+    PeriodicDiagsRequest(DiagsISO.Buffer, length);
+    break;
+  case 0x3b: // write data by local identifier
+    DiagsWriteData(DiagsISO.Buffer, length);
+    break;
   case 0xa9: // DTC    
     if ( (DiagsISO.Buffer[1] == 0x81) && (DiagsISO.Buffer[2] == 0x12) )
     {
@@ -698,672 +955,515 @@ static void ProcessDiags(void)
 }
 /******************************************************************************************/
 
-static void ProgrammingStateMachine(void)
+static void DiagsWriteData(u8 * request, u16 length)
 {
-  static PROGRAM_STATE PgmState = PGM_IGN_OFF;
-  static PROGRAM_STATE DelayReturnState;
-  static u16 DelayTimer;
-  static u8 Config[10];
-  u8 ConfigTemp;
-  
-  __no_init static u32 PowerOnDetect;
-  u16 id;
-  u8 * pkt = 0;
-  u16 RxLength = 0;
-  
-  if ( (PgmState != PGM_END) && !ProgramIgnOn )
-  {
-    PgmState = PGM_IGN_OFF;
-    ProgramISO.Enabled = false;    
-  }
+  u8 error;
 
-  if ( (ISO15765_IsPacketWaiting(&ProgramISO.ChannelData)) && (ProgramISO.Enabled) )
+  // request is [0x3b][lid][data]..
+  if ( length < 2 )
   {
-    //clear the rx channel
-    ISO15765_Rx (&ProgramISO.ChannelData, &id , pkt, &RxLength);
+    error = 0x13; // incorrect message length
   }
-  
-  switch ( PgmState )
+  else
   {
-//************************************************
-  case PGM_IGN_OFF:
-    if ( ProgramIgnOn )
-    {
-      PgmState = PGM_STARTUP;
-      DEBUG("PSM Ign On\r\n");
-      DelayTimer = 4000;
-      PgmState = PGM_DELAY;
-      DelayReturnState = PGM_STARTUP;
-    }   
-    break;
-//************************************************
-  case PGM_STARTUP:
-    // OK first we need to see if this was a power on reset
-    if ( PowerOnDetect == 0xcafed00d )
-    {
-      DEBUG("PSM Already Run\r\n");
-      PgmState = PGM_FINISHED;
-    }
-    else
-    {
-      PowerOnDetect = 0xcafed00d;
-      DelayTimer = 2000;
-      PgmState = PGM_CHECK_DISPLAY_PRESENT;
-      DEBUG("PSM Start\r\n");
-      DEBUG("ISO Programming Channel Init\r\n");
-      ISO15765_Connect (&ProgramISO.ChannelData,ISOProgramID,CAN_PROG_ISO_TX, CAN_PROG_ISO_RX,ProgramISO.Buffer,PROGRAMISOBUFFLEN,ISODIR_BI);
-      ProgramISO.Enabled = true;
-    }
-    break;
-//************************************************
-  case PGM_CHECK_DISPLAY_PRESENT:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      // timeout
-      PgmState = PGM_FINISHED;
-      DEBUG("PSM Error. Display Not Found\r\n");
-    }
-    if ( vaux_node_avail(6) && ( vaux_nm_status() == NME_ACTIVE ) )
+    switch ( request[1] )
     {
-      // the display is present and the NM is active
-      ProgramISO.Buffer[0] = 0x20;
-      if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+    case DIAG_LID_SPEEDPROFILE:
+      if ( length != 3 )
       {
-        // Are You There
-        ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 1);
-        PgmState = PGM_WAIT_DISPLAY_READY;
-        DelayTimer = 2000;
+        error = 0x13;
       }
-    }
-    break;
-//************************************************
-   case PGM_WAIT_DISPLAY_READY:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to AYT?\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( ( RxLength != 1 ) || ( ProgramISO.Buffer[0] != 0x60 ) )
+      else if ( !SpeedPulseProfile(request[2]) )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to AYT?\r\n");    
+        error = 0x31; // request out of range
       }
       else
       {
-        // everything is OK so we need to get the display's information so we know if its the correct one before programming it
-        PgmState = PGM_GET_IDENTIFIER;
+        error = FlashStoreWrite(FSK_SPEED_PROFILE,&request[2],1) ? 0 : 0x72; // general programming failure
       }
-    }
-    break;
-//************************************************
-  case PGM_GET_IDENTIFIER:
-    // the display is present and the NM is active
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0x9a;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
-    {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_IDENTIFIER;
-      DelayTimer = 2000;
-    }
-    break;
-//************************************************
-  case PGM_WAIT_IDENTIFIER:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Identifier?\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0x9a) )
+      break;
+    case DIAG_LID_STALKVARIANT:
+      if ( length != 3 )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Identifier\r\n");    
+        error = 0x13;
+      }
+      else if ( !VauxhallStalkVariant(request[2]) )
+      {
+        error = 0x31;
       }
       else
       {
-        // is this the correct identifier
-        if (  CheckDisplayCompatible( (((u16)ProgramISO.Buffer[2])<<8) + ProgramISO.Buffer[3]) == 0xff )
-        {
-          PgmState = PGM_FINISHED;
-//          DisplayText.TextString = (char*)TextStringUnknownDisplay;
-//          DisplayText.OverlayTimer = 5000;
-          DEBUG("PSM Error. Incorrect Display Found\r\n");    
-        }
-        else
-        {
-          DEBUG("PSM Found Display with known identifier\r\n");    
-          PgmState = PGM_GET_MIDCANCONFIG1;
-        }        
+        error = FlashStoreWrite(FSK_STALK_VARIANT,&request[2],1) ? 0 : 0x72;
       }
-    }
-    break;
-//************************************************
-  case PGM_GET_MIDCANCONFIG1:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0xbb;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
-    {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_MIDCANCONFIG1;
-      DelayTimer = 2000;
-    }
-    break;
-//************************************************
-  case PGM_WAIT_MIDCANCONFIG1:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Mid CAN Config\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0xbb) )
+      break;
+    case DIAG_LID_STALKMAP:
+      if ( ( ( length - 2 ) % STALKMAPLEN ) || ( ( length - 2 ) > ( STALKUSERMAPMAX * STALKMAPLEN ) ) )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Mid CAN Config\r\n");    
+        error = 0x13;
       }
-      else
+      else if ( !VauxhallStalkUserMap(&request[2],length - 2) )
       {
-        // check the mid can config
-        Config[0] = ProgramISO.Buffer[2];
-        Config[1] = ProgramISO.Buffer[3];
-        PgmState = PGM_GET_MIDCANCONFIG2;
+        error = 0x31;
       }
-    }
-    break;
-//************************************************
-  case PGM_GET_MIDCANCONFIG2:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0xbb;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
-    {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_MIDCANCONFIG2;
-      DelayTimer = 2000;
-    }
-    break;
-//************************************************
-  case PGM_WAIT_MIDCANCONFIG2:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Mid CAN Config2\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0xbb) )
+      else
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Mid CAN Config\r\n");    
+        error = FlashStoreWrite(FSK_STALK_MAP,&request[2],length - 2) ? 0 : 0x72;
       }
-      else
+      break;
+    case DIAG_LID_STALKGESTURE:
+      if ( ( length != 2 ) && ( length != ( STALKGESTURELEN + 2 ) ) )
       {
-        // check the mid can config
-        if ( ( Config[0] == ProgramISO.Buffer[2] ) && ( Config[1] == ProgramISO.Buffer[3] ) )
-        {
-          if ( ProgramISO.Buffer[2] & 0x02 )
-          {
-#ifdef PROGRAM_COUNTRY_CODE
-            PgmState = PGM_GET_VARIANTCOUNTRYCODE1;
-#else
-            PgmState = PGM_GET_VARIANTEHUPRESENT1;
-#endif
-            DEBUG("PSM Mid CAN EHU Present\r\n");    
-          }
-          else
-          {
-            DEBUG("PSM Mid CAN EHU Not Present\r\n");    
-            PgmState = PGM_PROGRAMMIDCANSTART;
-          }
-        }
-        else
-        {
-          PgmState = PGM_FAILED;
-          DEBUG("PSM Error. Mid CAN Config read error\r\n");    
-        }
+        error = 0x13;
       }
-    }
-    break;
-//************************************************
-  case PGM_PROGRAMMIDCANSTART:
-    ProgramISO.Buffer[0] = 0x3b;
-    ProgramISO.Buffer[1] = 0xbb;
-    ProgramISO.Buffer[2] = Config[0] | 0x02;
-    ProgramISO.Buffer[3] = Config[1];
-    
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
-    {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 4);
-      PgmState = PGM_PROGRAMMIDCANWAIT1;
-      DelayTimer = 2000;
-    }
-    break;
-//************************************************
-  case PGM_PROGRAMMIDCANWAIT1:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Mid CAN Program\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x7f) || (ProgramISO.Buffer[1]!=0x3b) || (ProgramISO.Buffer[2]!=0x78) )
+      else if ( !VauxhallStalkGestureTiming(&request[2],length - 2) )
       {
-        DEBUG("PSM Error. Invalid Response to Mid CAN Program\r\n");
-        PgmState = PGM_FAILED;
+        error = 0x31;
       }
       else
       {
-        PgmState = PGM_PROGRAMMIDCANWAIT2;
-        DelayTimer = 2000;
+        error = FlashStoreWrite(FSK_STALK_GESTURES,&request[2],length - 2) ? 0 : 0x72;
       }
-    }
-    break;
-//************************************************
-  case PGM_PROGRAMMIDCANWAIT2:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response 2 to Mid CAN Program\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x7b) || (ProgramISO.Buffer[1]!=0xbb) )
+      break;
+    case DIAG_LID_CANTRACE:
+      if ( length != 6 )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Mid CAN Program Failed\r\n");    
+        error = 0x13;
       }
       else
       {
-#ifdef PROGRAM_COUNTRY_CODE
-        PgmState = PGM_GET_VARIANTCOUNTRYCODE1;
-#else
-        PgmState = PGM_GET_VARIANTEHUPRESENT1;
-#endif
-        DEBUG("PSM Mid CAN Program Successful\r\n");    
-      }
-    }
-    break;
-//************************************************
-#ifdef PROGRAM_COUNTRY_CODE
-  case PGM_GET_VARIANTCOUNTRYCODE1:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0x44;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
-    {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_VARIANTCOUNTRYCODE1;
-      DelayTimer = 2000;
-    }
-    break;
-//************************************************
-  case PGM_WAIT_VARIANTCOUNTRYCODE1:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-    {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant Country Code\r\n");
-    }
-    if ( RxLength ) // we have received a packet
-    {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0x44) )
-      {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Variant Country Code\r\n");    
+        error = CanTraceArm(request[2],( (u16)request[3] << 8 ) | request[4],request[5]) ? 0 : 0x31;
       }
-      else if ( RxLength == 9 )
+      break;
+    case DIAG_LID_CANTRACESTOP:
+      if ( length != 2 )
       {
-        // check the mid can config
-        memcpy(Config,&ProgramISO.Buffer[2],7);
-        PgmState = PGM_GET_VARIANTCOUNTRYCODE2;
+        error = 0x13;
       }
       else
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Data Length for Variant Country Code\r\n");    
+        CanTraceStop();
+        error = 0;
       }
+      break;
+    default:
+      error = 0x31;
+      break;
     }
-    break;
-//************************************************
-  case PGM_GET_VARIANTCOUNTRYCODE2:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0x44;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  }
+
+  if ( ISO15765_Status(&DiagsISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  {
+    if ( error )
     {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_VARIANTCOUNTRYCODE2;
-      DelayTimer = 2000;
+      request[2] = error;
+      request[1] = 0x3b;
+      request[0] = 0x7f;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, 3);
     }
-    break;
-//************************************************
-  case PGM_WAIT_VARIANTCOUNTRYCODE2:
-    if ( DelayTimer )
-      DelayTimer--;
     else
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant Country Code 2\r\n");
+      request[0] = 0x7b;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, 2);
     }
-    if ( RxLength ) // we have received a packet
+  }
+}
+/******************************************************************************************/
+
+// The CAN trace is read a page at a time, as many entries from the first asked for as fit in the buffer. The CAN
+// monitor comes back whole.
+static void DiagsReadData(u8 * request, u16 length)
+{
+  u8 count;
+  const TCANMONITOR * bus;
+
+  // request is [0x21][lid][data]..
+  if ( length < 2 )
+  {
+    request[2] = 0x13; // incorrect message length
+    length = 0;
+  }
+  else
+  {
+    switch ( request[1] )
     {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0x44) )
+    case DIAG_LID_CANTRACE:
+      if ( length != 3 )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Variant Country Code 2\r\n");    
+        request[2] = 0x13;
+        length = 0;
       }
       else
       {
-        // check the variant A config
-        if ( !memcmp(Config,&ProgramISO.Buffer[2],7) ) // the data is the same
-        {
-          // no we need to check the country code
-          ConfigTemp=FindCountryCode(&ProgramISO.Buffer[5]);
-          if ( ConfigTemp == 0xff )
-          {
-            DEBUG("PSM Variant Country Code Invalid\r\n");    
-            PgmState = PGM_PROGRAMVARIANTCOUNTRYCODESTART;
-          }
-          else if ( ConfigTemp == 0x00 ) // no country code set
-          {
-            DEBUG("PSM Variant Country Code = Other / No Radio\r\n");    
-            PgmState = PGM_PROGRAMVARIANTCOUNTRYCODESTART;
-          }
-          else
-          {
-            PgmState = PGM_GET_VARIANTEHUPRESENT1;
-            DEBUG("PSM Variant Country Code Valid. Country = ");
-            DEBUG((char*)Country[ConfigTemp].Name);
-            DEBUG("\r\n");
-          }
-        }
-        else
-        {
-          PgmState = PGM_FAILED;
-          DEBUG("PSM Error. Variant Country Code read error\r\n");    
-        }
+        // reply is [0x61][lid][CANTRACESTATE][entries held][first][TCANTRACEENTRY]..
+        count = CanTraceRead(request[2],&request[5],( DIAGSISOBUFFLEN - 5 ) / sizeof(TCANTRACEENTRY));
+        request[4] = request[2];
+        request[3] = CanTraceCount();
+        request[2] = CanTraceState();
+        length = 5 + ( count * sizeof(TCANTRACEENTRY) );
       }
+      break;
+    case DIAG_LID_CANMONITOR:
+      bus = CanMonitor();
+      request[2] = bus->Load;
+      request[3] = bus->PeakLoad;
+      request[4] = bus->Frames >> 8;
+      request[5] = bus->Frames;
+      request[6] = bus->Tec;
+      request[7] = bus->Rec;
+      request[8] = bus->PeakTec;
+      request[9] = bus->PeakRec;
+      request[10] = bus->BusOffs >> 8;
+      request[11] = bus->BusOffs;
+      request[12] = bus->LastRecovery >> 8;
+      request[13] = bus->LastRecovery;
+      request[14] = bus->MaxRecovery >> 8;
+      request[15] = bus->MaxRecovery;
+      request[16] = bus->Overruns >> 8;
+      request[17] = bus->Overruns;
+      length = 18;
+      break;
+    default:
+      request[2] = 0x31; // request out of range
+      length = 0;
+      break;
     }
-    break;
-//************************************************
-  case PGM_PROGRAMVARIANTCOUNTRYCODESTART:
-    ProgramISO.Buffer[0] = 0x3b;
-    ProgramISO.Buffer[1] = 0x44;
+  }
 
-    
-    ProgramISO.Buffer[2] = Config[0];
-    ProgramISO.Buffer[3] = Config[1];
-    ProgramISO.Buffer[4] = Config[2];
-    ProgramISO.Buffer[5] = 0x33;
-    ProgramISO.Buffer[6] = 0x00;
-    ProgramISO.Buffer[7] = 0x00;
-    ProgramISO.Buffer[8] = 0x10; // we will set this to UK
-    
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  if ( ISO15765_Status(&DiagsISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  {
+    if ( !length )
     {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 9);
-      PgmState = PGM_PROGRAMVARIANTCOUNTRYCODEWAIT1;
-      DelayTimer = 2000;
+      request[1] = 0x21;
+      request[0] = 0x7f;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, 3);
     }
-    break;
-//************************************************
-  case PGM_PROGRAMVARIANTCOUNTRYCODEWAIT1:
-    if ( DelayTimer )
-      DelayTimer--;
     else
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant Country Code Program\r\n");
+      request[0] = 0x61;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, length);
     }
-    if ( RxLength ) // we have received a packet
+  }
+}
+/******************************************************************************************/
+
+static void PeriodicDiagsRequest(u8 * request, u16 length)
+{
+  u8 loop, slot, needed, empty;
+  u16 rate;
+
+  // request is [0x2a][mode][did][did]...
+  if ( length < 2 )
+  {
+    request[2] = 0x13; // incorrect message length
+  }
+  else if ( request[1] == PERIODIC_MODE_STOP )
+  {
+    for ( slot = 0 ; slot < PERIODICMAXDIDS ; slot++ )
     {
-      if ( (ProgramISO.Buffer[0]!=0x7f) || (ProgramISO.Buffer[1]!=0x3b) || (ProgramISO.Buffer[2]!=0x78) )
+      if ( ( length == 2 ) || memchr( &request[2], PeriodicDiags.Entry[slot].did, length-2 ) )
       {
-        DEBUG("PSM Error. Invalid Response to Variant Country Code Program\r\n");
-        PgmState = PGM_FAILED;
-      }
-      else
-      {
-        PgmState = PGM_PROGRAMVARIANTCOUNTRYCODEWAIT2;
-        DelayTimer = 2000;
+        PeriodicDiags.Entry[slot].did = PDID_NONE;
       }
     }
-    break;
-//************************************************
-  case PGM_PROGRAMVARIANTCOUNTRYCODEWAIT2:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
+    request[2] = 0;
+  }
+  else
+  {
+    switch ( request[1] )
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response 2 to Variant Country Code Program\r\n");
+    case PERIODIC_MODE_SLOW:
+      rate = PERIODIC_RATE_SLOW;
+      break;
+    case PERIODIC_MODE_MEDIUM:
+      rate = PERIODIC_RATE_MEDIUM;
+      break;
+    case PERIODIC_MODE_FAST:
+      rate = PERIODIC_RATE_FAST;
+      break;
+    default:
+      rate = 0;
+      break;
     }
-    if ( RxLength ) // we have received a packet
+    request[2] = ( length > 2 ) ? 0 : 0x13;
+    needed = 0;
+    for ( loop = 2 ; ( loop < length ) && !request[2] ; loop++ )
     {
-      if ( (ProgramISO.Buffer[0]!=0x7b) || (ProgramISO.Buffer[1]!=0x44) )
+      if ( ( request[loop] == PDID_NONE ) || ( request[loop] >= PDID_END ) || !rate )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Variant Country Code Program Failed\r\n");    
+        request[2] = 0x31; // request out of range
       }
-      else
+      else if ( !memchr( &request[2], request[loop], loop-2 ) )
       {
-        PgmState = PGM_GET_VARIANTEHUPRESENT1;
-        DEBUG("PSM Varaint Country Code Program Successful\r\n");    
+        // a new identifier needs a slot of its own, one already running keeps its slot
+        for ( slot = 0 ; ( slot < PERIODICMAXDIDS ) && ( PeriodicDiags.Entry[slot].did != request[loop] ) ; slot++ );
+        if ( slot == PERIODICMAXDIDS )
+        {
+          needed++;
+        }
       }
     }
-    break;
-#endif
-
-    
-//************************************************
-  case PGM_GET_VARIANTEHUPRESENT1:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0x4c;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+    empty = 0;
+    for ( slot = 0 ; slot < PERIODICMAXDIDS ; slot++ )
     {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_VARIANTEHUPRESENT1;
-      DelayTimer = 2000;
+      if ( PeriodicDiags.Entry[slot].did == PDID_NONE )
+      {
+        empty++;
+      }
     }
-    break;
-//************************************************
-  case PGM_WAIT_VARIANTEHUPRESENT1:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
+    if ( ( needed > empty ) && !request[2] )
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant EHU Present\r\n");
+      request[2] = 0x31; // no room left for them all
     }
-    if ( RxLength ) // we have received a packet
+    // only touch the table once we know the whole request is good
+    for ( loop = 2 ; ( loop < length ) && !request[2] ; loop++ )
     {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0x4c) )
+      // reuse the slot if this identifier is already running, else find an empty one
+      for ( slot = 0 ; ( slot < PERIODICMAXDIDS ) && ( PeriodicDiags.Entry[slot].did != request[loop] ) ; slot++ );
+      if ( slot == PERIODICMAXDIDS )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Variant EHU Present\r\n");    
+        for ( slot = 0 ; ( slot < PERIODICMAXDIDS ) && ( PeriodicDiags.Entry[slot].did != PDID_NONE ) ; slot++ );
       }
-      else if ( RxLength == 6 )
+      if ( slot < PERIODICMAXDIDS ) // always, there was room for them all
       {
-        // check the variant B Config
-        memcpy(Config,&ProgramISO.Buffer[2],4);
-        PgmState = PGM_GET_VARIANTEHUPRESENT2;
-      }
-      else
-      {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Data Length for Variant EHU Present\r\n");    
+        PeriodicDiags.Entry[slot].did = request[loop];
+        PeriodicDiags.Entry[slot].rate = rate;
+        TimerArm(&PeriodicDiags.Entry[slot].timer,0);    // send the first one straight away
+        PeriodicDiags.Entry[slot].due = false;
       }
     }
-    break;
-//************************************************
-  case PGM_GET_VARIANTEHUPRESENT2:
-    ProgramISO.Buffer[0] = 0x1a;
-    ProgramISO.Buffer[1] = 0x4c;
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  }
+
+  if ( ISO15765_Status(&DiagsISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  {
+    if ( request[2] )
     {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 2);
-      PgmState = PGM_WAIT_VARIANTEHUPRESENT2;
-      DelayTimer = 2000;
+      request[1] = 0x2a;
+      request[0] = 0x7f;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, 3);
     }
-    break;
-//************************************************
-  case PGM_WAIT_VARIANTEHUPRESENT2:
-    if ( DelayTimer )
-      DelayTimer--;
     else
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant EHU Present 2\r\n");
+      request[0] = 0x6a;
+      ISO15765_ChTx ( &DiagsISO.ChannelData,request, 1);
+    }
+  }
+}
+/******************************************************************************************/
+
+static void PeriodicDiagsRun(void)
+{
+  TCANPacket pkt;
+  u8 slot, used, length;
+
+  if ( vaux_nm_status() != NME_ACTIVE ) // we are off the bus, so the tester has gone too
+  {
+    for ( slot = 0 ; slot < PERIODICMAXDIDS ; slot++ )
+    {
+      PeriodicDiags.Entry[slot].did = PDID_NONE;
     }
-    if ( RxLength ) // we have received a packet
+    return;
+  }
+
+  for ( slot = 0 ; slot < PERIODICMAXDIDS ; slot++ )
+  {
+    if ( PeriodicDiags.Entry[slot].did != PDID_NONE )
     {
-      if ( (ProgramISO.Buffer[0]!=0x5a) || (ProgramISO.Buffer[1]!=0x4c) )
+      if ( TimerExpired(&PeriodicDiags.Entry[slot].timer) )
       {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Invalid Response to Variant EHU Present 2\r\n");    
+        // reload as soon as it falls due so that the rate doesn't stretch when the bus load cap holds us off
+        TimerArm(&PeriodicDiags.Entry[slot].timer,PeriodicDiags.Entry[slot].rate);
+        PeriodicDiags.Entry[slot].due = true;
       }
-      else
+    }
+  }
+
+  if ( TimerRunning(&PeriodicDiags.gap_timer) )
+  {
+    return;
+  }
+
+  // pack as many of the due identifiers as we can into one frame, anything left over goes in the next one
+  used = 0;
+  for ( slot = 0 ; slot < PERIODICMAXDIDS ; slot++ )
+  {
+    if ( ( PeriodicDiags.Entry[slot].did != PDID_NONE ) && PeriodicDiags.Entry[slot].due )
+    {
+      length = PeriodicDIDLength[PeriodicDiags.Entry[slot].did] + 1;
+      if ( ( used + length ) <= 8 )
       {
-        // check the mid can config
-        if ( !memcmp(Config,&ProgramISO.Buffer[2],4) ) // the data is the same
+        pkt.data[used] = PeriodicDiags.Entry[slot].did;
+        if ( PeriodicDiagsFill( PeriodicDiags.Entry[slot].did, &pkt.data[used+1] ) )
         {
-          ConfigTemp = ProgramISO.Buffer[4] & 0xc0;
-          if ( (ConfigTemp != 0x80)  && (ConfigTemp != 0xc0 ) )
-          {
-            DEBUG("PSM Variant EHU Present Invalid\r\n");    
-            PgmState = PGM_PROGRAMVARIANTEHUPRESENTSTART;
-          }
-          else if ( ConfigTemp & 0x40) 
-          {
-            PgmState = PGM_COMPLETE_OK;
-            DEBUG("PSM Variant EHU Present Correct\r\n");    
-          }
-          else
-          {
-            DEBUG("PSM Variant EHU Present Incorrect\r\n");    
-            PgmState = PGM_PROGRAMVARIANTEHUPRESENTSTART;
-          }
+          used += length;
         }
         else
         {
-          PgmState = PGM_FAILED;
-          DEBUG("PSM Error. Variant EHU Present read error\r\n");    
+          // nothing we know how to fill, drop it rather than send a bad frame every time
+          PeriodicDiags.Entry[slot].did = PDID_NONE;
+          DEBUG("Periodic DID dropped\r\n");
         }
+        PeriodicDiags.Entry[slot].due = false;
       }
     }
+  }
+  if ( !used )
+  {
+    return;
+  }
+  while ( used < 8 )
+  {
+    pkt.data[used++] = 0;
+  }
+  pkt.cplen = sizeof(TCANPacket);
+  pkt.id = CAN_DIAGS_PERIODIC_TX;
+  pkt.dlc = 8;
+  pkt.tag = 0;
+  CANTx(&pkt);
+  TimerArm(&PeriodicDiags.gap_timer,PERIODIC_FRAME_GAP);
+}
+/******************************************************************************************/
+
+static u8 PeriodicDiagsFill(u8 did, u8 * data)
+{
+  u16 held;
+  const TKEYQUEUESTATS * keys;
+  const TCANMONITOR * bus;
+
+  switch ( did )
+  {
+  case PDID_SPEED:
+    data[0] = global.speed >> 8;
+    data[1] = global.speed;
+    break;
+  case PDID_VEHICLE_INPUTS:
+    data[0] = ( global.ignition ? 0x01 : 0 ) | ( global.illumination ? 0x02 : 0 ) |
+              ( global.reverse ? 0x04 : 0 ) | ( global.parkbrake ? 0x08 : 0 );
+    data[1] = global.display_mode;
+    break;
+  case PDID_STALK:
+    held = VauxhallStalkHeld() / 100;
+    data[0] = VauxhallStalk.Button;
+    data[1] = ( held > 0xff ) ? 0xff : held;
+    break;
+  case PDID_NM:
+    data[0] = vaux_nm_status() | ( vaux_node_present(NM_DISPLAY_NODE) ? 0x10 : 0 ) | ( global.phone_kit_present ? 0x20 : 0 );
+    break;
+  case PDID_KEYQUEUE:
+    keys = KeyQueueStats();
+    held = keys->MaxLatency / 10;
+    data[0] = keys->Depth;
+    data[1] = keys->MaxDepth;
+    data[2] = keys->Dropped;
+    data[3] = ( held > 0xff ) ? 0xff : held;
+    break;
+  case PDID_CANBUS:
+    bus = CanMonitor();
+    data[0] = bus->Load;
+    data[1] = bus->Tec;
+    data[2] = bus->Rec;
+    data[3] = ( bus->BusOffs > 0xff ) ? 0xff : bus->BusOffs;
     break;
+  default:
+    return 0;
+  }
+  return PeriodicDIDLength[did];
+}
+/******************************************************************************************/
+
+static void ProgrammingStateMachine(void)
+{
+  static PROGRAM_STATE DelayReturnState;
+  
+  __no_init static u32 PowerOnDetect;
+  
+  if ( (Pgm.State != PGM_END) && !ProgramIgnOn )
+  {
+    Pgm.State = PGM_IGN_OFF;
+    ProgramISO.Enabled = false;    
+  }
+
+  switch ( Pgm.State )
+  {
 //************************************************
-  case PGM_PROGRAMVARIANTEHUPRESENTSTART:
-    ProgramISO.Buffer[0] = 0x3b;
-    ProgramISO.Buffer[1] = 0x4c;
-    memcpy(&ProgramISO.Buffer[2],Config,4);
-    ProgramISO.Buffer[4] |= 0xc0;
-    
-    if ( ISO15765_Status(&ProgramISO.ChannelData) == ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  case PGM_IGN_OFF:
+    if ( ProgramIgnOn )
     {
-      // GET IDENTIFIER
-      ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, 6);
-      PgmState = PGM_PROGRAMVARIANTEHUPRESENTWAIT1;
-      DelayTimer = 2000;
-    }
+      DEBUG("PSM Ign On\r\n");
+      TimerArm(&Pgm.Timer,4000);
+      Pgm.State = PGM_DELAY;
+      DelayReturnState = PGM_STARTUP;
+    }   
     break;
 //************************************************
-  case PGM_PROGRAMVARIANTEHUPRESENTWAIT1:
-    if ( DelayTimer )
-      DelayTimer--;
+  case PGM_STARTUP:
+    // OK first we need to see if this was a power on reset
+    if ( PowerOnDetect == 0xcafed00d )
+    {
+      DEBUG("PSM Already Run\r\n");
+      Pgm.State = PGM_FINISHED;
+    }
     else
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response to Variant EHU Present Program\r\n");
+      PowerOnDetect = 0xcafed00d;
+      TimerArm(&Pgm.Timer,2000);
+      Pgm.State = PGM_CHECK_DISPLAY_PRESENT;
+      DEBUG("PSM Start\r\n");
+      DEBUG("ISO Programming Channel Init\r\n");
+      ISO15765_Connect (&ProgramISO.ChannelData,ISOProgramID,CAN_PROG_ISO_TX, CAN_PROG_ISO_RX,ProgramISO.Buffer,PROGRAMISOBUFFLEN,ISODIR_BI);
+      ProgramISO.Enabled = true;
+    }
+    break;
+//************************************************
+  case PGM_CHECK_DISPLAY_PRESENT:
+    if ( vaux_node_present(NM_DISPLAY_NODE) && ( vaux_nm_status() == NME_ACTIVE ) )
+    {
+      // the display is present and the NM is active, so off we go
+      Pgm.State = PGM_SEQUENCE;
+      ProgrammingNextStep(PSTEP_ARE_YOU_THERE);
     }
-    if ( RxLength ) // we have received a packet
+    else if ( !TimerRunning(&Pgm.Timer) )
     {
-      if ( (ProgramISO.Buffer[0]!=0x7f) || (ProgramISO.Buffer[1]!=0x3b) || (ProgramISO.Buffer[2]!=0x78) )
-      {
-        DEBUG("PSM Error. Invalid Response to Variant EHU Present Program\r\n");
-        PgmState = PGM_FAILED;
-      }
-      else
-      {
-        PgmState = PGM_PROGRAMVARIANTEHUPRESENTWAIT2;
-        DelayTimer = 2000;
-      }
+      // timeout
+      Pgm.State = PGM_FINISHED;
+      DEBUG("PSM Error. Display Not Found\r\n");
     }
     break;
 //************************************************
-  case PGM_PROGRAMVARIANTEHUPRESENTWAIT2:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
+  case PGM_SEQUENCE:
+    // the responses move us through the sequence (see ProgrammingResponse), all we do here is retry a request that
+    // couldn't go out because the channel was busy, and time out if the display stops answering
+    if ( !Pgm.RequestSent )
     {
-      PgmState = PGM_FAILED;
-      DEBUG("PSM Error. No Response 2 to Variant EHU Present Program\r\n");
+      ProgrammingStartStep();
     }
-    if ( RxLength ) // we have received a packet
+    if ( !TimerRunning(&Pgm.Timer) )
     {
-      if ( (ProgramISO.Buffer[0]!=0x7b) || (ProgramISO.Buffer[1]!=0x4c) )
-      {
-        PgmState = PGM_FAILED;
-        DEBUG("PSM Error. Variant EHU Present Program Failed\r\n");    
-      }
-      else
-      {
-        PgmState = PGM_COMPLETE_OK;
-        DEBUG("PSM Varaint EHU Present Program Successful\r\n");    
-      }
+      Pgm.State = PGM_FAILED;
+      DEBUG("PSM Error. No Response from Display\r\n");
     }
     break;
 //************************************************
   case PGM_COMPLETE_OK:
     DisplayText.TextString = (char*)TextStringProgramOK;
-    DisplayText.OverlayTimer = 5000;
-    PgmState = PGM_FINISHED;
+    TimerArm(&DisplayText.OverlayTimer,5000);
+    Pgm.State = PGM_FINISHED;
     break;
 //************************************************
   case PGM_FAILED:
     DisplayText.TextString = (char*)TextStringProgramFailed;
-    DisplayText.OverlayTimer = 5000;
-    PgmState = PGM_FINISHED;
+    TimerArm(&DisplayText.OverlayTimer,5000);
+    Pgm.State = PGM_FINISHED;
     break;
 //************************************************
   case PGM_DELAY:
-    if ( DelayTimer )
-      DelayTimer--;
-    else
-      PgmState = DelayReturnState;
+    if ( !TimerRunning(&Pgm.Timer) )
+      Pgm.State = DelayReturnState;
     break;
 //************************************************
   case PGM_FINISHED:
     DEBUG("PSM Finished\r\n");
     ProgramISO.Enabled = false;
-    PgmState = PGM_END;
+    Pgm.State = PGM_END;
     break;
 //************************************************
   case PGM_END:
@@ -1377,6 +1477,327 @@ static void ProgrammingStateMachine(void)
 }
 /******************************************************************************************/
 
+static void ProgrammingNextStep(PROGRAM_STEP next)
+{
+  switch ( next )
+  {
+  case PSTEP_COMPLETE_OK:
+    Pgm.State = PGM_COMPLETE_OK;
+    break;
+  case PSTEP_FAILED:
+    Pgm.State = PGM_FAILED;
+    break;
+  case PSTEP_FINISHED:
+    Pgm.State = PGM_FINISHED;
+    break;
+  default:
+    Pgm.Step = next;
+    TimerArm(&Pgm.Timer,PGM_RESPONSE_TIMEOUT);
+    ProgrammingStartStep();
+    break;
+  }
+}
+/******************************************************************************************/
+
+static void ProgrammingStartStep(void)
+{
+  const PROGRAM_STEP_DEF * step = &ProgramSteps[Pgm.Step];
+  u8 length = step->RequestLength;
+
+  if ( ISO15765_Status(&ProgramISO.ChannelData) != ( ( (u16)ISO15765_GSTATE_IDLE << 8 ) | (u16)ISO15765_TSTATE_CONNOK ) )
+  {
+    Pgm.RequestSent = false; // try again next time round
+    return;
+  }
+  ProgramISO.Buffer[0] = step->Request[0];
+  ProgramISO.Buffer[1] = step->Request[1];
+  if ( step->Prepare )
+  {
+    length = step->Prepare(ProgramISO.Buffer);
+  }
+  ISO15765_ChTx ( &ProgramISO.ChannelData,ProgramISO.Buffer, length);
+  Pgm.RequestSent = true;
+}
+/******************************************************************************************/
+
+// Called as soon as the programming channel has taken a packet, so the next step goes out without waiting for the next tick
+static void ProgrammingResponse(void)
+{
+  const PROGRAM_STEP_DEF * step;
+  u16 id;
+  u8 * pkt = 0;
+  u16 RxLength = 0;
+
+  if ( !ISO15765_IsPacketWaiting(&ProgramISO.ChannelData) )
+    return;
+  //clear the rx channel
+  ISO15765_Rx (&ProgramISO.ChannelData, &id , pkt, &RxLength);
+
+  if ( ( Pgm.State != PGM_SEQUENCE ) || ( !Pgm.RequestSent ) || ( !RxLength ) )
+    return; // we didn't ask for this
+
+  step = &ProgramSteps[Pgm.Step];
+  if ( ( RxLength == 3 ) && ( ProgramISO.Buffer[0] == 0x7f ) && ( ProgramISO.Buffer[1] == step->Request[0] ) && ( ProgramISO.Buffer[2] == 0x78 ) )
+  {
+    // response pending, the display is busy writing its eeprom so give it another timeout period
+    TimerArm(&Pgm.Timer,PGM_RESPONSE_TIMEOUT);
+  }
+  else if ( ( RxLength < step->ResponseMatch ) || memcmp( ProgramISO.Buffer, step->Response, step->ResponseMatch ) )
+  {
+    DEBUG("PSM Error. Invalid Response\r\n");    
+    ProgrammingNextStep(PSTEP_FAILED);
+  }
+  else if ( step->ResponseLength && ( RxLength != step->ResponseLength ) )
+  {
+    DEBUG("PSM Error. Invalid Data Length\r\n");    
+    ProgrammingNextStep(PSTEP_FAILED);
+  }
+  else if ( step->Transform )
+  {
+    ProgrammingNextStep(step->Transform(ProgramISO.Buffer, RxLength));
+  }
+  else
+  {
+    ProgrammingNextStep(step->Next);
+  }
+}
+/******************************************************************************************/
+
+static PROGRAM_STEP PgmIdentifier(u8 * response, u16 length)
+{
+  // is this the correct identifier
+  if (  CheckDisplayCompatible( (((u16)response[2])<<8) + response[3]) == 0xff )
+  {
+//    DisplayText.TextString = (char*)TextStringUnknownDisplay;
+//    DisplayText.OverlayTimer = 5000;
+    DEBUG("PSM Error. Incorrect Display Found\r\n");    
+    return PSTEP_FINISHED;
+  }
+  DEBUG("PSM Found Display with known identifier\r\n");    
+  Pgm.DisplayID = (((u16)response[2])<<8) + response[3];
+  Pgm.Known = PgmKnownDisplay();
+  Pgm.Block = 0;
+  Pgm.Dirty = 0;
+  return PSTEP_READ_BLOCK;
+}
+/******************************************************************************************/
+
+static u8 PgmPrepareBlockRead(u8 * request)
+{
+  request[1] = ProgramBlocks[Pgm.Block].Id;
+  return 2;
+}
+/******************************************************************************************/
+
+static u8 PgmPrepareBlockWrite(u8 * request)
+{
+  const PROGRAM_BLOCK_DEF * block = &ProgramBlocks[Pgm.Block];
+
+  request[1] = block->Id;
+  memcpy(&request[2],Pgm.Data[Pgm.Block],block->Length);
+  return 2 + block->Length;
+}
+/******************************************************************************************/
+
+static PROGRAM_STEP PgmBlockRead(u8 * response, u16 length)
+{
+  const PROGRAM_BLOCK_DEF * block = &ProgramBlocks[Pgm.Block];
+
+  // the display may send more than we use, as it always has been allowed to
+  if ( ( response[1] != block->Id ) || ( length < 2 + block->Length ) )
+  {
+    DEBUG("PSM Error. Config block read error\r\n");    
+    return PSTEP_FAILED;
+  }
+  memcpy(Pgm.Data[Pgm.Block],&response[2],block->Length);
+  if ( Pgm.Known && !PgmStoredBlock(Pgm.Block,Pgm.Data[Pgm.Block]) )
+  {
+    Pgm.Known = false; // another display of the same type, or someone has changed this one
+  }
+  if ( block->Modify(Pgm.Data[Pgm.Block]) )
+  {
+    Pgm.Dirty |= ( 1 << Pgm.Block );
+  }
+  if ( ++Pgm.Block < PGM_NUMBLOCKS )
+  {
+    return PSTEP_READ_BLOCK;
+  }
+  if ( Pgm.Known )
+  {
+    DEBUG("PSM Display already programmed\r\n");    
+    return PSTEP_FINISHED;
+  }
+  // all read, now write back only what needs it
+  Pgm.Block = 0;
+  return PgmNextWrite();
+}
+/******************************************************************************************/
+
+static PROGRAM_STEP PgmBlockWritten(u8 * response, u16 length)
+{
+  if ( response[1] != ProgramBlocks[Pgm.Block].Id )
+  {
+    DEBUG("PSM Error. Config block write error\r\n");    
+    return PSTEP_FAILED;
+  }
+  return PSTEP_VERIFY_BLOCK;
+}
+/******************************************************************************************/
+
+static PROGRAM_STEP PgmBlockVerify(u8 * response, u16 length)
+{
+  const PROGRAM_BLOCK_DEF * block = &ProgramBlocks[Pgm.Block];
+
+  if ( ( response[1] != block->Id ) || ( length < 2 + block->Length ) || memcmp(Pgm.Data[Pgm.Block],&response[2],block->Length) )
+  {
+    DEBUG("PSM Error. Config block verify error\r\n");    
+    return PSTEP_FAILED;
+  }
+  Pgm.Dirty &= ~( 1 << Pgm.Block );
+  return PgmNextWrite();
+}
+/******************************************************************************************/
+
+// find the next block that needs writing, if there are none left we are done
+static PROGRAM_STEP PgmNextWrite(void)
+{
+  for ( Pgm.Block = 0 ; Pgm.Block < PGM_NUMBLOCKS ; Pgm.Block++ )
+  {
+    if ( Pgm.Dirty & ( 1 << Pgm.Block ) )
+    {
+      return PSTEP_WRITE_BLOCK;
+    }
+  }
+  DEBUG("PSM Config Correct\r\n");    
+  PgmStoreConfig();
+  return PSTEP_COMPLETE_OK;
+}
+/******************************************************************************************/
+
+// remember which display we programmed and what we left in it
+static void PgmStoreConfig(void)
+{
+  u8 config[FS_MAXVALUELEN];
+  u8 length = 0;
+  u8 loop;
+
+  for ( loop = 0 ; loop < PGM_NUMBLOCKS ; loop++ )
+  {
+    memcpy(&config[length],Pgm.Data[loop],ProgramBlocks[loop].Length);
+    length += ProgramBlocks[loop].Length;
+  }
+  FlashStoreWrite(FSK_DISPLAY_CONFIG,config,length);
+  FlashStoreWrite(FSK_DISPLAY_ID,(u8*)&Pgm.DisplayID,sizeof(Pgm.DisplayID));
+}
+/******************************************************************************************/
+
+// true if the last display we programmed had this identifier, with the same set of blocks as this build programs. The
+// identifier is only the type of display, so the blocks it holds are checked against what we left with PgmStoredBlock().
+static bool PgmKnownDisplay(void)
+{
+  u8 config[FS_MAXVALUELEN];
+  u16 StoredID;
+  u8 length = 0;
+  u8 loop;
+
+  for ( loop = 0 ; loop < PGM_NUMBLOCKS ; loop++ )
+  {
+    length += ProgramBlocks[loop].Length;
+  }
+  if ( ( FlashStoreRead(FSK_DISPLAY_ID,(u8*)&StoredID,sizeof(StoredID)) != sizeof(StoredID) ) || ( StoredID != Pgm.DisplayID ) )
+  {
+    return false;
+  }
+  return ( FlashStoreRead(FSK_DISPLAY_CONFIG,config,sizeof(config)) == length );
+}
+/******************************************************************************************/
+
+// true if a block just read from the display is the same as we stored after programming the last one
+static bool PgmStoredBlock(u8 block, const u8 * data)
+{
+  u8 config[FS_MAXVALUELEN];
+  u8 offset = 0;
+  u8 loop;
+
+  for ( loop = 0 ; loop < block ; loop++ )
+  {
+    offset += ProgramBlocks[loop].Length;
+  }
+  if ( FlashStoreRead(FSK_DISPLAY_CONFIG,config,sizeof(config)) < ( offset + ProgramBlocks[block].Length ) )
+  {
+    return false;
+  }
+  return !memcmp(&config[offset],data,ProgramBlocks[block].Length);
+}
+/******************************************************************************************/
+
+static bool PgmModifyMidCAN(u8 * data)
+{
+  if ( data[0] & 0x02 )
+  {
+    DEBUG("PSM Mid CAN EHU Present\r\n");    
+    return false;
+  }
+  DEBUG("PSM Mid CAN EHU Not Present\r\n");    
+  data[0] |= 0x02;
+  return true;
+}
+/******************************************************************************************/
+
+#ifdef PROGRAM_COUNTRY_CODE
+static bool PgmModifyCountryCode(u8 * data)
+{
+  u8 ConfigTemp;
+
+  // now we need to check the country code
+  ConfigTemp=FindCountryCode(&data[3]);
+  if ( ConfigTemp == 0xff )
+  {
+    DEBUG("PSM Variant Country Code Invalid\r\n");    
+  }
+  else if ( ConfigTemp == 0x00 ) // no country code set
+  {
+    DEBUG("PSM Variant Country Code = Other / No Radio\r\n");    
+  }
+  else
+  {
+    DEBUG("PSM Variant Country Code Valid. Country = ");
+    DEBUG((char*)Country[ConfigTemp].Name);
+    DEBUG("\r\n");
+    return false;
+  }
+  data[3] = 0x33;
+  data[4] = 0x00;
+  data[5] = 0x00;
+  data[6] = 0x10; // we will set this to UK
+  return true;
+}
+/******************************************************************************************/
+#endif
+
+static bool PgmModifyEHUPresent(u8 * data)
+{
+  u8 ConfigTemp;
+
+  ConfigTemp = data[2] & 0xc0;
+  if ( ConfigTemp == 0xc0 )
+  {
+    DEBUG("PSM Variant EHU Present Correct\r\n");    
+    return false;
+  }
+  if ( ConfigTemp != 0x80 )
+  {
+    DEBUG("PSM Variant EHU Present Invalid\r\n");    
+  }
+  else
+  {
+    DEBUG("PSM Variant EHU Present Incorrect\r\n");    
+  }
+  data[2] |= 0xc0;
+  return true;
+}
+/******************************************************************************************/
+
 #ifdef PROGRAM_COUNTRY_CODE
 static u8 FindCountryCode (u8 * code)
 {
@@ -1410,8 +1831,7 @@ static u8 CheckDisplayCompatible (u16 DisplayID)
 static void ForceCANWake(void)
 {
   static CANWAKESTATE CWState = CW_Start;
-  static u16 DelayCounter = 0;
-  DelayCounter++;
+  static TTimer Delay;
   
 
   switch ( CWState )
@@ -1433,13 +1853,14 @@ static void ForceCANWake(void)
 //********************************
   case CW_Active:
     // we have been woken up by the ignition wire rather than the CAN wake line
-    // first we need to skip 5 seconds so that we dont try to wake the bus when we dont need to
-    DelayCounter = 0;
-    CWState = CW_Wait5Sec;
+    // first we need to skip 5 seconds so that we dont try to wake the bus when we dont need to,
+    // unless we already know this car needs waking
+    TimerArm(&Delay,5000);
+    CWState = ( CarVariant & CARVARIANT_FORCEWAKE ) ? CW_CheckCanActive : CW_Wait5Sec;
     break;
 //********************************
   case CW_Wait5Sec:
-    if ( DelayCounter > 5000 )
+    if ( !TimerRunning(&Delay) )
     {
       CWState = CW_CheckCanActive;
     }
@@ -1449,18 +1870,22 @@ static void ForceCANWake(void)
     if ( CANDataReceived > 10 ) // we have received at least 10 packets so the network must be up and running
     {
       CWState = CW_NotRequired;
+      CarVariant &= ~CARVARIANT_FORCEWAKE;
+      FlashStoreWrite(FSK_CAR_VARIANT,&CarVariant,sizeof(CarVariant));
     }
     else // got nowt so lets try to wake the bus up
     {
+      CarVariant |= CARVARIANT_FORCEWAKE;
+      FlashStoreWrite(FSK_CAR_VARIANT,&CarVariant,sizeof(CarVariant));
       SetNMData((u8*)NMDataWake);        
       vaux_nm_cmd(NMC_FORCEWAKE);
-      DelayCounter = 0;
+      TimerArm(&Delay,2000);
       CWState = CW_Wait2Sec;    
     }
     break;
 //********************************
   case CW_Wait2Sec:
-    if ( DelayCounter > 2000 )
+    if ( !TimerRunning(&Delay) )
     {
       if ( !global.ignition )
       {
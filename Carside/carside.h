@@ -1,10 +1,20 @@
 #ifndef CARSIDE_H
 #define CARSIDE_H
 
-extern void CarSide(void);
+// Tasks, see scheduler.h
+extern void CarSideReceive(void);
+extern void CarSideNM(void);
+extern void CarSideISO(void);
+extern void CarSideDiags(void);
+extern void CarSideDisplay(void);
+extern void CarSideProgramming(void);
 extern void InitCarSide(void);
+extern void InitCarSideCAN(void);
+extern bool CarSideWarmBoot(void);
+extern void CarSidePrepareWarmBoot(void);
 
 #define IGNITIONWAKETOKEN 0x5a5afeab
+#define WARMBOOTTOKEN     0xb007cafe
 
 #endif
 
@@ -0,0 +1,175 @@
+// Host side decoder for the debug UART's binary log. Reads the raw bytes from a file or stdin and prints a line of
+// text for each record, CAN trace entries are shown under the LOG_CANTRACE record that starts the dump. The target's timestamp is a 16 bit ms count, it is carried on here across its wrap.
+//
+//   gcc -o log_decode log_decode.c
+//   log_decode < capture.bin
+
+#include <stdio.h>
+#include "../diags_log.h"
+
+// keep in step with EVENT in Events/events.h
+static const char * const EventNames[] =
+{
+  "IGNITION", "ILLUMINATION", "REVERSE", "SPEED", "PARKBRAKE", "DISPLAY_MODE", "NMNODES"
+};
+#define EVENT_SPEED   3             // EV_SPEED, in 1/64 km/h
+
+// keep in step with the key codes in Misc/global.h
+static const char * KeyName(int key)
+{
+  static const char * const Keys[] =
+  {
+    "NONE", "VOL_UP", "VOL_DOWN", "TRACK_UP", "TRACK_DOWN", "SOURCE", "PRE_UP", "PRE_UP_HOLD", "PICKUP", "HANGUP"
+  };
+
+  if ( key == 128 )
+  {
+    return "RELEASE";
+  }
+  return ( key < (int)( sizeof(Keys) / sizeof(Keys[0]) ) ) ? Keys[key] : "?";
+}
+/********************************************************************************************************************************/
+
+// keep in step with CANTRACETRIG and CANTRACEMARK in CAN Trace/can_trace.h
+static const char * const TraceTriggers[] = { "none", "bus off", "ISO timeout", "id" };
+static const char * const TraceMarks[] = { "?", "** bus off **", "** ISO timeout **", "** receive overrun **" };
+
+// A TCANTRACEENTRY, its stamp is 0.1ms and wraps every 6.5s so it is shown as it is
+static void PrintTraceEntry(const unsigned char * entry)
+{
+  unsigned int stamp = entry[0] | ( entry[1] << 8 );
+  unsigned int iddlc = entry[2] | ( entry[3] << 8 );
+  unsigned int id = iddlc & 0x7ff;
+  unsigned int dlc = ( iddlc >> 11 ) & 0x0f;
+  unsigned int i;
+
+  printf("           %5u.%u  ", stamp / 10, stamp % 10);
+  if ( dlc == 0x0f )
+  {
+    printf("%s\n", ( id < 4 ) ? TraceMarks[id] : "?");
+    return;
+  }
+  printf("%s %03x [%u]", ( iddlc & 0x8000 ) ? "TX" : "RX", id, dlc);
+  for ( i = 0 ; ( i < dlc ) && ( i < 4 ) ; i++ )
+  {
+    printf(" %02x", entry[4 + i]);
+  }
+  printf("%s\n", ( dlc > 4 ) ? " .." : "");
+}
+/********************************************************************************************************************************/
+
+static void PrintRecord(unsigned long ms, int id, int a, int b)
+{
+  printf("%7lu.%03lu  ", ms / 1000, ms % 1000);
+  switch ( id )
+  {
+  case LOG_LOST:
+    printf("** %d records lost **\n", b);
+    break;
+  case LOG_BOOT:
+    printf("%s boot\n", a ? "warm" : "cold");
+    break;
+  case LOG_EVENT:
+    if ( a < (int)( sizeof(EventNames) / sizeof(EventNames[0]) ) )
+    {
+      printf("event %s = %d", EventNames[a], b);
+    }
+    else
+    {
+      printf("event %d = %d", a, b);
+    }
+    if ( a == EVENT_SPEED )
+    {
+      printf(" (%d.%02d km/h)", b >> 6, ( ( b & 0x3f ) * 100 ) >> 6);
+    }
+    printf("\n");
+    break;
+  case LOG_KEY:
+    printf("key %s, waited %dms\n", KeyName(a), b);
+    break;
+  case LOG_BUSOFF:
+    printf("CAN bus off, %d in a row, holding off %dms\n", a, b);
+    break;
+  case LOG_BUSRECOVERED:
+    printf("CAN back on the bus after %dms\n", b);
+    break;
+  case LOG_CANTRACE:
+    printf("CAN trace, %d entries, trigger %s\n", b, ( a < 4 ) ? TraceTriggers[a] : "?");
+    break;
+  default:
+    printf("id %d a %d b %d\n", id, a, b);
+    break;
+  }
+}
+/********************************************************************************************************************************/
+
+int main(int argc, char * argv[])
+{
+  FILE * in = stdin;
+  unsigned char buf[LOG_HEADERLEN + 256];
+  unsigned long ms = 0;
+  unsigned int last = 0;
+  int c, id, length, i, first = 1;
+  unsigned int stamp;
+
+  if ( ( argc > 1 ) && !( in = fopen(argv[1], "rb") ) )
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  while ( ( c = fgetc(in) ) != EOF )
+  {
+    if ( c != LOG_SYNC )
+    {
+      continue;                     // not lined up on a record yet
+    }
+    if ( fread(&buf[1], 1, LOG_HEADERLEN - 1, in) != LOG_HEADERLEN - 1 )
+    {
+      break;
+    }
+    id = buf[1];
+    if ( id >= LOG_END )
+    {
+      continue;                     // wasn't a record after all, look for the next sync
+    }
+    stamp = buf[2] | ( buf[3] << 8 );
+    ms += first ? stamp : (unsigned int)( ( stamp - last ) & 0xffff );
+    last = stamp;
+    first = 0;
+
+    if ( ( id == LOG_TEXT ) || ( id == LOG_CANFRAME ) )
+    {
+      if ( ( length = fgetc(in) ) == EOF || fread(buf, 1, length, in) != (size_t)length )
+      {
+        break;
+      }
+      if ( id == LOG_CANFRAME )
+      {
+        if ( length >= 8 )
+        {
+          PrintTraceEntry(buf);
+        }
+        continue;
+      }
+      printf("%7lu.%03lu  ", ms / 1000, ms % 1000);
+      for ( i = 0 ; i < length ; i++ )
+      {
+        if ( ( buf[i] != '\r' ) && ( buf[i] != '\n' ) )
+        {
+          putchar(buf[i]);
+        }
+      }
+      putchar('\n');
+    }
+    else
+    {
+      if ( fread(buf, 1, LOG_ARGSLEN, in) != LOG_ARGSLEN )
+      {
+        break;
+      }
+      PrintRecord(ms, id, buf[0], buf[1] | ( buf[2] << 8 ));
+    }
+  }
+  return 0;
+}
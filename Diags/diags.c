@@ -1,22 +1,28 @@
 #include "diags.h"
 #include <ior8c22_23.h>
 #include <intrinsics.h>
+#include <string.h>
+#include "timer.h"
 
-#define DIAGBUFFERSIZE  256
+#define DIAGBUFFERSIZE  256         // the u8 indexes wrap round it on their own
+#define DIAGMAXTEXT     64
 
-#ifdef DIAGS_ENABLED
 static struct
 {
-  char buffer[DIAGBUFFERSIZE];
-  u16 in;
-  u16 out;
+  u8 buffer[DIAGBUFFERSIZE];
+  volatile u8 in;
+  volatile u8 out;
+  volatile bool busy;               // the uart is sending, its interrupt will take the next byte
+  u16 lost;                         // records that didn't fit since the last LOG_LOST
 } diag;
-#endif
+
+static bool DiagsLogStart(LOGID id, u8 length);
+static void DiagsPut(u8 byte);
+static void DiagsKick(void);
 /********************************************************************************************************************************/
 
 void InitDiags(void)
 {
-#ifdef DIAGS_ENABLED
   PD6 &= 0x3F;        // make RXD1 & TXD1 inputs
   U1BRG = 25;        // set divider as 26 for 38400 baud
   U1MR = 5;           // set UART for 8 bits, internal clock, 1 stop bit & no parity
@@ -26,44 +32,138 @@ void InitDiags(void)
   PMR = 0x10;         // use TXD1 & RXD1 pins
   // set up interrupt
 //  S1RIC = 2;
+  S1TIC = 1;          // transmit buffer empty takes the next byte out of the ring
   diag.in = diag.out = 0;
+  diag.busy = false;
+  diag.lost = 0;
+}
+/********************************************************************************************************************************/
 
-#endif
+// Anything still in the ring is thrown away, the interrupt mustn't wake us to send it
+void DiagsSleep(void)
+{
+  S1TIC = 0;
+  diag.in = diag.out;
+  diag.busy = false;
 }
 /********************************************************************************************************************************/
 
-void DiagsProcessing(void)
+void DiagsLog(LOGID id, u8 a, u16 b)
 {
-#ifdef DIAGS_ENABLED
-  if ( diag.in != diag.out ) // there is data to send
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  if ( DiagsLogStart(id,LOG_ARGSLEN) )
   {
-    if ( U1C1 & 2 ) // there is room in the uart for the next byte
+    DiagsPut(a);
+    DiagsPut(b);
+    DiagsPut(b >> 8);
+    DiagsKick();
+  }
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+void DiagsLogData(LOGID id, const u8 * data, u8 length)
+{
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  if ( DiagsLogStart(id,length + 1) )
+  {
+    DiagsPut(length);
+    while ( length-- )
     {
-      U1TB = diag.buffer[diag.out];
-      if ( diag.out )
-        diag.out--;
-      else
-        diag.out = DIAGBUFFERSIZE-1;
-    } 
+      DiagsPut(*data++);
+    }
+    DiagsKick();
   }
-#endif
+  __set_interrupt_state(state);
 }
 /********************************************************************************************************************************/
 
-void SendDiag( char * text)
+bool DiagsLogRoom(u8 length)
 {
+  return ( (u8)( diag.out - diag.in - 1 ) >= ( LOG_HEADERLEN + LOG_HEADERLEN + LOG_ARGSLEN + length ) );
+}
+/********************************************************************************************************************************/
+
 #ifdef DIAGS_ENABLED
-  while ( *text )
+void SendDiag( char * text)
+{
+  u16 length = strlen(text);
+
+  DiagsLogData(LOG_TEXT,(const u8 *)text,( length > DIAGMAXTEXT ) ? DIAGMAXTEXT : length);
+}
+#endif
+/********************************************************************************************************************************/
+
+// Interrupts off. Puts the header in if there is room for the whole record, with a LOST record in front of it when
+// some have been thrown away.
+static bool DiagsLogStart(LOGID id, u8 length)
+{
+  u8 room = diag.out - diag.in - 1;
+  u16 now = TimerNow();
+
+  if ( diag.lost )
   {
-    diag.buffer[diag.in] = *text++;
-    if ( diag.in )
-      diag.in--;
-    else
-      diag.in = DIAGBUFFERSIZE-1;
+    if ( room < ( LOG_HEADERLEN + LOG_ARGSLEN + LOG_HEADERLEN + length ) )
+    {
+      if ( diag.lost < 0xffff )
+      {
+        diag.lost++;
+      }
+      return false;
+    }
+    DiagsPut(LOG_SYNC);
+    DiagsPut(LOG_LOST);
+    DiagsPut(now);
+    DiagsPut(now >> 8);
+    DiagsPut(0);
+    DiagsPut(diag.lost);
+    DiagsPut(diag.lost >> 8);
+    diag.lost = 0;
   }
-#endif
+  else if ( room < ( LOG_HEADERLEN + length ) )
+  {
+    diag.lost++;
+    return false;
+  }
+  DiagsPut(LOG_SYNC);
+  DiagsPut(id);
+  DiagsPut(now);
+  DiagsPut(now >> 8);
+  return true;
 }
 /********************************************************************************************************************************/
 
+static void DiagsPut(u8 byte)
+{
+  diag.buffer[diag.in++] = byte;
+}
+/********************************************************************************************************************************/
 
+// Interrupts off. Only the first byte is written here, the interrupt sends the rest.
+static void DiagsKick(void)
+{
+  if ( !diag.busy )
+  {
+    diag.busy = true;
+    U1TB = diag.buffer[diag.out++];
+  }
+}
+/********************************************************************************************************************************/
 
+#pragma vector = 19
+static __interrupt void Uart1TxIntr (void)
+{
+  if ( diag.in != diag.out )
+  {
+    U1TB = diag.buffer[diag.out++];
+  }
+  else
+  {
+    diag.busy = false;
+  }
+}
+/********************************************************************************************************************************/
@@ -1,11 +1,21 @@
 #ifndef DIAGS_H
 #define DIAGS_H
 #include "common.h"
+#include "diags_log.h"
 
-
+// Everything out of the debug UART goes as binary records (diags_log.h) from a ring that the UART1 transmit interrupt
+// empties, so logging is a few bytes copied with interrupts off. DiagsLog() is always built in, the text that
+// DEBUG() sends is only there when DIAGS_ENABLED is defined.
 
 extern void InitDiags(void);
-extern void DiagsProcessing(void);
+// Before we sleep
+extern void DiagsSleep(void);
+// A whole record goes in or, if there isn't room, none of it and it is counted as lost
+extern void DiagsLog(LOGID id, u8 a, u16 b);
+// The same for the records that carry a length and that many bytes
+extern void DiagsLogData(LOGID id, const u8 * data, u8 length);
+// True if a record carrying length bytes would go in now, even with a LOST record in front of it
+extern bool DiagsLogRoom(u8 length);
 #ifdef DIAGS_ENABLED
 #define DEBUG(x)  SendDiag(x)
 extern void SendDiag( char * );
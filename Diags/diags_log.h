@@ -0,0 +1,27 @@
+#ifndef DIAGS_LOG_H
+#define DIAGS_LOG_H
+
+// The binary log records. This is shared with the host decoder (Diags/Host), so it mustn't pull in anything of the
+// target's. On the UART a record is LOG_SYNC, the id, a ms timestamp (low, high) and then, for LOG_TEXT and
+// LOG_CANFRAME, a length and that many bytes, for everything else an 8 bit argument and a 16 bit one (low, high).
+// Never renumber the ids, only add to the end.
+
+#define LOG_SYNC        0xa5
+#define LOG_HEADERLEN   4                 // sync, id, timestamp
+#define LOG_ARGSLEN     3
+
+typedef enum
+{
+  LOG_TEXT,         // a DEBUG() string, only in a DIAGS_ENABLED build
+  LOG_LOST,         // b records were thrown away before this one, the buffer was full
+  LOG_BOOT,         // a 1 when we have come out of our own sleep
+  LOG_EVENT,        // a EVENT, b the value passed to its subscribers
+  LOG_KEY,          // a key code going out to the head unit, b ms it waited in the key queue
+  LOG_BUSOFF,       // the CAN controller went bus off, a how many in a row, b ms we hold off the bus first
+  LOG_CANTRACE,     // a CAN trace dump follows, a CANTRACETRIG it stopped on, b how many LOG_CANFRAMEs
+  LOG_CANFRAME,     // one CAN trace entry, see TCANTRACEENTRY
+  LOG_BUSRECOVERED, // the first frame through after a bus off, b ms it took
+  LOG_END
+}LOGID;
+
+#endif
@@ -0,0 +1,52 @@
+#include "events_internal.h"
+#include "scheduler.h"
+#include "diags.h"
+
+void EventSubscribe(EVENT event, TEventHandler handler)
+{
+  if ( Events.Used < EVENTMAXSUBSCRIBERS )
+  {
+    Events.Subscriber[Events.Used].Event = event;
+    Events.Subscriber[Events.Used].Handler = handler;
+    Events.Used++;
+  }
+  else
+  {
+    DEBUG("Event Subscribers Full\r\n");
+  }
+}
+/********************************************************************************************************************************/
+
+void EventPublish(EVENT event, u16 value)
+{
+  if ( Events.Value[event] != value )
+  {
+    // if it changes again before the subscribers have been told, they just get the latest value
+    Events.Value[event] = value;
+    Events.Pending |= ( 1 << event );
+    TaskReady(TASK_EVENTS);
+  }
+}
+/********************************************************************************************************************************/
+
+void EventsRun(void)
+{
+  u8 event, sub;
+
+  for ( event = 0 ; event < EV_END ; event++ )
+  {
+    if ( Events.Pending & ( 1 << event ) )
+    {
+      Events.Pending &= ~( 1 << event );
+      DiagsLog(LOG_EVENT,event,Events.Value[event]);
+      for ( sub = 0 ; sub < Events.Used ; sub++ )
+      {
+        if ( Events.Subscriber[sub].Event == event )
+        {
+          Events.Subscriber[sub].Handler((EVENT)event,Events.Value[event]);
+        }
+      }
+    }
+  }
+}
+/********************************************************************************************************************************/
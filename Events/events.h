@@ -0,0 +1,32 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "common.h"
+
+// Vehicle state change events. Whoever decodes a value publishes it every time it is decoded, subscribers only hear about
+// it when it actually changes. Handlers are called from the events task, straight after the receive task has finished,
+// so an edge is seen at most one task switch after the frame that caused it.
+
+typedef enum
+{
+  EV_IGNITION,
+  EV_ILLUMINATION,
+  EV_REVERSE,
+  EV_SPEED,               // 1/64 km/h
+  EV_PARKBRAKE,
+  EV_DISPLAY_MODE,
+  EV_NMNODES,             // NM nodes present, one bit per address, see vaux_nm_present()
+  EV_END
+}EVENT;
+
+typedef void (*TEventHandler)(EVENT event, u16 value);
+
+#define EVENTMAXSUBSCRIBERS   8
+
+// At init time only
+void EventSubscribe(EVENT event, TEventHandler handler);
+void EventPublish(EVENT event, u16 value);
+// Task, hands any changes to their subscribers
+void EventsRun(void);
+
+#endif
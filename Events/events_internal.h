@@ -0,0 +1,20 @@
+#ifndef EVENTS_INTERNAL_H
+#define EVENTS_INTERNAL_H
+
+#include "events.h"
+
+typedef struct
+{
+  EVENT Event;
+  TEventHandler Handler;
+}TSUBSCRIBER;
+
+static struct
+{
+  u16 Value[EV_END];                // last published, everything starts off at 0 like global
+  u8 Pending;                       // one bit per event that has changed since the subscribers were last told
+  u8 Used;
+  TSUBSCRIBER Subscriber[EVENTMAXSUBSCRIBERS];
+}Events;
+
+#endif
@@ -0,0 +1,400 @@
+#include <ior8c22_23.h>
+#include <intrinsics.h>
+#include <string.h>
+#include "flash_store_internal.h"
+#include "diags.h"
+#include "timer.h"
+
+void FlashStoreInit(void)
+{
+  bool ValidA = ( FS_BLOCK_A[0] == FS_MARKER );
+  bool ValidB = ( FS_BLOCK_B[0] == FS_MARKER );
+  u8 header[FS_HEADERLEN] = { FS_MARKER, 0 };
+  bool ok;
+
+  if ( ValidA && ValidB )
+  {
+    // we lost power after building a new block but before the old one was erased, the newer one wins
+    FlashStore.Block = ( (u8)( FS_BLOCK_A[1] + 1 ) == FS_BLOCK_B[1] ) ? FS_BLOCK_B : FS_BLOCK_A;
+  }
+  else if ( ValidA )
+  {
+    FlashStore.Block = FS_BLOCK_A;
+  }
+  else if ( ValidB )
+  {
+    FlashStore.Block = FS_BLOCK_B;
+  }
+  else
+  {
+    // first time out, start again in block A
+    DEBUG("Flash Store Format\r\n");
+    FlashStore.Block = 0;
+    FlashStoreEraseStart(FS_BLOCK_A);
+    while ( !FlashStoreEraseDone(&ok) )
+    {
+      // nothing else is running yet, so just wait for it
+      wdtr = 0x00;
+      wdtr = 0xFF;
+    }
+    if ( !ok || !FlashStoreProgram(FS_BLOCK_A + 1, &header[1], 1) || !FlashStoreProgram(FS_BLOCK_A, header, 1) )
+    {
+      DEBUG("Flash Store Error\r\n");
+      return;
+    }
+    FlashStore.Block = FS_BLOCK_A;
+  }
+  FlashStore.Sequence = FlashStore.Block[1];
+  FlashStore.Free = FlashStoreScan(FlashStore.Block);
+}
+/********************************************************************************************************************************/
+
+u8 FlashStoreRead(FS_KEY key, u8 * data, u8 maxlength)
+{
+  FS_PENDING * pending = FlashStoreFindPending(key);
+  u8 * record;
+
+  if ( pending )
+  {
+    if ( pending->Length > maxlength )
+    {
+      return 0;
+    }
+    memcpy(data,pending->Data,pending->Length);
+    return pending->Length;
+  }
+  if ( !FlashStore.Block || ( FlashStore.State != FS_IDLE ) ) // the data flash can't be read while it is erasing
+  {
+    return 0;
+  }
+  record = FlashStoreFind(FlashStore.Block, FS_BLOCKSIZE, key);
+  if ( !record || ( record[1] > maxlength ) )
+  {
+    return 0;
+  }
+  memcpy(data,&record[2],record[1]);
+  return record[1];
+}
+/********************************************************************************************************************************/
+
+bool FlashStoreWrite(FS_KEY key, const u8 * data, u8 length)
+{
+  FS_PENDING * pending;
+  u8 * record;
+
+  if ( !FlashStore.Block || ( length > FS_MAXVALUELEN ) )
+  {
+    return false;
+  }
+  if ( FlashStore.State == FS_IDLE )
+  {
+    record = FlashStoreFind(FlashStore.Block, FS_BLOCKSIZE, key);
+    if ( record && ( record[1] == length ) && !memcmp(&record[2],data,length) )
+    {
+      return true; // already got it, save the flash
+    }
+    if ( ( FlashStore.Free + FS_RECORDLEN(length) ) <= FS_BLOCKSIZE )
+    {
+      return FlashStoreAppend(key,data,length);
+    }
+  }
+  // no room, or a compact is already going. Keep it till the compact has made room for it.
+  pending = FlashStoreFindPending(key);
+  if ( !pending )
+  {
+    if ( FlashStore.Pending == FS_PENDINGMAX )
+    {
+      DEBUG("Flash Store Full\r\n");
+      return false;
+    }
+    pending = &FlashStore.PendingRecords[FlashStore.Pending++];
+  }
+  pending->Key = key;
+  pending->Length = length;
+  memcpy(pending->Data,data,length);
+  if ( FlashStore.State == FS_IDLE )
+  {
+    FlashStoreCompactStart();
+  }
+  return true;
+}
+/********************************************************************************************************************************/
+
+void FlashStoreRun(void)
+{
+  bool ok;
+  u8 * record;
+
+  switch ( FlashStore.State )
+  {
+  case FS_ERASE_NEW:
+    if ( FlashStoreEraseDone(&ok) )
+    {
+      if ( !ok )
+      {
+        DEBUG("Flash Store Erase Error\r\n");
+        FlashStoreCompactFail();
+        break;
+      }
+      FlashStore.Block = ( FlashStore.From == FS_BLOCK_A ) ? FS_BLOCK_B : FS_BLOCK_A;
+      FlashStore.Free = FS_HEADERLEN;
+      FlashStore.Key = 1;
+      FlashStore.State = FS_COPY;
+    }
+    break;
+  case FS_COPY:
+    // one key a pass, each program holds the interrupts off while it goes
+    if ( FlashStore.Key < FSK_END )
+    {
+      record = FlashStoreFindPending((FS_KEY)FlashStore.Key) ? 0 : FlashStoreFind(FlashStore.From, FS_BLOCKSIZE, (FS_KEY)FlashStore.Key);
+      if ( record && !FlashStoreAppend((FS_KEY)FlashStore.Key,&record[2],record[1]) )
+      {
+        FlashStoreCompactFail();
+        break;
+      }
+      FlashStore.Key++;
+    }
+    else if ( !FlashStoreCompactFinish() )
+    {
+      FlashStoreCompactFail();
+    }
+    break;
+  case FS_ERASE_OLD:
+    if ( FlashStoreEraseDone(&ok) ) // if this failed the sequence number still sorts it
+    {
+      FlashStore.State = FS_IDLE;
+    }
+    break;
+  default:
+    break;
+  }
+  if ( FlashStore.State != FS_IDLE )
+  {
+    TimerKeepTicking();
+  }
+}
+/********************************************************************************************************************************/
+
+bool FlashStoreBusy(void)
+{
+  return ( FlashStore.State != FS_IDLE );
+}
+/********************************************************************************************************************************/
+
+// Returns the offset of the first free byte in the block, or FS_BLOCKSIZE if the block must not be written to any more
+static u16 FlashStoreScan(u8 * block)
+{
+  u16 offset = FS_HEADERLEN;
+  u16 loop;
+
+  while ( ( offset < FS_BLOCKSIZE ) && ( block[offset] != FS_ERASED ) )
+  {
+    if ( ( ( offset + 1 ) >= FS_BLOCKSIZE ) || ( block[offset + 1] > FS_MAXVALUELEN ) )
+    {
+      return FS_BLOCKSIZE; // rubbish, leave it for the next compact
+    }
+    offset += FS_RECORDLEN(block[offset + 1]);
+  }
+  if ( offset > FS_BLOCKSIZE )
+  {
+    return FS_BLOCKSIZE;
+  }
+  // everything past the last record should still be erased, if it isn't a write was cut short so we can't write over it
+  for ( loop = offset ; loop < FS_BLOCKSIZE ; loop++ )
+  {
+    if ( block[loop] != FS_ERASED )
+    {
+      return FS_BLOCKSIZE;
+    }
+  }
+  return offset;
+}
+/********************************************************************************************************************************/
+
+// Returns the latest good record for key, 0 if there isn't one
+static u8 * FlashStoreFind(u8 * block, u16 end, FS_KEY key)
+{
+  u8 * found = 0;
+  u16 offset = FS_HEADERLEN;
+  u8 length;
+
+  while ( ( ( offset + 1 ) < end ) && ( block[offset] != FS_ERASED ) )
+  {
+    length = block[offset + 1];
+    if ( ( length > FS_MAXVALUELEN ) || ( ( offset + FS_RECORDLEN(length) ) > end ) )
+    {
+      break;
+    }
+    if ( ( block[offset] == key ) && ( block[offset + FS_RECORDLEN(length) - 1] == FlashStoreCheck(&block[offset],length) ) )
+    {
+      found = &block[offset];
+    }
+    offset += FS_RECORDLEN(length);
+  }
+  return found;
+}
+/********************************************************************************************************************************/
+
+static u8 FlashStoreCheck(const u8 * record, u8 length)
+{
+  u8 sum = 0;
+  u8 loop;
+
+  for ( loop = 0 ; loop < ( length + 2 ) ; loop++ )
+  {
+    sum += record[loop];
+  }
+  return ~sum;
+}
+/********************************************************************************************************************************/
+
+static bool FlashStoreAppend(FS_KEY key, const u8 * data, u8 length)
+{
+  u8 record[FS_RECORDLEN(FS_MAXVALUELEN)];
+  u8 * address = FlashStore.Block + FlashStore.Free;
+
+  // build it in ram first, data may well be pointing at the flash
+  record[0] = key;
+  record[1] = length;
+  memcpy(&record[2],data,length);
+  record[FS_RECORDLEN(length) - 1] = FlashStoreCheck(record,length);
+
+  if ( !FlashStoreProgram(address,record,FS_RECORDLEN(length)) || memcmp(address,record,FS_RECORDLEN(length)) )
+  {
+    DEBUG("Flash Store Write Error\r\n");
+    FlashStore.Free = FS_BLOCKSIZE; // don't write over a half written record, the next write will compact
+    return false;
+  }
+  FlashStore.Free += FS_RECORDLEN(length);
+  return true;
+}
+/********************************************************************************************************************************/
+
+static FS_PENDING * FlashStoreFindPending(FS_KEY key)
+{
+  u8 loop;
+
+  for ( loop = 0 ; loop < FlashStore.Pending ; loop++ )
+  {
+    if ( FlashStore.PendingRecords[loop].Key == key )
+    {
+      return &FlashStore.PendingRecords[loop];
+    }
+  }
+  return 0;
+}
+/********************************************************************************************************************************/
+
+// Copies the latest value of every key into the other block and makes that the live one, see FS_STATE
+static void FlashStoreCompactStart(void)
+{
+  DEBUG("Flash Store Compact\r\n");
+  FlashStore.From = FlashStore.Block;
+  FlashStore.OldFree = FlashStore.Free;
+  FlashStoreEraseStart( ( FlashStore.From == FS_BLOCK_A ) ? FS_BLOCK_B : FS_BLOCK_A );
+  FlashStore.State = FS_ERASE_NEW;
+}
+/********************************************************************************************************************************/
+
+// Everything is copied, add what has been waiting and mark the new block live
+static bool FlashStoreCompactFinish(void)
+{
+  u8 header[FS_HEADERLEN];
+  u8 loop;
+
+  for ( loop = 0 ; loop < FlashStore.Pending ; loop++ )
+  {
+    if ( !FlashStoreAppend((FS_KEY)FlashStore.PendingRecords[loop].Key,FlashStore.PendingRecords[loop].Data,
+                           FlashStore.PendingRecords[loop].Length) )
+    {
+      return false;
+    }
+  }
+  header[0] = FS_MARKER;
+  header[1] = FlashStore.Sequence + 1;
+  if ( !FlashStoreProgram(FlashStore.Block + 1, &header[1], 1) || !FlashStoreProgram(FlashStore.Block, header, 1) )
+  {
+    return false;
+  }
+  FlashStore.Sequence++;
+  FlashStore.Pending = 0;
+  FlashStoreEraseStart(FlashStore.From); // so it can't be mistaken for the live block
+  FlashStore.State = FS_ERASE_OLD;
+  return true;
+}
+/********************************************************************************************************************************/
+
+// the old block is still good, carry on with that. What was waiting is lost.
+static void FlashStoreCompactFail(void)
+{
+  DEBUG("Flash Store Compact Error\r\n");
+  FlashStore.Block = FlashStore.From;
+  FlashStore.Free = FlashStore.OldFree;
+  FlashStore.Pending = 0;
+  FlashStore.State = FS_IDLE;
+}
+/********************************************************************************************************************************/
+
+static bool FlashStoreProgram(u8 * address, const u8 * data, u16 length)
+{
+  __istate_t state = __get_interrupt_state();
+  bool ok = true;
+
+  __disable_interrupt();
+  fmr01 = 0;
+  fmr01 = 1;                      // CPU rewrite mode
+  fmr11 = 0;
+  fmr11 = 1;                      // EW1 mode, so we keep running from program flash while the data flash is written
+  while ( length-- && ok )
+  {
+    *address = FS_CMD_PROGRAM;
+    *address = *data++;
+    while ( !fmr00 );             // wait till the sequencer is ready
+    if ( fmr06 )                  // program error
+    {
+      *address = FS_CMD_CLRSTATUS;
+      ok = false;
+    }
+    address++;
+  }
+  *FS_BLOCK_A = FS_CMD_READARRAY;
+  fmr01 = 0;
+  __set_interrupt_state(state);
+  return ok;
+}
+/********************************************************************************************************************************/
+
+// Starts an erase and leaves the data flash in CPU rewrite mode till FlashStoreEraseDone() sees it finish. We carry on
+// running from program flash, interrupts and all, while it goes.
+static void FlashStoreEraseStart(u8 * block)
+{
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  fmr01 = 0;
+  fmr01 = 1;                      // CPU rewrite mode
+  fmr11 = 0;
+  fmr11 = 1;                      // EW1 mode
+  *block = FS_CMD_ERASE;
+  *block = FS_CMD_ERASE_OK;
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+// false while the erase is still going, then true once with ok set if it worked
+static bool FlashStoreEraseDone(bool * ok)
+{
+  if ( !fmr00 )                   // sequencer still busy
+  {
+    return false;
+  }
+  *ok = !fmr07;                   // erase error
+  if ( fmr07 )
+  {
+    *FS_BLOCK_A = FS_CMD_CLRSTATUS;
+  }
+  *FS_BLOCK_A = FS_CMD_READARRAY;
+  fmr01 = 0;
+  return true;
+}
+/********************************************************************************************************************************/
@@ -0,0 +1,39 @@
+#ifndef FLASH_STORE_H
+#define FLASH_STORE_H
+
+#include "common.h"
+
+// Small key/value store in the R8C data flash (blocks A and B). Values are appended as records, the latest one
+// for a key wins, and when a block fills up the live values are copied into the other block, so the wear is spread
+// over both blocks and over every byte in them.
+
+// Never renumber these, records already in the flash use them.
+typedef enum
+{
+  FSK_DISPLAY_ID = 1,     // u16 identifier of the display we last programmed
+  FSK_DISPLAY_CONFIG,     // its config blocks as they were verified after programming
+  FSK_NM_NETLIST,         // u16 NM netlist last seen with the ring running
+  FSK_CAR_VARIANT,        // u8 bits describing the car, see CarsideInternal.h
+  FSK_SPEED_PROFILE,      // u8 SPEEDPROFILE the head unit wants, set by diagnostics
+  FSK_STALK_VARIANT,      // u8 STALKVARIANT, set by diagnostics
+  FSK_STALK_MAP,          // upto STALKUSERMAPMAX stalk mappings, set by diagnostics
+  FSK_STALK_GESTURES,     // STALKGESTURELEN bytes of gesture thresholds, set by diagnostics
+  FSK_END
+}FS_KEY;
+
+#define FS_MAXVALUELEN  16
+
+// Call once at startup before anything reads the store.
+void FlashStoreInit(void);
+// Copies the latest value for key into data. Returns its length, 0 if there isn't one or it won't fit in maxlength.
+// While a compact is erasing, only values written since it started can be read.
+u8 FlashStoreRead(FS_KEY key, u8 * data, u8 maxlength);
+// Stores a new value for key. Nothing is written if the value is already there. Returns false if the write failed.
+// When the block is full the value is held in ram while the store compacts, which FlashStoreRun() does a step at a time.
+bool FlashStoreWrite(FS_KEY key, const u8 * data, u8 length);
+// Task, moves a compact on. Keeps the tick going till it is done.
+void FlashStoreRun(void);
+// A compact is under way, don't sleep
+bool FlashStoreBusy(void);
+
+#endif
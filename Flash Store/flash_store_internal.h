@@ -0,0 +1,70 @@
+#ifndef FLASH_STORE_INTERNAL_H
+#define FLASH_STORE_INTERNAL_H
+
+#include "flash_store.h"
+
+#define FS_BLOCK_A        ((u8 *)0x2400)      // data flash block A
+#define FS_BLOCK_B        ((u8 *)0x2800)      // data flash block B
+#define FS_BLOCKSIZE      0x400
+
+// Each block starts with a 2 byte header, [marker][sequence], followed by records packed back to back up to the first
+// erased byte. A record is [key][length][data...][check]. The marker is written last when a block is built, so a
+// block that lost power half way through is never taken as the live one. When both blocks are marked the one with
+// the next sequence number is the newer.
+#define FS_MARKER         0xa5
+#define FS_ERASED         0xff
+#define FS_HEADERLEN      2
+#define FS_RECORDLEN(len) ( 3 + (len) )
+
+// flash sequencer commands
+#define FS_CMD_PROGRAM    0x40
+#define FS_CMD_ERASE      0x20
+#define FS_CMD_ERASE_OK   0xd0
+#define FS_CMD_CLRSTATUS  0x50
+#define FS_CMD_READARRAY  0xff
+
+// A compact erases the other block, copies one key a step into it, adds the values waiting in ram, then erases the old
+// block. An erase takes a few hundred ms, the data flash carries on with it on its own while we poll it from the task.
+typedef enum
+{
+  FS_IDLE,
+  FS_ERASE_NEW,
+  FS_COPY,
+  FS_ERASE_OLD
+}FS_STATE;
+
+#define FS_PENDINGMAX     2     // writes that can wait for a compact
+
+typedef struct
+{
+  u8 Key;
+  u8 Length;
+  u8 Data[FS_MAXVALUELEN];
+}FS_PENDING;
+
+static struct
+{
+  u8 * Block;           // live block, 0 if the flash couldn't be set up
+  u16 Free;             // offset of the first free byte in it
+  u8 Sequence;
+  FS_STATE State;
+  u8 * From;            // the block being compacted
+  u16 OldFree;
+  u8 Key;               // next one to copy
+  u8 Pending;           // used in PendingRecords[]
+  FS_PENDING PendingRecords[FS_PENDINGMAX];
+}FlashStore;
+
+static u16 FlashStoreScan(u8 * block);
+static u8 * FlashStoreFind(u8 * block, u16 end, FS_KEY key);
+static u8 FlashStoreCheck(const u8 * record, u8 length);
+static bool FlashStoreAppend(FS_KEY key, const u8 * data, u8 length);
+static FS_PENDING * FlashStoreFindPending(FS_KEY key);
+static void FlashStoreCompactStart(void);
+static bool FlashStoreCompactFinish(void);
+static void FlashStoreCompactFail(void);
+static bool FlashStoreProgram(u8 * address, const u8 * data, u16 length);
+static void FlashStoreEraseStart(u8 * block);
+static bool FlashStoreEraseDone(bool * ok);
+
+#endif
@@ -2,6 +2,8 @@
 #include "common.h"
 #include "iso15765.h"
 #include "iso15765_internal.h"
+#include "timer.h"
+#include "can_trace.h"
 #include <string.h>
 
 /////////////////////////////////////////
@@ -75,7 +77,7 @@ static uint16 ISO15765_ChTxChunk (ISO15765_Channel *chan)
       outpkt[1] = (chan->pkt_length & 0xff);                    // rest of length is in the second byte
       memcpy (&outpkt[2], chan->buffer, 6);                     // which leaves 6 bytes for the start of the packet
       res = UUDT_Tx(chan->xmitid, 8, outpkt, ISO15765_CreateTagFromChanPtr(chan, TAG_FF));
-      chan->pkttimer = N_Bs - TIMER_RESOLUTION;
+      TimerArm(&chan->pkttimer, N_Bs - TIMER_RESOLUTION);
       chan->buffer_pos += 6;
       chan->next_seq ++;
     }
@@ -94,7 +96,7 @@ static uint16 ISO15765_ChTxChunk (ISO15765_Channel *chan)
         res = UUDT_Tx(chan->xmitid, size + 1, outpkt, ISO15765_CreateTagFromChanPtr(chan, TAG_CF));
         chan->buffer_pos += size;
         chan->next_seq ++;
-        chan->pkttimer = N_Bs - TIMER_RESOLUTION;
+        TimerArm(&chan->pkttimer, N_Bs - TIMER_RESOLUTION);
         if (chan->next_seq > 0xF)
         {
           chan->next_seq = 0;
@@ -104,7 +106,7 @@ static uint16 ISO15765_ChTxChunk (ISO15765_Channel *chan)
         {
           chan->tbs = 0;                // Send no more packets
           chan->gstate = ISO15765_GSTATE_IDLE;
-          chan->pkttimer = 0x7FFF;
+          TimerStop(&chan->pkttimer);
         }
       }
     }
@@ -209,7 +211,7 @@ static void ReceiveMultiFrame (ISO15765_Channel *chan, TCANPacket *pkt)
             // Setup the channel for receiving a multi-segmented packet
             chan->buffer_pos = 6; // Next packet will start being received here.
             chan->gstate = ISO15765_GSTATE_AWAIT_CF;
-            chan->pkttimer = TL_A - TIMER_RESOLUTION;
+            TimerArm(&chan->pkttimer, TL_A - TIMER_RESOLUTION);
             chan->next_seq = 1;
             chan->pkt_length = length;  // Actual length of packet
             chan->flags |= ISO15765F_RETRY_DELAY; // Don't add 100ms retry delay to our timer
@@ -270,7 +272,7 @@ static void ReceiveMultiFrame (ISO15765_Channel *chan, TCANPacket *pkt)
             else
             {
               // Packet still incomplete, send FC.
-              chan->pkttimer = TL_A - TIMER_RESOLUTION;
+              TimerArm(&chan->pkttimer, TL_A - TIMER_RESOLUTION);
               chan->flags |= ISO15765F_RETRY_DELAY; // Don't add 100ms retry delay to our timer
               SendFC (chan, FCFS_CTS, 1, 0);
             }
@@ -278,7 +280,7 @@ static void ReceiveMultiFrame (ISO15765_Channel *chan, TCANPacket *pkt)
           else // Sequence number is incorrect.
           {
             chan->flags |= (ISO15765F_INVALIDPKT | ISO15765F_MINOR_ERROR | ISO15765F_RETRY_DELAY);
-            chan->pkttimer = 1;
+            TimerArm(&chan->pkttimer, 1);
           }
         }
       }
@@ -313,7 +315,7 @@ static void TransmitFrame (ISO15765_Channel *chan, TCANPacket *pkt)
         {
         case FCFS_CTS:
           // Reset our FC timer
-          chan->pkttimer = N_Bs - TIMER_RESOLUTION;
+          TimerArm(&chan->pkttimer, N_Bs - TIMER_RESOLUTION);
 
           // Only take the info from the first FC received per segmented packet
           if ((chan->flags & ISO15765F_RECEIVED_FCCTS) == 0)
@@ -357,7 +359,7 @@ static void TransmitFrame (ISO15765_Channel *chan, TCANPacket *pkt)
             chan->tstmin = chan->fp_st;
 
             // Valid FC, send out a CF ASAP.
-            chan->tsttimer = 1;
+            TimerArm(&chan->tsttimer, 0);
           }
           else
           {
@@ -366,7 +368,7 @@ static void TransmitFrame (ISO15765_Channel *chan, TCANPacket *pkt)
             chan->tstmin = chan->fp_st;
 
             // Valid FC, send out a CF ASAP.
-            chan->tsttimer = 1;
+            TimerArm(&chan->tsttimer, 0);
           }
           break;
         case FCFS_WAIT:
@@ -374,7 +376,7 @@ static void TransmitFrame (ISO15765_Channel *chan, TCANPacket *pkt)
         default:
           // Invalid packet, mark as such and retry
           chan->flags |= (ISO15765F_INVALIDPKT | ISO15765F_RETRY_DELAY);
-          chan->pkttimer = TL_B - TIMER_RESOLUTION;
+          TimerArm(&chan->pkttimer, TL_B - TIMER_RESOLUTION);
           break;
         }
       }
@@ -463,7 +465,14 @@ uint16 ISO15765_Connect (ISO15765_Channel *chan, uint16 chid, uint16 xmitid, uin
 {
   if ((xmitid) && (rcvid))                                                                      // Both ID's are valid?
   {
+    // A reconnected channel's timers are already on the timer chain, keep their links
+    TTimer pkttimer = chan->pkttimer;
+    TTimer tsttimer = chan->tsttimer;
+
     memset(chan,0,sizeof(ISO15765_Channel) );
+    chan->pkttimer = pkttimer;
+    chan->tsttimer = tsttimer;
+    TimerStop(&chan->tsttimer);
     chan->xmitid = xmitid;
     chan->rcvid = rcvid;
     chan->chid = chid;
@@ -472,7 +481,7 @@ uint16 ISO15765_Connect (ISO15765_Channel *chan, uint16 chid, uint16 xmitid, uin
     chan->dir = dir;
     chan->tstate = ISO15765_TSTATE_CONNOK;
     chan->gstate = ISO15765_GSTATE_IDLE;
-    chan->pkttimer = 0x7FFF;
+    TimerStop(&chan->pkttimer);
     return 0;
   }
   return (uint16)-1;
@@ -503,7 +512,7 @@ uint16 ISO15765_ChTx (ISO15765_Channel *chan, uint8 *pkt, uint16 length)
       if (length < 8)
       {
         chan->gstate = ISO15765_GSTATE_IDLE;
-        chan->pkttimer = 0x7FFF;
+        TimerStop(&chan->pkttimer);
         chan->retries = 0;
         chan->buffer_pos = length;
         chan->pkt_length = length;
@@ -602,10 +611,9 @@ uint16 ISO15765_RunCycle (ISO15765_Channel *chan)
 
   if (chan->tstate != ISO15765_TSTATE_INVALID)
   {
-    if (((chan->gstate & 0xF0) == ISO15765_GSTATE_AWAITING) && (chan->pkttimer != 0x7FFF))
+    if ((chan->gstate & 0xF0) == ISO15765_GSTATE_AWAITING)
     {
-      chan->pkttimer --;
-      if (chan->pkttimer <= 0)
+      if (TimerExpired(&chan->pkttimer))
       {
         // Timer triggered. Find out what we were waiting for and retry if possible.
         if ((chan->flags & ISO15765F_RETRY_DELAY) == 0)
@@ -613,7 +621,8 @@ uint16 ISO15765_RunCycle (ISO15765_Channel *chan)
           // Not yet done the retry delay, mark the packet as invalid just in case someone tries to talk about the packet we
           // have just canceled.
           chan->flags |= (ISO15765F_RETRY_DELAY | ISO15765F_INVALIDPKT);
-          chan->pkttimer = TL_B - TIMER_RESOLUTION;
+          TimerArm(&chan->pkttimer, TL_B - TIMER_RESOLUTION);
+          CANTRACE_MARK(CANTRACEMARK_ISOTIMEOUT);
         }
         else // ISO15765F_RETRY_DELAY is set
         {
@@ -621,7 +630,7 @@ uint16 ISO15765_RunCycle (ISO15765_Channel *chan)
           {
           case ISO15765_GSTATE_AWAIT_CF:
             // We were expecting a consecutive frame from the display, but didn't get it. Abort the packet receive.
-            chan->pkttimer = 0;
+            TimerStop(&chan->pkttimer);
             chan->flags = 0;
             chan->gstate = ISO15765_GSTATE_IDLE;
             break;
@@ -660,14 +669,14 @@ uint16 ISO15765_RunCycle (ISO15765_Channel *chan)
             break;
           default:
             // Don't know what brought us here, must be bogus.
-            chan->pkttimer = 0;
+            TimerStop(&chan->pkttimer);
             // We must clear the gstate now the timer is no more, otherwise we will constantly come back in here
             chan->gstate = ISO15765_GSTATE_IDLE;
             break;
           } // switch
         }   // ISO15765F_RETRY_DELAY if
       }
-      else
+      else if (TimerRunning(&chan->pkttimer))
       {
         // Packet timer hasn't expired, See if this channel is transmitting a large packet
         if ((chan->gstate == ISO15765_GSTATE_AWAIT_FC) && ((chan->flags & (ISO15765F_INVALIDPKT | ISO15765F_WAITING_TXOK)) == 0))
@@ -675,14 +684,12 @@ uint16 ISO15765_RunCycle (ISO15765_Channel *chan)
           // see if we need to send another portion of it (check block size & timer)
           if (chan->tbs)
           {
-            chan->tsttimer --;
-            if (chan->tsttimer <= 0)
+            if (TimerExpired(&chan->tsttimer))
             {
-              chan->tsttimer = chan->tstmin;
               chan->tbs --;
               // Comms looks ok - reset our retry counter.
               ISO15765_ChTxChunk(chan);
-              // Don't start decrementing the timer for the next packet until this one has successfully been transmitted
+              // Don't start the timer for the next packet until this one has successfully been transmitted
               if (chan->tbs)
               {
                 // We need to autosend the next CF, wait until this has cleared first.
@@ -739,7 +746,11 @@ void ISO15765_ReportSuccess (ISO15765_Channel *chan, uint16 tag)
   {
     if (chan->tstate != ISO15765_TSTATE_INVALID)
     {
-      chan->flags &= ~ISO15765F_WAITING_TXOK;
+      if (chan->flags & ISO15765F_WAITING_TXOK)
+      {
+        chan->flags &= ~ISO15765F_WAITING_TXOK;
+        TimerArm(&chan->tsttimer, chan->tstmin);
+      }
     }
   }
 }
@@ -1,6 +1,8 @@
 #ifndef ISO15765_H
 #define ISO15765_H
 
+#include "timer.h"
+
 typedef enum
 {
   ISODIR_RX, // Receive only
@@ -9,7 +11,8 @@ typedef enum
 } ISO15765_Dir;
 /// Everything about an ISO15765 channel is listed here.
 /// Since we may receive multiple, segmented, ISO15765 packets, it's a good idea to have the buffer local to each ISO15765 channel too.
-/// Maximum value for timers (tstmin, pkttimer, tsttimer) is 32767ms.
+/// Maximum value for timers (tstmin, pkttimer, tsttimer) is 32767ms. pkttimer and tsttimer are deadlines on the central
+/// timer service, stopped when not in use.
 typedef struct
 {
   uint16 chid;                  ///< Channel ID, specifies position in channel array, used when dereferencing a channel pointer
@@ -25,8 +28,8 @@ typedef struct
   uint16 completed;                 ///< Indicates whether or not the packet has completed transmission
   uint16 tstmin;                    ///< Minimum time gap between transmission of consecutive data frames
   uint16 tbs;                     ///< Transmit block size (number of packets to send before waiting for next FC)
-  sint16 pkttimer;                  ///< Maximum time gap between FCs or CFs before considering an error
-  sint16 tsttimer;                  ///< tstmin timer, when zero, sends out another packet if bs != 0
+  TTimer pkttimer;                  ///< Maximum time gap between FCs or CFs before considering an error
+  TTimer tsttimer;                  ///< tstmin timer, when due, sends out another packet if bs != 0
   uint16 retries;                 ///< Number of resends so far of a certain packet type
   uint16 flags;                   ///< Flags, reset to zero when a packet is resent from the beginning
   uint16 fp_bs;                   ///< 'BS' value from the first FC packet
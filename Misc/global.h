@@ -43,8 +43,6 @@ struct global_def
   u8  reverse;
   u16 speed;
   u8  parkbrake;
-  u16 delay;
-  u16 sleeptimer;         // sleep
   u8  sleep;
   u8  count;
   u8  hold;
@@ -5,12 +5,25 @@
 #include "can_internal.h"
 #include <string.h>
 #include "global.h"
+#include "scheduler.h"
+#include "can_trace.h"
+#include "can_monitor.h"
 
 //#pragma diag_suppress=pe177,pe826
 
 /*
 	Revision history
 
+        19 Oct 26 - CANRx() keeps handing over received frames and transmit tags while bus off, the error is only reported
+                    once there is nothing else. Bus off holds up transmit, not receive.
+
+        19 Oct 26 - TXNextPkt() no longer spins waiting for the transmit channel to disable, the packet stays queued for the
+                    next CANSide(). CANRxPending() added so the main loop only runs the receive task when there is something
+                    for it, not for the whole time a frame is going out.
+
+        19 Oct 26 - bus off no longer needs CANInit(). The controller comes back by itself after 128*11 recessive bits,
+                    CANBusOffRecover() clears the error once it has. The TX queue is held, not timed out, while bus off.
+
         09 Feb 09 - changed code that tx queue and rx queue can be set to different sizes
                   - changed can init data to that it only stores a pointer rather than a copy of the data itself
                     this means that the calling function MUST keep the structure intact for all the time that the can routines are running
@@ -70,8 +83,9 @@ TExtCANInfo can;
 
 /// Retrieve a packet from the internal circular buffer. If an error is reported, the 'pkt' structure is NOT filled in.
 /// Errors take priority over normal data to signify conditions like overrun/etc. All errors, apart from CANERR_RX_BUSOFF are
-/// cleared when this function has reported them via the return value. To clear the CANERR_RX_BUSOFF error, a call to CANInit()
-/// is required. It may take 1,408 (128*11) consecutive recessive bits before reception and transmit is possible again.
+/// cleared when this function has reported them via the return value. To clear the CANERR_RX_BUSOFF error, a call to
+/// CANBusOffRecover() or CANInit() is required. Bus off only holds up transmit, so it is reported once everything received
+/// and every transmit tag has been handed over, and frames keep coming out while we wait to go back on the bus.
 /// You can tell which packets transmit ok as the packet tags will be placed into the tag of RX_OK or RX_NODATA
 /// \param pkt Where to put the received data, if any. cplen member must be valid.
 /// \return One of CANERR_RX_*
@@ -87,8 +101,8 @@ CANErr CANRx (TCANPacket *pkt)
 	{
 		if ((pkt) && (pkt->cplen == sizeof(TCANPacket)))
 		{
-			// Check for errors first
-			if (CANErrors)
+			// Check for errors first, bus off comes after the data
+			if (CANErrors & (~canerr_busoff))
 			{
 				// Looks like we got a live one!
 				if ((CANErrors & canerr_overrun) != 0)
@@ -103,11 +117,6 @@ CANErr CANRx (TCANPacket *pkt)
 					CANErrors &= (~canerr_buserror);		
 					err = CANERR_RX_BUSERR;
 				}
-				else if ((CANErrors & canerr_busoff) != 0)
-				{
-					// Just report the error.
-					err = CANERR_RX_BUSOFF;
-				}
 				else if ((CANErrors & canerr_txtimeout) != 0)
 				{
 					// Clear the error, report the error
@@ -129,6 +138,11 @@ CANErr CANRx (TCANPacket *pkt)
 				{
 					err = CANERR_RX_OK;
 				}
+				else if (((CANErrors & canerr_busoff) != 0) && (OutBuffer_Tags.in == OutBuffer_Tags.out))
+				{
+					// Nothing left to hand over, just report the error.
+					err = CANERR_RX_BUSOFF;
+				}
 				else
 				{
 					err = CANERR_RX_NODATA;
@@ -174,7 +188,7 @@ CANErr CANTx (TCANPacket *pkt)
 			{				
 				// Packet queued ok. See if we need to kickstart it.
 				err = CANERR_TX_OK;
-				if (TXInt_Finished)
+				if ((TXInt_Finished) && ((CANErrors & canerr_busoff) == 0))
 				{
 					// Interrupt will not be called again until another packet has been sent
 					TXNextPkt();
@@ -249,6 +263,7 @@ CANErr CANSleep (void)
 		// Shutdown can controller and go into sleep mode. Wake up on incoming packet.
 		CANInit_SelectMode(CIM_RESET);
 		CANInit_SelectMode(CIM_SLEEP);
+		C01WKIC = 1;	// wake-up interrupt on (priority 1), the rest stay polled
 		
 		// tja1054a standby
 		// en = 0x40, stb = 0x20
@@ -283,6 +298,38 @@ CANErr CANSleep (void)
 
 /********************************************************************************************************************************/
 
+/// Clear a CANERR_RX_BUSOFF error without reinitialising. The controller returns to error active by itself after 128
+/// occurrences of 11 consecutive recessive bits, until it has this does nothing. Neither buffer is touched, so frames
+/// queued during the bus off go out as soon as CANSide() is next called.
+/// \return One of CANERR_BUSOFF_*
+/// \par Side effects
+/// May modify file scope variable CANErrors
+CANErr CANBusOffRecover (void)
+{
+	CANErr err = CANERR_INTERNAL_ERROR;
+
+	if (Init_OK)
+	{
+		if ((C0STR & 0x4000) == 0)
+		{
+			// Back on the bus. Any packet left in slot 0 is retried by the controller and finishes through the TX interrupt.
+			CANErrors &= (~canerr_busoff);
+			err = CANERR_BUSOFF_RECOVERED;
+		}
+		else
+		{
+			err = CANERR_BUSOFF_WAITING;
+		}
+	}
+	else
+	{
+		err = CANERR_NOT_INITIALISED;
+	}
+	return err;
+}
+
+/********************************************************************************************************************************/
+
 /// Setup the CAN controller to specification supplied in 'initdata'.
 /// A single channel is configured to use as a transmit channel. \n
 /// Upto 15 channels are available as receive channels, one per unique id. Fill in the ID's required in the \a initdata structure.
@@ -348,62 +395,71 @@ CANErr CANInit (TCANInitData *initdata)
 /// May modify file scope variables TXInt_Finished, LastTXPacketTimer, OutBuffer \n
 /// \note
 /// Call CANInit() before calling this function. (This code should only be run after car side has initialised anyway)
+/// Whilst bus off nothing is timed out or scheduled, the queue waits for CANBusOffRecover().
 void CANSide (void)
 {
 	uint8 sleep_ok = 1;
 
-#if 1
-	// Check for packets that have taken too long to transmit.
-	if (!TXInt_Finished)
+	if (CANErrors & canerr_busoff)
 	{
+		// Nothing can go out, so don't time out what's in slot 0 or load the next one.
 		sleep_ok = 0;
-		if (LastTXPacketTimer > LocalInitData->tout)
+	}
+	else
+	{
+#if 1
+		// Check for packets that have taken too long to transmit.
+		if (!TXInt_Finished)
 		{
-			// Kill the outgoing packet. We know the interrupt can clear the TXInt_Finished flag at any time, but if a packet has
-			// been waiting for this long, then the chances are that it's not going to be sent anyway, and even if it did manage
-			// to get sent, cancelling an empty buffer pretty much gets changed to a "no operation".
+			sleep_ok = 0;
+			if (LastTXPacketTimer > LocalInitData->tout)
+			{
+				// Kill the outgoing packet. We know the interrupt can clear the TXInt_Finished flag at any time, but if a packet has
+				// been waiting for this long, then the chances are that it's not going to be sent anyway, and even if it did manage
+				// to get sent, cancelling an empty buffer pretty much gets changed to a "no operation".
 			
-			C0MCTL0 = 0;
-			if ((C0MCTL0 & 2) == 0)		// As soon as abort is actually carried out, transmitting bit changes back to zero.
-			{									// If the kill was ignored, then keep trying each time we come through.
-				TXInt_Finished = 1;
-				CANErrors |= canerr_txtimeout;
-				LastTXPacketTag_Fail = LastTXPacketTag;
-				LastTXPacketTag = 0;
-				// Do we need to purge the tx buffer?
-				if (LocalInitData->flags & CIF_CLRBUFTXER)
-				{
-					CANFlush(CANF_TX_BUFFER, 0);
+				C0MCTL0 = 0;
+				if ((C0MCTL0 & 2) == 0)		// As soon as abort is actually carried out, transmitting bit changes back to zero.
+				{									// If the kill was ignored, then keep trying each time we come through.
+					TXInt_Finished = 1;
+					CANErrors |= canerr_txtimeout;
+					LastTXPacketTag_Fail = LastTXPacketTag;
+					LastTXPacketTag = 0;
+					// Do we need to purge the tx buffer?
+					if (LocalInitData->flags & CIF_CLRBUFTXER)
+					{
+						CANFlush(CANF_TX_BUFFER, 0);
+					}
 				}
 			}
+			else
+			{
+				// Only increment the timer when it's less or equal to 'tout' in 'initdata' struct.
+				LastTXPacketTimer ++;
+			}
 		}
 		else
-		{
-			// Only increment the timer when it's less or equal to 'tout' in 'initdata' struct.
-			LastTXPacketTimer ++;
-		}
-	}
-	else
 #endif
-	{
-		// If tag isn't invalid (0) then append it to the tag queue as the packet must have been a success
-		if (LastTXPacketTag)
 		{
-			OutBuffer_Tags.buffer[OutBuffer_Tags.in++] = LastTXPacketTag;
-			if (OutBuffer_Tags.in >= TXCACHE_SIZE)
+			// If tag isn't invalid (0) then append it to the tag queue as the packet must have been a success
+			if (LastTXPacketTag)
 			{
-				OutBuffer_Tags.in = 0;
-			}
+				OutBuffer_Tags.buffer[OutBuffer_Tags.in++] = LastTXPacketTag;
+				if (OutBuffer_Tags.in >= TXCACHE_SIZE)
+				{
+					OutBuffer_Tags.in = 0;
+				}
 
-			LastTXPacketTag = 0;
+				LastTXPacketTag = 0;
+			}
 		}
-	}
 	
-	// Check to see if we need to schedule a new packet transmission.
-	if (OutBuffer.buffer[OutBuffer.out].cplen)
-	{
-		sleep_ok = 0;
-		TXNextPkt();
+		// Check to see if we need to schedule a new packet transmission.
+		if (OutBuffer.buffer[OutBuffer.out].cplen)
+		{
+			sleep_ok = 0;
+			TXNextPkt();
+		}
 	}
 	
 	if (sleep_ok)
@@ -686,7 +742,7 @@ static uint16 CANInit_ConfigureInterrupts (void)
    *c0icr = 0xFFFF;							// Interrupt disable on all channels
 
    C01WKIC = 0; // CAN wakeup interrupt = enabled (priority 1)
-   C0RECIC = 0; // CAN receive takes priority over transmit
+   C0RECIC = 1; // CAN receive (priority 1), wakes the CPU and readies the receive task, can_int() still reads the slots
    C0TRMIC = 0; // CAN transmit ...
    C01ERRIC = 0; // CAN error ...
 
@@ -714,47 +770,40 @@ static uint16 TXNextPkt(void)
 	if ((TXInt_Finished) && ((C0MCTL0 & 2) == 0))	// Ensure tx interrupt has finished, and that a packet is not already being transmitted.
 	{																
 		TCANPacket xmit;
-		if (CB_RetrieveTX(&OutBuffer, &xmit))
+		// First thing to do is disable the transmit channel. This may not happen straight away, so rather than wait for it
+		// ask for it and come back on the next CANSide() with the packet still queued.
+		C0MCTL0 = 0;
+		if (C0MCTL0 != 0)
+		{
+			ok = 0;
+		}
+		else if (CB_RetrieveTX(&OutBuffer, &xmit))
 		{
 			if (xmit.cplen == sizeof(TCANPacket))
 			{
-				// First thing to do is disable the transmit channel. This may not happen straight away, so we need to confirm it.
-				uint16 timer = 0xFFFF;
-
-				while ((C0MCTL0 != 0) && (timer > 0))
+				// Controller should now accept the packet, so should be safe to set the TXInt_Finished flag.
+				// This will cause us not to be called again until we have a successfull acknowledgement on this one.
+				TXInt_Finished = 0;
+
+				// Setup slot with ID and data.
+				slot0[0] = (uint8)((xmit.id) >> 6);			// SID 6 - 10
+				slot0[1] = (uint8)((xmit.id) & 0x3F);		// SID 0 - 5
+				slot0[2] = 0;													// EID 14 - 17 (Unused)
+				slot0[3] = 0;													// EID 6 - 13  (Unused)
+				slot0[4] = 0;													// EID 5 - 0   (Unused)
+				slot0[5] = xmit.dlc;											// DLC
+			
+				uint16 lp;
+				for (lp = 0; lp < xmit.dlc; lp ++)
 				{
-					C0MCTL0 = 0;
-					timer --;
-					if (timer == 0)
-					{
-						ok = 0;
-					}
-				}
-
-				if (ok)
-				{
-					// Controller should now accept the packet, so should be safe to set the TXInt_Finished flag.
-					// This will cause us not to be called again until we have a successfull acknowledgement on this one.
-					TXInt_Finished = 0;
-
-					// Setup slot with ID and data.
-					slot0[0] = (uint8)((xmit.id) >> 6);			// SID 6 - 10
-					slot0[1] = (uint8)((xmit.id) & 0x3F);		// SID 0 - 5
-					slot0[2] = 0;													// EID 14 - 17 (Unused)
-					slot0[3] = 0;													// EID 6 - 13  (Unused)
-					slot0[4] = 0;													// EID 5 - 0   (Unused)
-					slot0[5] = xmit.dlc;											// DLC
-				
-					uint16 lp;
-					for (lp = 0; lp < xmit.dlc; lp ++)
-					{
-						slot0[6+lp] = xmit.data[lp];
-					}
-						
-					C0MCTL0 |= 0x80;												// Queue for transmission
-					LastTXPacketTimer = 0;										// New packet has been sent
-					LastTXPacketTag = xmit.tag;
+					slot0[6+lp] = xmit.data[lp];
 				}
+					
+				C0MCTL0 |= 0x80;												// Queue for transmission
+				LastTXPacketTimer = 0;										// New packet has been sent
+				LastTXPacketTag = xmit.tag;
+				CANTRACE_FRAME(xmit.id,xmit.dlc,xmit.data,true);
+				CanMonitorFrame(xmit.dlc);
 			}
 			else
 			{
@@ -991,6 +1040,8 @@ void can_int (void)
     {
       CANErrors |= canerr_busoff;
       CANErrStat |= canerr_busoff;
+      CANTRACE_MARK(CANTRACEMARK_BUSOFF);
+      CanMonitorBusOff();
     }
   }
   else
@@ -1043,11 +1094,15 @@ void can_int (void)
         // Yup, it's been overwritten whilst we were reading it. Don't place into buffer as it could be corrupt.
         CANErrors |= canerr_overrun;	
         (*slotctrl) &= 0xFB;							// Clear overwrite flag
+        CANTRACE_MARK(CANTRACEMARK_OVERRUN);
+        CanMonitorOverrun();
       }
       else
       {
         pkt->cplen = sizeof (TCANPacket);		// Mark packet as valid
         pkt->tag = 0;
+        CANTRACE_FRAME(pkt->id,pkt->dlc,pkt->data,false);
+        CanMonitorFrame(pkt->dlc);
         InBuffer.in ++;
         if (InBuffer.in == RXCACHE_SIZE)
         {
@@ -1060,7 +1115,44 @@ void can_int (void)
       // No room to store the packet, so we need to loose it.
       (*slotctrl) &= 0xFA;								// Mark slot as read, and clear any possible overwrite flag
       CANErrors |= canerr_overrun;						
+      CANTRACE_MARK(CANTRACEMARK_OVERRUN);
+      CanMonitorOverrun();
     }
   }
 //  TESTLED = 0;
 }
+/********************************************************************************************************************************/
+
+uint8 CANIdle (void)
+{
+	return ((InBuffer.buffer[InBuffer.out].cplen == 0) && (CANErrors == 0) && (TXInt_Finished) && (LastTXPacketTag == 0) &&
+					(OutBuffer.buffer[OutBuffer.out].cplen == 0) && (OutBuffer_Tags.in == OutBuffer_Tags.out));
+}
+
+/********************************************************************************************************************************/
+
+uint8 CANRxPending (void)
+{
+	return ((InBuffer.buffer[InBuffer.out].cplen != 0) || ((CANErrors & (~canerr_busoff)) != 0) ||
+					(OutBuffer_Tags.in != OutBuffer_Tags.out));
+}
+
+/********************************************************************************************************************************/
+
+/// CAN receive interrupt. Brings the CPU out of wait mode and readies the receive task, which calls can_int() to pick the
+/// frame up.
+#pragma vector = 4
+static __interrupt void CANRxIntr (void)
+{
+	TaskReady(TASK_CANRX);
+}
+
+/********************************************************************************************************************************/
+
+/// CAN wake-up interrupt, armed by CANSleep(). All it has to do is bring the CPU out of wait mode, the sleep loop
+/// looks at CRX0 itself to decide if the bus really is waking up.
+#pragma vector = 3
+static __interrupt void CANWakeUpIntr (void)
+{
+	C01WKIC = 0;	// one shot, CANInit() sets the controller up again anyway
+}
@@ -105,7 +105,10 @@ typedef enum
 
 		CANERR_SLEEP_FAIL = 0, 			/*!< CANSleep() - Failed to enter sleep mode, or failed to exit sleep mode. The CAN controller may be in
 																		an undetermined state. */
-		CANERR_SLEEP_OK = 1				///< CANSleep() - Sleep mode was exited properly
+		CANERR_SLEEP_OK = 1,				///< CANSleep() - Sleep mode was exited properly
+
+		CANERR_BUSOFF_WAITING = 0,		///< CANBusOffRecover() - The controller is still bus off, try again later
+		CANERR_BUSOFF_RECOVERED = 1	///< CANBusOffRecover() - The controller is error active again and the BUSOFF error is cleared
 } CANErr;
 
 /// Parameter to CANFlush()
@@ -122,8 +125,9 @@ extern TExtCANInfo can;
 
 /// Retrieve a packet from the internal circular buffer. If an error is reported, the 'pkt' structure is NOT filled in.
 /// Errors take priority over normal data to signify conditions like overrun/etc. All errors, apart from CANERR_RX_BUSOFF are
-/// cleared when this function has reported them via the return value. To clear the CANERR_RX_BUSOFF error, a call to CANInit()
-/// is required. It may take 1,408 (128*11) consecutive recessive bits before reception and transmit is possible again.
+/// cleared when this function has reported them via the return value. To clear the CANERR_RX_BUSOFF error, a call to
+/// CANBusOffRecover() or CANInit() is required. It may take 1,408 (128*11) consecutive recessive bits before transmit is possible again.
+/// Bus off is only reported once there are no received frames or transmit tags left, they keep coming out while it lasts.
 /// \param pkt Where to put the received data, if any. cplen member must be valid.
 /// \return One of CANERR_RX_*
 /// \par Side effects
@@ -153,11 +157,18 @@ CANErr CANTx (TCANPacket *pkt);
 /// May modify file scope variables InBuffer, OutBuffer
 CANErr CANFlush (TCANFlushCfg cfg, uint8 abort);
 
-/// Place the CAN controller into sleep mode. Will not return until sleep mode has exited.
+/// Place the CAN controller into sleep mode and arm the CAN wake-up interrupt, so the first edge on CRX0 brings the
+/// CPU out of wait mode. Returns straight away, leaving sleep is done with CANInit().
 /// \return One of CANERR_SLEEP_*
-/// \note Not yet implemented
 CANErr CANSleep (void);
 
+/// Clear a CANERR_RX_BUSOFF error without reinitialising. The controller returns to error active by itself after 128
+/// occurrences of 11 consecutive recessive bits, until it has this does nothing. Neither buffer is touched.
+/// \return One of CANERR_BUSOFF_*
+/// \par Side effects
+/// May modify file scope variable CANErrors
+CANErr CANBusOffRecover (void);
+
 /// Setup the CAN controller to specification supplied in 'initdata'.
 /// A single channel is configured to use as a transmit channel. \n
 /// Upto 15 channels are available as receive channels, one per unique id. Fill in the ID's required in the \a initdata structure.
@@ -177,8 +188,16 @@ CANErr CANInit (TCANInitData *initdata);
 /// May modify file scope variables TXInt_Finished, LastTXPacketTimer, OutBuffer \n
 /// \note
 /// Call CANInit() before calling this function. (This code should only be run after car side has initialised anyway)
+/// Whilst bus off nothing is timed out or scheduled, the queue waits for CANBusOffRecover().
 void CANSide (void);
 
+/// Returns 1 if nothing is waiting to be received, reported or sent, so CANSide() and CANRx() don't need calling every 1ms.
+uint8 CANIdle (void);
+
+/// Returns 1 if there is something for CANRx() to hand over now: a frame, a transmit report or an error. A transmit still in
+/// flight doesn't count, that is looked at on the tick. Bus off doesn't either, the recovery is paced by the tick too.
+uint8 CANRxPending (void);
+
 /// CAN recevie and error check routine.
 /// needs to be called as often as possible so that no CAN packets are lost.
 void can_int (void);
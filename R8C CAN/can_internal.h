@@ -32,7 +32,7 @@ typedef struct
 enum
 {
 	canerr_busoff = 1,									/*!<	Bus off error from controller.
-																		Reported by CANRx(). Cleared by CANInit(). */
+																		Reported by CANRx(). Cleared by CANInit() or CANBusOffRecover(). */
 	canerr_buserror = 2,									/*!<	If set, > 127 errors have occured in either transmission or reception.
 																		Reported and cleared by a call to CANRx(). */
 	canerr_overrun = 4,									/*!<	If set, a data overrun has occured, causing data to be overwritten.
@@ -0,0 +1,90 @@
+#ifndef RADIOSIDE_INTERNAL_H
+#define RADIOSIDE_INTERNAL_H
+
+#include "button_out.h"
+#include "timer.h"
+#include "vauxhall_stalk.h"
+
+#define ANALOG_BUTTON_HOLD_TIME   100
+#define ANALOG_BUTTON_GAP_TIME    100
+// Volume is the key that gets pressed over and over, so its press and gap are cut down to the shortest the head
+// unit still counts every one of
+#define ANALOG_VOLUME_HOLD_TIME   50
+#define ANALOG_VOLUME_GAP_TIME    50
+
+#define PHONE_HOLD_TIME 1500
+// Power of 2. Each key is one sequencer step of at most 100ms, and nothing waits behind more than KEYQUEUESIZE - 1 of
+// them plus the step on the lines and the one ready behind it, so a key always reaches the head unit within about 1s.
+#define KEYQUEUESIZE  8
+
+static void VehicleChanged(EVENT event, u16 value);
+static void KeyRepeatStart(BUTTON button);
+static void KeyRepeatRun(u8 key);
+static u8 KeyQueueDepth(void);
+static void KeyQueueCount(u8 * count);
+
+static struct
+{
+  u8 Key[KEYQUEUESIZE];
+  u16 Queued[KEYQUEUESIZE];         // TimerNow() when it went in
+  u8 In;
+  u8 Out;
+  TKEYQUEUESTATS Stats;
+}KeyQueue;
+
+typedef struct
+{
+  u8 Lines;                         // BUTTONLINE_ pulled low for it
+  u16 Hold;                         // ms, shortest it is held for
+  u16 Gap;                          // ms, shortest release after it
+}TKEYOUT;
+
+#define KEYOUTS   ( HANGUP + 1 )
+
+// Indexed by the key codes in global.h
+static const TKEYOUT KeyOut[KEYOUTS] =
+{
+  { BUTTONLINE_NONE,                          0,                        ANALOG_BUTTON_GAP_TIME },  // NONE
+  { BUTTONLINE_VOLUP,                         ANALOG_VOLUME_HOLD_TIME,  ANALOG_VOLUME_GAP_TIME },  // VOL_UP
+  { BUTTONLINE_VOLDOWN,                       ANALOG_VOLUME_HOLD_TIME,  ANALOG_VOLUME_GAP_TIME },  // VOL_DOWN
+  { BUTTONLINE_TRACKUP,                       ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME },  // TRACK_UP
+  { BUTTONLINE_TRACKDOWN,                     ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME },  // TRACK_DOWN
+  { BUTTONLINE_SOURCE,                        ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME },  // SOURCE
+  { BUTTONLINE_SHIFT | BUTTONLINE_TRACKUP,    ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME },  // PRE_UP
+  { BUTTONLINE_NONE,                          0,                        ANALOG_BUTTON_GAP_TIME },  // PRE_UP_HOLD, not sent
+  { BUTTONLINE_SHIFT | BUTTONLINE_PICKUP,     ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME },  // PICKUP
+  { BUTTONLINE_SHIFT | BUTTONLINE_DISP,       ANALOG_BUTTON_HOLD_TIME,  ANALOG_BUTTON_GAP_TIME }   // HANGUP
+};
+
+// Auto repeat while a stalk button is held. The first repeat comes Delay after the press, then every Period, with the
+// period cut by 1/2^Accel (0 for none) each time down to MinPeriod. A Delay of 0 means the key is held on the head unit instead.
+typedef struct
+{
+  u16 Delay;                        // ms
+  u16 Period;                       // ms
+  u16 MinPeriod;                    // ms, no point going under the key's hold + gap
+  u8 Accel;
+}TKEYREPEAT;
+
+// Indexed by BUTTON
+static const TKEYREPEAT KeyRepeats[] =
+{
+  { 0,    0,    0,    0 },          // BUTTON_NONE
+  { 400,  200,  100,  3 },          // BUTTON_VOLUP
+  { 400,  200,  100,  3 },          // BUTTON_VOLDOWN
+  { 0,    0,    0,    0 },          // BUTTON_TRACKUP, held is fast forward on the head unit
+  { 0,    0,    0,    0 },          // BUTTON_TRACKDOWN, and rewind
+  { 0,    0,    0,    0 },          // BUTTON_HANGUP
+  { 0,    0,    0,    0 },          // BUTTON_VOICE
+  { 0,    0,    0,    0 },          // BUTTON_PICKUP
+  { 0,    0,    0,    0 }           // BUTTON_PHONEHANGUP
+};
+
+static struct
+{
+  TTimer Timer;                     // till the next repeat is due
+  u16 Period;
+  const TKEYREPEAT * Repeat;
+}KeyRepeat;
+
+#endif
@@ -5,49 +5,36 @@
 #include "radioside.h"
 #include "vauxhall_stalk.h"
 #include "diags.h"
+#include "events.h"
+#include "speed_pulse.h"
+#include "RadiosideInternal.h"
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define ANALOG_BUTTON_HOLD_TIME   100  
-#define ANALOG_BUTTON_GAP_TIME    100
-
-#define PHONE_HOLD_TIME 1500
-#define KEYBUFFSIZE   30
-
-u8  key_buff[KEYBUFFSIZE],key_in = 0,key_out = 0;
-
-u16  timer_count;
-u8  timer_divider;
-u8  timer_modify;
-u8  timer_mod = 0;
-
-struct t
+void InitRadioSide(void)
 {
-  u8  sending;
-  u8  stage;
-  u8  length;
-  u8  bitpos;
-  u8  bytepos;
-};
-
-struct t txbuff;
+  EventSubscribe(EV_IGNITION,VehicleChanged);
+  EventSubscribe(EV_ILLUMINATION,VehicleChanged);
+  EventSubscribe(EV_REVERSE,VehicleChanged);
+  EventSubscribe(EV_PARKBRAKE,VehicleChanged);
+  EventSubscribe(EV_SPEED,VehicleChanged);
+}
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void SetButton(void)
 {
-  static u16 old_speed = 0;
   static u8 LastKeySent;
-  u32 timer_temp;
-  
-  if (!txbuff.sending)
-    do_button();        // get the next button press to send out
-  else
-    tx();
+  static BUTTON LastButton = BUTTON_NONE;
+  bool pressed = ( VauxhallStalk.Button != LastButton );
   
+  // Edges come from what we saw last time round rather than ChangedAt, which only moves when the stalk task next runs. We
+  // can be made ready again before then, and must not send the key a second time when we are.
+  LastButton = VauxhallStalk.Button;
   switch ( VauxhallStalk.Button )
   {
     case BUTTON_VOICE:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       { // just been pressed
         if ( LastKeySent != RELEASE )
         {
@@ -58,7 +45,7 @@ void SetButton(void)
       }
       break;
     case BUTTON_HANGUP:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         if ( LastKeySent != RELEASE )
         {
@@ -69,7 +56,7 @@ void SetButton(void)
       }
       break;
     case BUTTON_TRACKUP:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         if ( LastKeySent != RELEASE )
         {
@@ -80,7 +67,7 @@ void SetButton(void)
       }
       break;
     case BUTTON_TRACKDOWN:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         if ( LastKeySent != RELEASE )
         {
@@ -91,7 +78,7 @@ void SetButton(void)
       }
       break;
     case BUTTON_VOLUP:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         if ( LastKeySent != RELEASE )
         {
@@ -102,7 +89,7 @@ void SetButton(void)
       }
       break;
     case BUTTON_VOLDOWN:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         if ( LastKeySent != RELEASE )
         {
@@ -112,76 +99,117 @@ void SetButton(void)
         LastKeySent = VOL_DOWN;
       }
       break;
+    case BUTTON_PICKUP:
+      if ( pressed )
+      {
+        if ( LastKeySent != RELEASE )
+        {
+          add_key(RELEASE);
+        }
+        add_key(PICKUP);
+        LastKeySent = PICKUP;
+      }
+      break;
+    case BUTTON_PHONEHANGUP:
+      if ( pressed )
+      {
+        if ( LastKeySent != RELEASE )
+        {
+          add_key(RELEASE);
+        }
+        add_key(HANGUP);
+        LastKeySent = HANGUP;
+      }
+      break;
     case BUTTON_NONE:
-      if ( !VauxhallStalk.TimeHeld )
+      if ( pressed )
       {
         add_key(RELEASE);
         LastKeySent = RELEASE;
       }
       break;
   }
-  
-  if (global.ignition ==1)
+  if ( pressed )
   {
-    IGNITION = 1;
+    KeyRepeatStart(VauxhallStalk.Button);
   }
   else
   {
-    IGNITION = 0;
+    KeyRepeatRun(LastKeySent);
   }
-  
-  if (global.illumination == 1)
-  {
-    ILLUM = 1;
-  }
-  else
+
+  // keys are only handed over one step ahead of the lines, so they can still be coalesced here while they wait. The
+  // sequencer readies us again each time it takes one.
+  while ( KeyQueueDepth() && !ButtonOutQueued() )
   {
-    ILLUM = 0;
+    do_button();
   }
-  
-  if (global.reverse == 1)
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void KeyRepeatStart(BUTTON button)
+{
+  KeyRepeat.Repeat = &KeyRepeats[button];
+  KeyRepeat.Period = KeyRepeat.Repeat->Period;
+  if ( KeyRepeat.Repeat->Delay )
   {
-    REVERSE = 1;
+    TimerArm(&KeyRepeat.Timer,KeyRepeat.Repeat->Delay);
   }
   else
   {
-    REVERSE = 0;
+    TimerStop(&KeyRepeat.Timer);
   }
-  
-  if (global.parkbrake == 1)
-  {
-    PARK = 1;
-  }
-  else
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A repeat is only added once the last one has gone out to the lines, so a long hold can't pile up keys that would
+// carry on after the button is let go. If the head unit side is slower than the repeat, it sets the pace.
+static void KeyRepeatRun(u8 key)
+{
+  if ( KeyQueueDepth() || ButtonOutQueued() )
   {
-    PARK = 0;
+    return;
   }
-  
-  // now do the speed pulse
-  if (global.speed != old_speed ) // need to modify timer
+  if ( TimerExpired(&KeyRepeat.Timer) )
   {
-    timer_modify = 0;
-    old_speed = global.speed;
-    if (!global.speed)    // speed is zero!
-    {
-      timer_divider = 0;
-      timer_count = 0xFFFF;
-    }
-    else if (global.speed < 6)   // use divider
+    add_key(RELEASE);
+    add_key(key);
+    TimerArm(&KeyRepeat.Timer,KeyRepeat.Period);
+    if ( KeyRepeat.Repeat->Accel )
     {
-      timer_divider = 5;
-      timer_temp = (u32)100000 / (u32)(global.speed<<1);
-      timer_temp -= 4;
-      timer_count = timer_temp & 0xFFFF;
+      KeyRepeat.Period -= KeyRepeat.Period >> KeyRepeat.Repeat->Accel;
     }
-    else                    // no divider , normal interrupt
+    if ( KeyRepeat.Period < KeyRepeat.Repeat->MinPeriod )
     {
-      timer_divider = 1;
-      timer_temp = (u32)500000 / (u32)(global.speed<<1);
-      timer_temp -= 4;
-      timer_count = timer_temp & 0xFFFF;
+      KeyRepeat.Period = KeyRepeat.Repeat->MinPeriod;
     }
-    timer_modify = 1;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The vehicle outputs only get touched when what they show changes
+static void VehicleChanged(EVENT event, u16 value)
+{
+  switch ( event )
+  {
+  case EV_IGNITION:
+    IGNITION = value ? 1 : 0;
+    break;
+  case EV_ILLUMINATION:
+    ILLUM = value ? 1 : 0;
+    break;
+  case EV_REVERSE:
+    REVERSE = value ? 1 : 0;
+    break;
+  case EV_PARKBRAKE:
+    PARK = value ? 1 : 0;
+    break;
+  case EV_SPEED:
+    SpeedPulseSet(value);
+    break;
   }
 }
 
@@ -189,6 +217,7 @@ void SetButton(void)
 
 void do_button(void)
 {
+  static u8 LastKey = NONE;
   u8 key;
   
   key = get_key();
@@ -223,99 +252,16 @@ void do_button(void)
     DEBUG("RELEASE\r\n");
     break;
   }
-  switch (key)
+  if (key == RELEASE)
   {
-  case VOL_UP:
-    while (PD0_bit.PD0_3 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0_bit.PD0_3 = 1;
-    }
-    P0_bit.P0_3 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-  case VOL_DOWN:
-    while (PD0_bit.PD0_2 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0_bit.PD0_2 = 1;
-    }
-    P0_bit.P0_2 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-  case TRACK_UP:
-    while (PD0_bit.PD0_4 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0_bit.PD0_4 = 1;
-    }
-    P0_bit.P0_4 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-  case TRACK_DOWN:
-    PD6_bit.PD6_0 = 1;
-    P6_bit.P6_0 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-  case SOURCE:
-    while (PD0_bit.PD0_6 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0_bit.PD0_6 = 1;
-    }
-    P0_bit.P0_6 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;   // 200mS hold for Sony
-    txbuff.sending = 1;
-    break;
-  case PRE_UP:
-    PD1_bit.PD1_1 = 1;
-    P1_bit.P1_1 = 0;
-    while (PD0_bit.PD0_4 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0_bit.PD0_4 = 1;
-    }
-    P0_bit.P0_4 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;      
-  case PICKUP:
-    PD1_bit.PD1_1 = 1;          // shift
-    P1_bit.P1_1 = 0;
-    while (PD0_bit.PD0_5 == 0)  // keep trying till it's set!
-    {
-      PRCR =4;                  // unprotect port 0
-      PD0_bit.PD0_5 = 1;
-    }
-    P0_bit.P0_5 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-  case HANGUP:
-    PD1_bit.PD1_1 = 1;          // shift
-    P1_bit.P1_1 = 0;
-    PD3_bit.PD3_3 = 1;          // DISP
-    P3_bit.P3_3 = 0;
-    global.delay = ANALOG_BUTTON_HOLD_TIME;
-    txbuff.sending = 1;
-    break;
-
-  case RELEASE:
-    PD6_bit.PD6_0 = 0;      // set Track Down pin back to input
-    PD1_bit.PD1_2 = 0;      // set Power back to input
-    PD1_bit.PD1_1 = 0;      // set Shift back to input
-    while (PD0 & 0x5C)      // keep trying till they're clear!
-    {
-      PRCR =4;                // unprotect port 0
-      PD0 &= 0xA3;            // set Track up, vol up & vol down back to inputs
-    }
-    global.delay = ANALOG_BUTTON_GAP_TIME;
-    txbuff.sending = 1;
-    break;
+    // the gap after a key goes with the key, so the next press can't come too soon for it
+    ButtonOutPush(BUTTONLINE_NONE, KeyOut[LastKey].Gap);
+  }
+  else if (key < KEYOUTS)
+  {
+    // held on the lines for at least the hold time, and after that until the next key
+    ButtonOutPush(KeyOut[key].Lines, KeyOut[key].Hold);
+    LastKey = key;
   }
 }
 
@@ -323,83 +269,88 @@ void do_button(void)
 
 void release_all_buttons(void)
 {
-  PD6_bit.PD6_0 = 0;      // set Track Down pin back to input
-  PD1_bit.PD1_2 = 0;      // set Power back to input
-  PD1_bit.PD1_1 = 0;      // set Shift back to input
-  while (PD0 & 0x5C)      // keep trying till they're clear!
+  KeyQueue.Out = KeyQueue.In;
+  ButtonOutStop();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Keys that haven't started yet are tidied up on the way in: a repeat of the last key is dropped, and a press of the
+// key already waiting with its release behind it is merged into that pair, so taps made while the lines are busy still
+// go out once. The queue alternates release and press after that, and a press only gets in with room behind it for its
+// release, so only presses are ever thrown away.
+void add_key(u8 key)
+{
+  u8 depth = KeyQueueDepth();
+  u8 tail = ( KeyQueue.In - 1 ) & ( KEYQUEUESIZE - 1 );
+  u8 press = ( KeyQueue.In - 2 ) & ( KEYQUEUESIZE - 1 );
+
+  if ( depth && ( KeyQueue.Key[tail] == key ) )
+  {
+    KeyQueueCount(&KeyQueue.Stats.Coalesced);
+    return;
+  }
+  if ( ( depth >= 2 ) && ( KeyQueue.Key[tail] == RELEASE ) && ( KeyQueue.Key[press] == key ) )
   {
-    PRCR =4;                // unprotect port 0
-    PD0 &= 0xa3;            // set Track up, preset up, vol up & vol down back to inputs
+    KeyQueueCount(&KeyQueue.Stats.Merged);
+    return;
+  }
+  if ( depth >= ( KEYQUEUESIZE - ( ( key == RELEASE ) ? 1 : 2 ) ) )
+  {
+    KeyQueueCount(&KeyQueue.Stats.Dropped);
+    return;
+  }
+  KeyQueue.Key[KeyQueue.In] = key;
+  KeyQueue.Queued[KeyQueue.In] = TimerNow();
+  KeyQueue.In = ( KeyQueue.In + 1 ) & ( KEYQUEUESIZE - 1 );
+  if ( ++depth > KeyQueue.Stats.MaxDepth )
+  {
+    KeyQueue.Stats.MaxDepth = depth;
   }
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
 
-void tx(void)
+u8 get_key(void)
 {
-  if ( global.delay )
-    global.delay--;
-  else
+  u8 temp;
+  u16 waited;
+
+  if (!KeyQueueDepth())
+    return 0xff;          // no key presses to return
+  temp = KeyQueue.Key[KeyQueue.Out];
+  waited = TimerSince(KeyQueue.Queued[KeyQueue.Out]);
+  if ( waited > KeyQueue.Stats.MaxLatency )
   {
-    txbuff.sending = 0;
+    KeyQueue.Stats.MaxLatency = waited;
   }
+  KeyQueue.Out = ( KeyQueue.Out + 1 ) & ( KEYQUEUESIZE - 1 );
+  DiagsLog(LOG_KEY,temp,waited);
+  return temp;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
 
-void add_key(u8 key)
+const TKEYQUEUESTATS * KeyQueueStats(void)
 {
-  key_buff[key_in] = key;
-  if (key_in)
-    key_in--;
-  else
-    key_in = KEYBUFFSIZE-1;
+  KeyQueue.Stats.Depth = KeyQueueDepth();
+  return &KeyQueue.Stats;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
-u8 get_key(void)
+static u8 KeyQueueDepth(void)
 {
-  u8 temp;
-  if (key_in == key_out)
-    return 0xff;          // no key presses to return
-  temp = key_buff[key_out];
-  if (key_out)
-    key_out--;
-  else
-    key_out = KEYBUFFSIZE-1;
-  return temp;
+  return ( KeyQueue.In - KeyQueue.Out ) & ( KEYQUEUESIZE - 1 );
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
-////////////////////                SPEED PULSE TIMER INTERRUPT               //////////////////////
-////////////////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////////////
 
-#pragma vector = 8
-static __interrupt void TimerRD0Intr (void)
+static void KeyQueueCount(u8 * count)
 {
-  static u8 divider = 0,divider_set = 0;
-    TRD0 = 0;                 // reset counter
-    if (TRDSR0) TRDSR0 = 0;
-    TRDSTR = 1;           // start the timer now!
- 
-    if ( divider )            // divider used for slower speed pulses
-    {
-        divider--;
-    }
-    if ( !divider )
-    {  
-        divider = divider_set;
-        if ( divider_set )    // only toggle pin if speed is > 0 
-            SPEED ^= 1;
-    }
-    if ( timer_modify )
-    {
-        TRDGRA0 = timer_count;          // load new value into compare register
-        if ( divider_set != timer_divider )
-            divider = timer_divider;    // update new divider if different to last
-        divider_set = timer_divider;    // set if speed > 0
-        timer_modify = 0;    
-    }   
+  if ( *count < 0xff )
+  {
+    ( *count )++;
+  }
 }
 
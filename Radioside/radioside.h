@@ -1,7 +1,24 @@
+#ifndef RADIOSIDE_H
+#define RADIOSIDE_H
+
+#include "common.h"
+
+typedef struct
+{
+  u8 Depth;                         // keys waiting now
+  u8 MaxDepth;
+  u8 Coalesced;                     // repeats of the key in front dropped, these all stick at 0xff
+  u8 Merged;                        // taps of a key already waiting with its release, sent as the one press
+  u8 Dropped;                       // presses thrown away on a full queue
+  u16 MaxLatency;                   // ms, longest a key has waited before going to the lines
+}TKEYQUEUESTATS;
+
+void InitRadioSide(void);
 void SetButton(void);
 void do_button(void);
 void release_all_buttons(void);
-void tx(void);
 void add_key(u8);
 u8 get_key(void);
+const TKEYQUEUESTATS * KeyQueueStats(void);
 
+#endif
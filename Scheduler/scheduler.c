@@ -0,0 +1,68 @@
+#include <intrinsics.h>
+#include "scheduler_internal.h"
+
+void SchedulerInit(void)
+{
+  u8 task;
+
+  Scheduler.Ready = 0;
+  Scheduler.TickMask = 0;
+  for ( task = 0 ; task < TASK_END ; task++ )
+  {
+    if ( Tasks[task].Tick )
+    {
+      Scheduler.TickMask |= ( 1 << task );
+    }
+  }
+}
+/********************************************************************************************************************************/
+
+void TaskReady(TASK task)
+{
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  Scheduler.Ready |= ( 1 << task );
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+void TaskReadyTick(void)
+{
+  __istate_t state = __get_interrupt_state();
+
+  __disable_interrupt();
+  Scheduler.Ready |= Scheduler.TickMask;
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+bool SchedulerRun(void)
+{
+  __istate_t state;
+  u16 bit = 1;
+  u8 task = 0;
+
+  if ( !Scheduler.Ready )
+  {
+    return false;
+  }
+  while ( !( Scheduler.Ready & bit ) )
+  {
+    bit <<= 1;
+    task++;
+  }
+  state = __get_interrupt_state();
+  __disable_interrupt();
+  Scheduler.Ready &= ~bit;            // cleared before it runs, so anything that makes it ready again while it runs counts
+  __set_interrupt_state(state);
+  Tasks[task].Run();
+  return true;
+}
+/********************************************************************************************************************************/
+
+bool SchedulerIdle(void)
+{
+  return ( Scheduler.Ready == 0 );
+}
+/********************************************************************************************************************************/
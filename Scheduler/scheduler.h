@@ -0,0 +1,47 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "common.h"
+
+// Cooperative, run to completion scheduler. A task is a function that does one lump of work and returns. Tasks are made
+// ready by events (a CAN frame, the timer tick, a button step going out) and the highest priority ready task always runs next,
+// so a slow task only holds the others up until it returns rather than for the rest of the tick.
+
+// in priority order, highest first
+typedef enum
+{
+  TASK_CANRX,       // received frames and transmit reports, as soon as they turn up
+  TASK_EVENTS,      // vehicle state changes out to their subscribers
+  TASK_NM,          // network management
+  TASK_CAN,         // CAN transmit queue
+  TASK_STALK,       // steering wheel buttons
+  TASK_RADIO,       // radioside buttons, outputs and speed pulse
+  TASK_ISO,         // ISO15765 channel timing
+  TASK_DIAGS,       // CAN diagnostics
+  TASK_DISPLAY,     // display text and radio status
+  TASK_PROGRAM,     // display programming and forced bus wake
+  TASK_FLASH,       // flash store compacting
+  TASK_TICKEND,     // last thing every tick, sleep and setting up the next tick
+  TASK_END
+}TASK;
+
+typedef struct
+{
+  void (*Run)(void);
+  bool Tick;                          // made ready by every timer tick
+}TTASK;
+
+// Defined with the rest of the system in main.c, indexed by TASK
+extern const TTASK Tasks[TASK_END];
+
+void SchedulerInit(void);
+// Can be called from an interrupt
+void TaskReady(TASK task);
+// Makes every task that runs off the tick ready
+void TaskReadyTick(void);
+// Runs the highest priority ready task, false if there wasn't one
+bool SchedulerRun(void);
+// Nothing ready, call with the interrupts off to be sure of it
+bool SchedulerIdle(void);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef SCHEDULER_INTERNAL_H
+#define SCHEDULER_INTERNAL_H
+
+#include "scheduler.h"
+
+static struct
+{
+  volatile u16 Ready;               // one bit per task, bit 0 is TASK_CANRX
+  u16 TickMask;                     // tasks with Tick set
+}Scheduler;
+
+#endif
@@ -0,0 +1,129 @@
+#include <ior8c22_23.h>
+#include <intrinsics.h>
+#include "speed_pulse_internal.h"
+#include "global.h"
+
+void SpeedPulseInit(void)
+{
+  TRDSTR = 0;                       // don't start the timer yet, SpeedPulseSet() does that when we are moving
+  TRDMR = 0;                        // leave mode register as default
+  TRDPMR = 0;                       // leave PWM mode register as default
+  TRDFCR = 0x80;                    // upper bit must be set
+  TRDOER1 = 0xFF;                   // set pins as I/O, the speed line isn't a timer RD pin so it is driven from the interrupt
+  TRDOER2 = 0;                      // leave output master enable register 2 as default
+  TRDOCR = 0;                       // leave output control regaster as default
+  TRDCR0 = TRDCR0_F32_CLEARONA;     // the hardware restarts the count, so the edges don't drift with interrupt latency
+  TRDIORA0 = 8;
+  TRDIORC0 = 0x88;                  // set pins as I/O
+  TRDGRA0 = SPEEDPULSE_CHUNKMAX;
+  TRDIER0 = 0x01;                   // set the interrupt enable register to trigger on bit A compare only
+  TRD0IC = 1;                       // enable timer RD channel 0 interrupt
+  SpeedPulseProfile(SPEEDPROFILE_PIONEER);
+}
+/********************************************************************************************************************************/
+
+void SpeedPulseSet(u16 speed)
+{
+  __istate_t state = __get_interrupt_state();
+  u32 period = 0;
+  u32 high = 0;
+  u16 recip;
+  u8 shift = SPEEDPULSE_RECIPSHIFT - SpeedPulse.PulseShift;
+  u8 step;
+
+  SpeedPulse.Speed = speed;
+  if ( speed && speed >= ( (u16)SpeedPulse.Profile->MinSpeed << 6 ) )
+  {
+    // PulseCounts / speed as PulseCounts * 1 / speed, with speed shifted up to the range SpeedRecip[] covers
+    while ( !( speed & 0x8000 ) )
+    {
+      speed <<= 1;
+      shift--;
+    }
+    step = ( speed >> SPEEDPULSE_RECIPSTEP ) & 0x3F;
+    recip = SpeedRecip[step] - (u16)( ( (u32)( SpeedRecip[step] - SpeedRecip[step + 1] ) *
+                                        ( speed & ( ( 1 << SPEEDPULSE_RECIPSTEP ) - 1 ) ) ) >> SPEEDPULSE_RECIPSTEP );
+    period = ( (u32)SpeedPulse.PulseCounts * recip ) >> shift;
+    high = ( period * SpeedPulse.DutyFraction ) >> 8;
+  }
+  __disable_interrupt();            // 32 bits, the interrupt mustn't see half of it
+  SpeedPulse.High = high;           // the interrupt picks these up at the next edge
+  SpeedPulse.Low = period - high;
+  if ( SpeedPulse.Left > ( SPEED ? SpeedPulse.High : SpeedPulse.Low ) )
+  {
+    // speeding up from a crawl, the half pulse going out is cut short to the new one after what is already loaded
+    SpeedPulse.Left = SPEED ? SpeedPulse.High : SpeedPulse.Low;
+  }
+  if ( !period )
+  {
+    TRDSTR = TRDSTR_CSEL0;          // stop
+    SpeedPulse.Left = 0;
+    SPEED = 0;
+  }
+  else if ( !( TRDSTR & TRDSTR_TSTART0 ) )
+  {
+    SPEED = 0;                      // start with the low part, the first edge is then a rising one
+    SpeedPulse.Left = SpeedPulse.Low;
+    SpeedPulseLoad();
+    TRD0 = 0;
+    TRDSTR = TRDSTR_CSEL0 | TRDSTR_TSTART0;
+  }
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+bool SpeedPulseProfile(u8 profile)
+{
+  u32 perkm;
+  u32 counts;
+  u8 shift = 0;
+
+  if ( profile >= SPEEDPROFILE_END )
+  {
+    return false;
+  }
+  // SPEEDPULSE_F32HZ * 3600 * 64 / pulses per km doesn't fit 32 bits until after the divide, so the * 64 goes in two halves
+  perkm = SpeedProfiles[profile].PulsesPerKm;
+  counts = ( (u32)SPEEDPULSE_F32HZ * 3600 / perkm ) * 64 + ( ( (u32)SPEEDPULSE_F32HZ * 3600 % perkm ) * 64 ) / perkm;
+  // the top 16 bits of it, rounded, so the multiply in SpeedPulseSet() fits 32
+  while ( counts > 0xFFFF )
+  {
+    counts = ( counts + 1 ) >> 1;
+    shift++;
+  }
+  SpeedPulse.PulseCounts = (u16)counts;
+  SpeedPulse.PulseShift = shift;
+  SpeedPulse.DutyFraction = ( ( (u16)SpeedProfiles[profile].Duty << 8 ) + 50 ) / 100;
+  SpeedPulse.Profile = &SpeedProfiles[profile];
+  SpeedPulseSet(SpeedPulse.Speed);
+  return true;
+}
+/********************************************************************************************************************************/
+
+// Loads the next part of the current half pulse into the compare register. Called with interrupts off.
+static void SpeedPulseLoad(void)
+{
+  u16 counts = SPEEDPULSE_CHUNK;
+
+  if ( SpeedPulse.Left <= SPEEDPULSE_CHUNKMAX )
+  {
+    counts = (u16)SpeedPulse.Left;
+  }
+  SpeedPulse.Left -= counts;
+  TRDGRA0 = counts - 1;
+}
+/********************************************************************************************************************************/
+
+#pragma vector = 8
+static __interrupt void TimerRD0Intr (void)
+{
+  if (TRDSR0) TRDSR0 = 0;
+
+  if ( !SpeedPulse.Left )           // this half of the pulse is done
+  {
+    SPEED ^= 1;
+    SpeedPulse.Left = SPEED ? SpeedPulse.High : SpeedPulse.Low;
+  }
+  SpeedPulseLoad();
+}
+/********************************************************************************************************************************/
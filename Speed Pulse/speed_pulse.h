@@ -0,0 +1,25 @@
+#ifndef SPEED_PULSE_H
+#define SPEED_PULSE_H
+
+#include "common.h"
+
+// Speed pulse out to the head unit for its navigation. Timer RD channel 0 counts out each half of the pulse on f32 and
+// the interrupt toggles the line and loads the next one, so it only runs once per edge. Speeds are in 1/64 km/h.
+
+// Head units want different pulses per km for their dead reckoning. Never renumber these, the selected one is kept in
+// the flash store.
+typedef enum
+{
+  SPEEDPROFILE_PIONEER,     // 3600 pulses/km, what we have always sent
+  SPEEDPROFILE_JIS,         // 2548 pulses/km, 637 turns/km x 4, the Japanese standard
+  SPEEDPROFILE_1000,        // 1000 pulses/km
+  SPEEDPROFILE_END
+}SPEEDPROFILE;
+
+void SpeedPulseInit(void);
+// 1/64 km/h, 0 stops the pulse (and the timer)
+void SpeedPulseSet(u16 speed);
+// Everything the profile needs is worked out here, so SpeedPulseSet() has no divides. False if there is no such profile.
+bool SpeedPulseProfile(u8 profile);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SPEED_PULSE_INTERNAL_H
+#define SPEED_PULSE_INTERNAL_H
+
+#include "speed_pulse.h"
+
+#define SPEEDPULSE_F32HZ        500000    // timer RD on f32, 2us a count
+#define SPEEDPULSE_CHUNKMAX     0xFFFF    // longest the 16 bit compare can count in one go
+#define SPEEDPULSE_CHUNK        0x8000    // long half pulses go out in these, so what is left is never a short count
+#define SPEEDPULSE_RECIPSHIFT   30        // SpeedRecip[] is 2^30 / the speed shifted up to 0x8000..0xFFFF
+#define SPEEDPULSE_RECIPSTEP    9         // 512 apart
+
+#define TRDSTR_TSTART0          0x01
+#define TRDSTR_CSEL0            0x04      // carry on counting after the compare match
+#define TRDCR0_F32_CLEARONA     0x24      // f32, counter cleared by the TRDGRA0 compare match
+
+typedef struct
+{
+  u16 PulsesPerKm;
+  u8 Duty;                          // % of each pulse the line is high for
+  u8 MinSpeed;                      // km/h, anything slower goes out as stopped
+}TSPEEDPROFILE;
+
+// The original generator loaded 500000 / ( 2 * km/h ) f32 counts per toggle, so one pulse took 1 / km/h seconds. That is
+// km/h pulses a second, or 3600 pulses every km, which is what the Pioneer units are calibrated for. It only had whole
+// km/h, so under 1 km/h was stopped.
+static const TSPEEDPROFILE SpeedProfiles[SPEEDPROFILE_END] =
+{
+  { 3600, 50, 1 },                  // SPEEDPROFILE_PIONEER
+  { 2548, 50, 1 },                  // SPEEDPROFILE_JIS
+  { 1000, 50, 1 }                   // SPEEDPROFILE_1000
+};
+
+// 2^30 / 0x8000, 2^30 / 0x8200 ... 2^30 / 0x10000, in between is a straight line. That is within 0.01% of the divide.
+static const u16 SpeedRecip[65] =
+{
+  32768, 32264, 31775, 31301, 30840, 30394, 29959, 29537,
+  29127, 28728, 28340, 27962, 27594, 27236, 26887, 26546,
+  26214, 25891, 25575, 25267, 24966, 24672, 24385, 24105,
+  23831, 23564, 23302, 23046, 22795, 22550, 22310, 22075,
+  21845, 21620, 21400, 21183, 20972, 20764, 20560, 20361,
+  20165, 19973, 19784, 19600, 19418, 19240, 19065, 18893,
+  18725, 18559, 18396, 18236, 18079, 17924, 17772, 17623,
+  17476, 17332, 17190, 17050, 16913, 16777, 16644, 16513,
+  16384
+};
+
+static struct
+{
+  u16 PulseCounts;                  // f32 counts in one pulse at 1/64 km/h are this << PulseShift, the period is that / speed
+  u8 PulseShift;
+  u16 DutyFraction;                 // 1/256ths of the period the line is high for
+  u32 High;                         // counts the line is high for, 0 when stopped
+  u32 Low;
+  u32 Left;                         // counts still to go in this half of the pulse after the one loaded
+  const TSPEEDPROFILE * Profile;
+  u16 Speed;                        // last asked for, 1/64 km/h
+}SpeedPulse = { 0, 0, 0, 0, 0, 0, &SpeedProfiles[SPEEDPROFILE_PIONEER], 0 };
+
+static void SpeedPulseLoad(void);
+
+#endif
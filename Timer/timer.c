@@ -0,0 +1,191 @@
+#include <ior8c22_23.h>
+#include <intrinsics.h>
+#include "timer_internal.h"
+
+volatile u8 timer_flag;
+
+void TimerInit(void)
+{
+  Timer.TickLength = 1;
+  TRBMR  = 0x10;                          // select f8 as a source
+  TRBPRE = TIMER_PRESCALE;                // 200 loops of
+  TRBPR = TIMER_COUNTSPERMS - 1;          // 10 counts
+  TRBIC = 1;                              // enable interrupt
+  TRBCR = TRBCR_TSTART;                   // start timer
+}
+/********************************************************************************************************************************/
+
+u16 TimerNow(void)
+{
+  return Timer.Now; // 16 bit, so the interrupt can't change it half way through reading it
+}
+/********************************************************************************************************************************/
+
+u16 TimerNowFine(void)
+{
+  __istate_t state = __get_interrupt_state();
+  u16 now, counted;
+
+  __disable_interrupt();
+  counted = ( Timer.TickLength * TIMER_COUNTSPERMS ) - 1 - TRBPR;
+  now = Timer.Now;
+  if ( TRBIC & TRBIC_IR )
+  {
+    // the tick has just run out and the interrupt hasn't counted it yet
+    now += Timer.TickLength;
+    counted = 0;
+  }
+  now = ( now * TIMER_COUNTSPERMS ) + Timer.Fraction + counted;
+  __set_interrupt_state(state);
+  return now;
+}
+/********************************************************************************************************************************/
+
+u16 TimerSince(u16 then)
+{
+  return TimerNow() - then;
+}
+/********************************************************************************************************************************/
+
+void TimerArm(TTimer * timer, u16 ms)
+{
+  timer->Expiry = TimerNow() + ms;
+  timer->Armed = true;
+  timer->Due = false;
+  if ( !timer->Linked )
+  {
+    timer->Next = Timer.Chain;
+    Timer.Chain = timer;
+    timer->Linked = true;
+  }
+}
+/********************************************************************************************************************************/
+
+void TimerStop(TTimer * timer)
+{
+  timer->Armed = false;
+  timer->Due = false;
+}
+/********************************************************************************************************************************/
+
+bool TimerRunning(TTimer * timer)
+{
+  TimerCheckDue(timer);
+  return ( timer->Armed && !timer->Due );
+}
+/********************************************************************************************************************************/
+
+bool TimerExpired(TTimer * timer)
+{
+  TimerCheckDue(timer);
+  if ( timer->Due )
+  {
+    timer->Armed = false;
+    timer->Due = false;
+    return true;
+  }
+  return false;
+}
+/********************************************************************************************************************************/
+
+// The expiry is only good for half the 16 bit clock, so this has to be seen within 32s of it. TimerNextTick() looks at
+// every armed timer at least every TIMER_MAXTICK ms, so it always is.
+static void TimerCheckDue(TTimer * timer)
+{
+  if ( timer->Armed && !timer->Due && ( (sint16)( timer->Expiry - TimerNow() ) <= 0 ) )
+  {
+    timer->Due = true;
+  }
+}
+/********************************************************************************************************************************/
+
+void TimerKeepTicking(void)
+{
+  Timer.KeepTicking = true;
+}
+/********************************************************************************************************************************/
+
+void TimerNextTick(void)
+{
+  TTimer * timer;
+  u16 now = TimerNow();
+  sint16 left;
+  u8 next = TIMER_MAXTICK;
+
+  // deadlines already due have had their turn this time round, anything still to come limits the tick. The walk is done
+  // even when we keep ticking, it is what catches a due timer nobody is looking at before the clock wraps.
+  for ( timer = Timer.Chain ; timer ; timer = timer->Next )
+  {
+    TimerCheckDue(timer);
+    if ( timer->Armed && !timer->Due )
+    {
+      left = (sint16)( timer->Expiry - now );
+      if ( left < next )
+      {
+        next = (u8)left;
+      }
+    }
+  }
+  if ( Timer.KeepTicking )
+  {
+    next = 1;
+  }
+  Timer.KeepTicking = false;
+  if ( next != Timer.TickLength )
+  {
+    TimerProgram(next);
+  }
+}
+/********************************************************************************************************************************/
+
+void TimerEndTick(void)
+{
+  if ( Timer.TickLength > 1 )
+  {
+    TimerProgram(1);
+    timer_flag = 1;
+  }
+}
+/********************************************************************************************************************************/
+
+// Stops timer RB, brings the clock up to date with however much of the current tick has gone, and restarts it for ms
+static void TimerProgram(u8 ms)
+{
+  __istate_t state = __get_interrupt_state();
+  u8 counted;
+
+  __disable_interrupt();
+  TRBCR = 0;
+  while ( TRBCR & TRBCR_TCSTF );          // wait till it has stopped
+  if ( TRBIC & TRBIC_IR )
+  {
+    // the tick ran out while we were stopping it, count it here instead of in the interrupt
+    TRBIC = 1;
+    Timer.Now += Timer.TickLength;
+    timer_flag = 1;
+  }
+  else
+  {
+    counted = ( Timer.TickLength * TIMER_COUNTSPERMS ) - 1 - TRBPR;
+    Timer.Now += ( counted / TIMER_COUNTSPERMS );   // whole ms first, the sum of what's left fits the u8
+    Timer.Fraction += ( counted % TIMER_COUNTSPERMS );
+    if ( Timer.Fraction >= TIMER_COUNTSPERMS )
+    {
+      Timer.Now++;
+      Timer.Fraction -= TIMER_COUNTSPERMS;
+    }
+  }
+  Timer.TickLength = ms;
+  TRBPR = ( ms * TIMER_COUNTSPERMS ) - 1;
+  TRBCR = TRBCR_TSTART;
+  __set_interrupt_state(state);
+}
+/********************************************************************************************************************************/
+
+#pragma vector = 24
+static __interrupt void TimerRbIntr (void)
+{
+  Timer.Now += Timer.TickLength;
+  timer_flag = 1;
+}
+/********************************************************************************************************************************/
@@ -0,0 +1,45 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "common.h"
+
+// Central timer service. Subsystems arm one shot deadlines against a ms clock instead of keeping their own countdowns,
+// and every timer that has been armed is chained together so the main loop can see when the next one is due. When
+// nothing needs the 1ms tick, timer RB is programmed for the next deadline and the CPU waits in between.
+
+typedef struct TTimerTag
+{
+  u16 Expiry;                       // TimerNow() value it falls due at
+  bool Armed;
+  bool Due;                         // seen to have fallen due, so it can't look to be running again once the clock wraps
+  bool Linked;                      // in the chain
+  struct TTimerTag * Next;
+}TTimer;
+
+#define TIMER_MAXTICK   25          // longest tick timer RB can be programmed for, ms
+
+extern volatile u8 timer_flag;      // set by the timer RB interrupt at the end of every tick
+
+// Sets up timer RB for a 1ms tick
+void TimerInit(void);
+// The ms clock, wraps
+u16 TimerNow(void);
+// The clock in 0.1ms, read straight out of timer RB so it is good part way through a long tick. Wraps every 6.5s.
+u16 TimerNowFine(void);
+// ms since a TimerNow() value
+u16 TimerSince(u16 then);
+// Arm a one shot deadline ms from now, rearming a running timer restarts it
+void TimerArm(TTimer * timer, u16 ms);
+void TimerStop(TTimer * timer);
+// Armed and not due yet. Once a timer has been seen to fall due it stays due, however long it is left.
+bool TimerRunning(TTimer * timer);
+// Returns true once when an armed timer falls due, the timer is then disarmed
+bool TimerExpired(TTimer * timer);
+// Anything that still has to be looked at every ms calls this each time round while it does
+void TimerKeepTicking(void);
+// Main loop, after the ms functions. Programs timer RB for the next tick, 1ms or as far as the next deadline.
+void TimerNextTick(void);
+// Main loop. Ends a long tick early, because something (eg. a CAN frame) has turned up that can't wait for it.
+void TimerEndTick(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef TIMER_INTERNAL_H
+#define TIMER_INTERNAL_H
+
+#include "timer.h"
+
+// timer RB runs from f8 (2MHz) through a 200 prescaler, so it counts in 0.1ms
+#define TIMER_PRESCALE    199
+#define TIMER_COUNTSPERMS 10
+
+#define TRBCR_TSTART      0x01
+#define TRBCR_TCSTF       0x02
+#define TRBIC_IR          0x08
+
+static struct
+{
+  volatile u16 Now;                 // ms
+  u8 Fraction;                      // 0.1ms left over when a tick was cut short
+  u8 TickLength;                    // ms timer RB is programmed for
+  bool KeepTicking;
+  TTimer * Chain;
+}Timer;
+
+static void TimerProgram(u8 ms);
+static void TimerCheckDue(TTimer * timer);
+
+#endif
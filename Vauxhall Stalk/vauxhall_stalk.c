@@ -5,6 +5,8 @@
 #include "vauxhall_stalk.h"
 #include "Diags.h"
 #include "global.h"
+#include "timer.h"
+#include "events.h"
 
 //#define STALK_DIAG
 
@@ -12,10 +14,20 @@
 
 void VauxhallStalkInit(void)
 {
+  EventSubscribe(EV_DISPLAY_MODE,DisplayModeChanged);
+  VauxhallStalkVariant(STALKVARIANT_ANY);
+  vx_stalk.timing = GestureTimingDefault;
   DEBUG("Vauxhall stalk init OK\n\r");
 }
 //******************************************************************************
 
+// a button held across a display mode change mustn't carry on into the new mode
+static void DisplayModeChanged(EVENT event, u16 value)
+{
+  vx_stalk.wait_for_release = 1;
+}
+//******************************************************************************
+
 void VauxhallStalkSide (void)
 {
   process_input_keys();
@@ -24,211 +36,301 @@ void VauxhallStalkSide (void)
 }
 //******************************************************************************
 
+u16 VauxhallStalkHeld(void)
+{
+  return TimerSince(VauxhallStalk.ChangedAt);
+}
+//******************************************************************************
+
 void process_stalk_packet( TCANPacket * canpkt )
 {
+  const TSTALKMAP * map;
+  BUTTON button;
+
   // we now need to check the commands comming in and send them to the pogo unit if needed
+  map = StalkLookup(vx_stalk.user_map,vx_stalk.user_map_length,canpkt->data);
+  if ( !map )
+  {
+    map = StalkLookup(vx_stalk.map,vx_stalk.map_length,canpkt->data);
+  }
 
-  if ( canpkt->data[0] == 0x01 ) // is button being pressed
+  if ( !map )
   {
-    switch ( canpkt->data[1] ) // what key is it?
+    button = BUTTON_NONE;
+    TimerStop(&vx_stalk.release_timer);
+  }
+  else if ( map->Button != STALKMAP_KEEP )
+  {
+    button = (BUTTON)map->Button;
+    if ( map->Flags & STALKMAP_TIMED )
+    {
+      TimerArm(&vx_stalk.release_timer,KEY_RELEASE_TIMEOUT);
+    }
+    else
     {
-    case 0x9f: case 0x82: // hangup button
-      vx_stalk.button = BUTTON_HANGUP;
-      break;
-    case 0x90: case 0x81: // voice button
-      vx_stalk.button = BUTTON_VOICE;
-      break;
-    case 0x91: case 0x8e: // track up
-      vx_stalk.button = BUTTON_TRACKUP;
-      break;
-    case 0x92: case 0x8f: // track down
-      vx_stalk.button = BUTTON_TRACKDOWN;
-      break;
-    case 0x9d:            // volume up
-      vx_stalk.button = BUTTON_VOLUP;
-      break;
-    case 0x9e:           // volume down
-      vx_stalk.button = BUTTON_VOLDOWN;
-      break;
+      TimerStop(&vx_stalk.release_timer);
     }
   }
-  else if ( ( canpkt->data[0] == 0x08) && ( canpkt->data[1] == 0x93 ) ) // new astra volume packet
+  else
   {
-    if ( canpkt->data[2] == 0x01 ) // volume up
+    button = vx_stalk.button;
+  }
+  if ( button != vx_stalk.button )
+  {
+    StalkButtonChanged(button);
+  }
+}
+//******************************************************************************
+
+// Presses, releases and the gestures they make, as the frames arrive
+static void StalkButtonChanged(BUTTON button)
+{
+  const TGESTURE * gesture = 0;
+
+  if ( vx_stalk.button != BUTTON_NONE )
+  {
+    vx_stalk.last_button = ( vx_stalk.gesture || ( vx_stalk.taps > 1 ) ) ? BUTTON_NONE : vx_stalk.button;
+    vx_stalk.last_button_time = TimerSince(vx_stalk.pressed_at);
+  }
+  if ( button == BUTTON_NONE )
+  {
+    TimerStop(&vx_stalk.long_timer);
+    if ( vx_stalk.taps )
     {
-      vx_stalk.button = BUTTON_VOLUP;
-      vx_stalk.key_release_timer = KEY_RELEASE_TIMEOUT;
+      TimerArm(&vx_stalk.tap_timer,vx_stalk.timing.TapGap);
     }
-    else if ( canpkt->data[2] == 0xff ) // volume down
+  }
+  else
+  {
+    if ( vx_stalk.taps && ( button != vx_stalk.tap_button ) )
     {
-      vx_stalk.button = BUTTON_VOLDOWN;
-      vx_stalk.key_release_timer = KEY_RELEASE_TIMEOUT;
+      StalkTapsDone(); // another button, so that was all the taps
     }
+    if ( ( vx_stalk.button != BUTTON_NONE ) && TimerRunning(&vx_stalk.chord_timer) )
+    {
+      gesture = GestureFind(GESTURE_CHORD,vx_stalk.button,button);
+    }
+    if ( !gesture && GestureTaps(button) )
+    {
+      TimerStop(&vx_stalk.tap_timer);
+      vx_stalk.tap_button = button;
+      vx_stalk.taps++;
+      if ( ( vx_stalk.taps == 3 ) || ( ( vx_stalk.taps == 2 ) && !GestureFind(GESTURE_TRIPLETAP,button,BUTTON_NONE) ) )
+      {
+        // nothing more it can come to, so it is the gesture now and held like one
+        gesture = GestureFind(( vx_stalk.taps == 2 ) ? GESTURE_DOUBLETAP : GESTURE_TRIPLETAP,button,BUTTON_NONE);
+        vx_stalk.taps = 0;
+      }
+    }
+    TimerArm(&vx_stalk.chord_timer,vx_stalk.timing.ChordWindow);
+    TimerArm(&vx_stalk.long_timer,vx_stalk.timing.LongPress);
+    vx_stalk.pressed_at = TimerNow();
   }
-  else
+  vx_stalk.gesture = gesture;
+  vx_stalk.button = button;
+
+#ifdef STALK_DIAG
+  switch ( button )
+  {
+  case BUTTON_NONE:
+    SendDiag("Button NONE\n\r");
+    break;
+  case BUTTON_HANGUP:
+    SendDiag("Button Hangup\n\r");
+    break;
+  case BUTTON_VOICE:
+    SendDiag("Button Voice\n\r");
+    break;
+  case BUTTON_TRACKUP:
+    SendDiag("Button Track Up\n\r");
+    break;
+  case BUTTON_TRACKDOWN:
+    SendDiag("Button Track Down\n\r");
+    break;
+  case BUTTON_VOLUP:
+    SendDiag("Button Volume Up\n\r");
+    break;
+  case BUTTON_VOLDOWN:
+    SendDiag("Button Volume Down\n\r");
+    break;
+  }
+  if ( gesture )
   {
-    vx_stalk.button = BUTTON_NONE;
-    vx_stalk.key_release_timer = 0;
+    SendDiag("Gesture\n\r");
   }
+#endif
 }
 //******************************************************************************
 
-static void process_input_keys(void)
+// Only gestures that can happen with the display and phone kit as they are now
+static const TGESTURE * GestureFind(TGESTURE_KIND kind, BUTTON button, BUTTON with)
 {
-  if ( vx_stalk.key_release_timer )
+  const TGESTURE * gesture;
+
+  for ( gesture = Gestures ; gesture < &Gestures[sizeof(Gestures) / sizeof(TGESTURE)] ; gesture++ )
   {
-    vx_stalk.key_release_timer--;
-    if ( !vx_stalk.key_release_timer )
+    if ( ( gesture->Kind == kind ) &&
+         ( ( ( gesture->Button == button ) && ( gesture->With == with ) ) ||
+           ( ( kind == GESTURE_CHORD ) && ( gesture->Button == with ) && ( gesture->With == button ) ) ) &&
+         ( !( gesture->Flags & GESTURE_RADIO ) || ( global.display_mode == DISPLAY_MODE_RADIO ) ) &&
+         ( !( gesture->Flags & GESTURE_NOPHONEKIT ) || !global.phone_kit_present ) )
     {
-      vx_stalk.button = BUTTON_NONE;
+      return gesture;
     }
   }
+  return 0;
+}
+//******************************************************************************
 
-  if ( vx_stalk.button != vx_stalk.old_button )
+// Whether presses of button have to be counted
+static bool GestureTaps(BUTTON button)
+{
+  return GestureFind(GESTURE_DOUBLETAP,button,BUTTON_NONE) || GestureFind(GESTURE_TRIPLETAP,button,BUTTON_NONE);
+}
+//******************************************************************************
+
+// The taps have stopped coming before a triple tap. The first went out as a press, a second is the double tap or, if
+// there isn't one, another press of tap_button.
+static void StalkTapsDone(void)
+{
+  const TGESTURE * gesture;
+
+  if ( vx_stalk.taps > 1 )
   {
-    vx_stalk.last_button = vx_stalk.old_button;
-    vx_stalk.last_button_time = vx_stalk.button_held_timer;
-    vx_stalk.button_held_timer = 0;
-    vx_stalk.old_button = vx_stalk.button;
+    gesture = GestureFind(GESTURE_DOUBLETAP,vx_stalk.tap_button,BUTTON_NONE);
+    vx_stalk.tapped = gesture ? gesture->Action : vx_stalk.tap_button;
   }
-  else
+  vx_stalk.taps = 0;
+  TimerStop(&vx_stalk.tap_timer);
+}
+//******************************************************************************
+
+static const TSTALKMAP * StalkLookup(const TSTALKMAP * map, u8 length, const u8 * data)
+{
+  for ( ; length ; length--, map++ )
   {
-    if ( vx_stalk.button_held_timer < 0xffff )
+    if ( ( data[0] == map->Data[0] ) &&
+         ( ( map->Flags & STALKMAP_ANY1 ) || ( data[1] == map->Data[1] ) ) &&
+         ( !( map->Flags & STALKMAP_DATA2 ) || ( data[2] == map->Data[2] ) ) )
     {
-      vx_stalk.button_held_timer++;
+      return map;
     }
   }
+  return 0;
+}
+//******************************************************************************
 
-#ifdef STALK_DIAG
-  // diags
-  if ( vx_stalk.button_held_timer == 0 ) // just pressed
+bool VauxhallStalkVariant(u8 variant)
+{
+  if ( variant >= STALKVARIANT_END )
+  {
+    return false;
+  }
+  vx_stalk.map = StalkVariants[variant].Map;
+  vx_stalk.map_length = StalkVariants[variant].Length;
+  return true;
+}
+//******************************************************************************
+
+bool VauxhallStalkUserMap(const u8 * data, u8 length)
+{
+  u8 i;
+
+  if ( ( length % STALKMAPLEN ) || ( length > ( STALKUSERMAPMAX * STALKMAPLEN ) ) )
+  {
+    return false;
+  }
+  for ( i = 0 ; i < length ; i += STALKMAPLEN )
   {
-    switch ( vx_stalk.button )
+    if ( ( data[i + 3] & ~STALKMAP_FLAGS ) || ( ( data[i + 4] > BUTTON_VOICE ) && ( data[i + 4] != STALKMAP_KEEP ) ) )
     {
-    case BUTTON_NONE:
-      SendDiag("Button NONE\n\r");
-      break;
-    case BUTTON_HANGUP:
-      SendDiag("Button Hangup\n\r");
-      break;
-    case BUTTON_VOICE:
-      SendDiag("Button Voice\n\r");
-      break;
-    case BUTTON_TRACKUP:
-      SendDiag("Button Track Up\n\r");
-      break;
-    case BUTTON_TRACKDOWN:
-      SendDiag("Button Track Down\n\r");
-      break;
-    case BUTTON_VOLUP:
-      SendDiag("Button Volume Up\n\r");
-      break;
-    case BUTTON_VOLDOWN:
-      SendDiag("Button Volume Down\n\r");
-      break;
+      return false;
     }
   }
-#endif
+  memcpy(vx_stalk.user_map,data,length);
+  vx_stalk.user_map_length = length / STALKMAPLEN;
+  return true;
+}
+//******************************************************************************
+
+bool VauxhallStalkGestureTiming(const u8 * data, u8 length)
+{
+  TGESTURETIMING timing;
+
+  if ( !length )
+  {
+    vx_stalk.timing = GestureTimingDefault;
+    return true;
+  }
+  if ( length != STALKGESTURELEN )
+  {
+    return false;
+  }
+  timing.LongPress = ( (u16)data[0] << 8 ) | data[1];
+  timing.TapGap = ( (u16)data[2] << 8 ) | data[3];
+  timing.ChordWindow = ( (u16)data[4] << 8 ) | data[5];
+  if ( !timing.LongPress || ( timing.LongPress > STALKGESTUREMAX ) || ( timing.TapGap > STALKGESTUREMAX ) ||
+       ( timing.ChordWindow > STALKGESTUREMAX ) )
+  {
+    return false;
+  }
+  vx_stalk.timing = timing;
+  return true;
+}
+//******************************************************************************
+
+static void process_input_keys(void)
+{
+  if ( TimerExpired(&vx_stalk.release_timer) )
+  {
+    StalkButtonChanged(BUTTON_NONE);
+  }
+  if ( TimerExpired(&vx_stalk.long_timer) && !vx_stalk.gesture )
+  {
+    vx_stalk.gesture = GestureFind(GESTURE_LONGPRESS,vx_stalk.button,BUTTON_NONE);
+    vx_stalk.taps = 0; // held, not tapped
+  }
+  if ( TimerExpired(&vx_stalk.tap_timer) )
+  {
+    StalkTapsDone();
+  }
 }
 //******************************************************************************
 
 
 static void process_menunavi_buttons(void)
 {
+  const TMENUNAVIKEY * key;
+
   if ( vx_stalk.menunavi_button != MENUNAVI_NONE ) // there is a button pressed
   {
+    key = &MenuNaviKeys[vx_stalk.menunavi_button];
     if ( vx_stalk.old_menunavi_button != vx_stalk.menunavi_button ) // this is the first time we have seen it
     {
-      vx_stalk.navibutton_timer = 100;
-      vx_stalk.navibutton_counter = 0;
-      switch ( vx_stalk.menunavi_button )
+      if ( key->Held )
       {
-      case MENUNAVI_MAIN:
-        send_key_can_packet(0x01,0xe0,0);
-        break;
-      case MENUNAVI_SETTINGS:
-        send_key_can_packet(0x01,0xff,0);
-        break;
-      case MENUNAVI_WHEELRIGHT:
-        send_key_can_packet(0x08,0x6a,0x01);
-        break;
-      case MENUNAVI_WHEELLEFT:
-        send_key_can_packet(0x08,0x6a,0xff);
-        break;
-      case MENUNAVI_LEFT_ARROW:
-        send_key_can_packet(0x01,0x6d,0);
-        break;
-      case MENUNAVI_RIGHT_ARROW:
-        send_key_can_packet(0x01,0x6c,0);
-        break;
-      case MENUNAVI_BC:
-        send_key_can_packet(0x01,0x01,0);
-        break;
-      case MENUNAVI_OK:
-        send_key_can_packet(0x01,0x6f,0);
-        break;
+        TimerArm(&vx_stalk.navibutton_timer,NAVIREPEATTIME);
       }
+      vx_stalk.navibutton_counter = 0;
+      send_key_can_packet(key->Type,key->Code,key->Value);
     }
-    else if ( vx_stalk.menunavi_button == vx_stalk.old_menunavi_button )
+    else if ( TimerExpired(&vx_stalk.navibutton_timer) )
     {
       // this is the repeat
-      if ( vx_stalk.navibutton_timer )
-      {
-        if (!(--vx_stalk.navibutton_timer))
-        {
-          vx_stalk.navibutton_timer = 100;
-          vx_stalk.navibutton_counter++;
-          switch ( vx_stalk.menunavi_button )
-          {
-          case MENUNAVI_MAIN:
-            send_key_can_packet(0x01,0xe0,vx_stalk.navibutton_counter);
-            break;
-          case MENUNAVI_SETTINGS:
-            send_key_can_packet(0x01,0xff,vx_stalk.navibutton_counter);
-            break;
-          case MENUNAVI_LEFT_ARROW:
-            send_key_can_packet(0x01,0x6d,vx_stalk.navibutton_counter);
-            break;
-          case MENUNAVI_RIGHT_ARROW:
-            send_key_can_packet(0x01,0x6c,vx_stalk.navibutton_counter);
-            break;
-          case MENUNAVI_BC:
-            send_key_can_packet(0x01,0x01,vx_stalk.navibutton_counter);
-            break;
-          case MENUNAVI_OK:
-            send_key_can_packet(0x01,0x6f,vx_stalk.navibutton_counter);
-            break;
-          }
-        }
-      }
+      TimerArm(&vx_stalk.navibutton_timer,NAVIREPEATTIME);
+      vx_stalk.navibutton_counter++;
+      send_key_can_packet(key->Type,key->Code,vx_stalk.navibutton_counter);
     }
   }
   else if ( vx_stalk.old_menunavi_button != MENUNAVI_NONE )
   {
-    vx_stalk.navibutton_timer = 0;
-    switch ( vx_stalk.old_menunavi_button )
+    key = &MenuNaviKeys[vx_stalk.old_menunavi_button];
+    TimerStop(&vx_stalk.navibutton_timer);
+    if ( key->Held )
     {
-    case MENUNAVI_MAIN:
-      send_key_can_packet(0x00,0xe0,vx_stalk.navibutton_counter);
-      break;
-    case MENUNAVI_SETTINGS:
-      send_key_can_packet(0x00,0xff,vx_stalk.navibutton_counter);
-      break;
-    case MENUNAVI_LEFT_ARROW:
-      send_key_can_packet(0x00,0x6d,vx_stalk.navibutton_counter);
-      break;
-    case MENUNAVI_RIGHT_ARROW:
-      send_key_can_packet(0x00,0x6c,vx_stalk.navibutton_counter);
-      break;
-    case MENUNAVI_BC:
-      send_key_can_packet(0x00,0x01,vx_stalk.navibutton_counter);
-      break;
-    case MENUNAVI_OK:
-      send_key_can_packet(0x00,0x6f,vx_stalk.navibutton_counter);
-      break;
+      send_key_can_packet(0x00,key->Code,vx_stalk.navibutton_counter);
     }
     vx_stalk.navibutton_counter = 0;
-
   }
   vx_stalk.old_menunavi_button = vx_stalk.menunavi_button;
 }
@@ -252,145 +354,144 @@ static void send_key_can_packet (u8 byte1,u8 byte2,u8 byte3)
 
 static void process_keypresses(void)
 {
-  static TDISPLAY_MODE old_display_mode;
-  static u8 wait_for_release = 0;
   static BUTTON old_vauxhall_button;
   
-  if ( global.display_mode != old_display_mode )
-  {
-    old_display_mode = global.display_mode;
-    wait_for_release = 1;
-  }
   if ( vx_stalk.button == BUTTON_NONE )
   {
-    wait_for_release = 0;
+    vx_stalk.wait_for_release = 0;
   }
 
   if( global.display_mode == DISPLAY_MODE_RADIO )
   {
     vx_stalk.menunavi_button = MENUNAVI_NONE;
-    switch ( vx_stalk.button )
+    if ( vx_stalk.gesture )
     {
-    case BUTTON_HANGUP:
-      if ( vx_stalk.button_held_timer > 2000 )
+      if ( vx_stalk.gesture->Navi != MENUNAVI_NONE ) // and whatever the first half of it was doing stops
       {
-        vx_stalk.menunavi_button = MENUNAVI_SETTINGS;
+        vx_stalk.menunavi_button = vx_stalk.gesture->Navi;
+        VauxhallStalk.Button = BUTTON_NONE;
       }
-      break;
-    case BUTTON_VOICE:
-      if ( ! (wait_for_release || global.phone_kit_present) )
+      else if ( !vx_stalk.wait_for_release )
       {
-        VauxhallStalk.Button = BUTTON_VOICE;
-        vx_stalk.extend_button_timer = 0;
+        VauxhallStalk.Button = vx_stalk.gesture->Action;
+        TimerStop(&vx_stalk.extend_timer);
       }
-      break;
-    case BUTTON_TRACKUP:
-      if ( !wait_for_release )
-      {
-        VauxhallStalk.Button = BUTTON_TRACKUP;
-        vx_stalk.extend_button_timer = 0;
-      }
-      break;
-    case BUTTON_TRACKDOWN:
-      if ( !wait_for_release )
-      {
-        VauxhallStalk.Button = BUTTON_TRACKDOWN;
-        vx_stalk.extend_button_timer = 0;
-      }
-      break;
-    case BUTTON_VOLUP:
-      if ( !wait_for_release )
-      {
-        VauxhallStalk.Button = BUTTON_VOLUP;
-        vx_stalk.extend_button_timer = 0;
-      }
-      break;
-    case BUTTON_VOLDOWN:
-      if ( !wait_for_release )
+    }
+    else if ( vx_stalk.tapped != BUTTON_NONE ) // a double tap that might have been a triple, done like a short HANGUP
+    {
+      VauxhallStalk.Button = vx_stalk.tapped;
+      TimerArm(&vx_stalk.extend_timer,KEY_EXTEND_TIME);
+    }
+    else if ( vx_stalk.taps > 1 ) // still counting them, the first press has already gone
+    {
+      if ( !TimerRunning(&vx_stalk.extend_timer) )
       {
-        VauxhallStalk.Button = BUTTON_VOLDOWN;
-        vx_stalk.extend_button_timer = 0;
+        VauxhallStalk.Button = BUTTON_NONE;
       }
-      break;
-    case BUTTON_NONE: // no button pressed now, but we may need to look for a release
-      switch ( vx_stalk.last_button )
+    }
+    else
+    {
+      switch ( vx_stalk.button )
       {
-      case BUTTON_HANGUP:
-#ifdef STALK_DIAG
-        SendDiag("Button HANGUP\n\r");
-#endif
-        if ( ( vx_stalk.last_button_time < 2000 )  && ( !global.phone_kit_present ) )
+      case BUTTON_HANGUP: // done on release, unless it turns into a long press
+        break;
+      case BUTTON_VOICE:
+        if ( ! (vx_stalk.wait_for_release || global.phone_kit_present) )
         {
-#ifdef STALK_DIAG
-          SendDiag("Button HANGUP < 2000\n\r");
-#endif
-          VauxhallStalk.Button = BUTTON_HANGUP;
-          vx_stalk.extend_button_timer = 200;
+          VauxhallStalk.Button = BUTTON_VOICE;
+          TimerStop(&vx_stalk.extend_timer);
         }
         break;
-      default:
-        if ( vx_stalk.extend_button_timer )
+      case BUTTON_TRACKUP:
+        if ( !vx_stalk.wait_for_release )
         {
-          vx_stalk.extend_button_timer--;
+          VauxhallStalk.Button = BUTTON_TRACKUP;
+          TimerStop(&vx_stalk.extend_timer);
         }
-        else
+        break;
+      case BUTTON_TRACKDOWN:
+        if ( !vx_stalk.wait_for_release )
+        {
+          VauxhallStalk.Button = BUTTON_TRACKDOWN;
+          TimerStop(&vx_stalk.extend_timer);
+        }
+        break;
+      case BUTTON_VOLUP:
+        if ( !vx_stalk.wait_for_release )
+        {
+          VauxhallStalk.Button = BUTTON_VOLUP;
+          TimerStop(&vx_stalk.extend_timer);
+        }
+        break;
+      case BUTTON_VOLDOWN:
+        if ( !vx_stalk.wait_for_release )
         {
-          VauxhallStalk.Button = BUTTON_NONE;
+          VauxhallStalk.Button = BUTTON_VOLDOWN;
+          TimerStop(&vx_stalk.extend_timer);
+        }
+        break;
+      case BUTTON_NONE: // no button pressed now, but we may need to look for a release
+        switch ( vx_stalk.last_button )
+        {
+        case BUTTON_HANGUP:
+#ifdef STALK_DIAG
+          SendDiag("Button HANGUP\n\r");
+#endif
+          if ( ( vx_stalk.last_button_time < vx_stalk.timing.LongPress ) && ( !global.phone_kit_present ) )
+          {
+#ifdef STALK_DIAG
+            SendDiag("Button HANGUP short\n\r");
+#endif
+            VauxhallStalk.Button = BUTTON_HANGUP;
+            TimerArm(&vx_stalk.extend_timer,KEY_EXTEND_TIME);
+          }
+          break;
+        default:
+          if ( !TimerRunning(&vx_stalk.extend_timer) )
+          {
+            VauxhallStalk.Button = BUTTON_NONE;
+          }
+          break;
         }
         break;
+      default:
+       VauxhallStalk.Button = BUTTON_NONE;
+        break;
       }
-      break;
-    default:
-     VauxhallStalk.Button = BUTTON_NONE;
-      break;
     }
   }
   else // must be BC or settings
   {
     VauxhallStalk.Button = BUTTON_NONE;
-    switch ( vx_stalk.button )
+    if ( vx_stalk.gesture && ( vx_stalk.gesture->Navi != MENUNAVI_NONE ) )
     {
-    case BUTTON_HANGUP:
-      if ( vx_stalk.button_held_timer > 2000 )
-      {
-        vx_stalk.menunavi_button = MENUNAVI_SETTINGS;
-      }
-      break;
-    case BUTTON_TRACKUP:
-      if ( !wait_for_release )
-      {
-        vx_stalk.menunavi_button = MENUNAVI_RIGHT_ARROW ;
-      }
-      break;
-    case BUTTON_TRACKDOWN:
-      if ( !wait_for_release )
-      {
-        vx_stalk.menunavi_button = MENUNAVI_LEFT_ARROW;
-      }
-      break;
-    case BUTTON_VOLUP:
-      if ( !wait_for_release )
-      {
-        vx_stalk.menunavi_button = MENUNAVI_OK;
-      }
-      break;
-    case BUTTON_VOLDOWN:
-      if ( !wait_for_release )
+      vx_stalk.menunavi_button = vx_stalk.gesture->Navi;
+    }
+    else
+    {
+      switch ( vx_stalk.button )
       {
-        vx_stalk.menunavi_button = MENUNAVI_MAIN ;
+      case BUTTON_HANGUP:
+        break;
+      default:
+        if ( NaviButtons[vx_stalk.button] == MENUNAVI_NONE )
+        {
+          vx_stalk.menunavi_button = MENUNAVI_NONE;
+        }
+        else if ( !vx_stalk.wait_for_release )
+        {
+          vx_stalk.menunavi_button = NaviButtons[vx_stalk.button];
+        }
+        break;
       }
-      break;
-    default:
-      vx_stalk.menunavi_button = MENUNAVI_NONE;
     }
   }
   vx_stalk.last_button = BUTTON_NONE;
+  vx_stalk.tapped = BUTTON_NONE;
   
-  if ( VauxhallStalk.TimeHeld != 0xffff )
-    VauxhallStalk.TimeHeld++;
   if ( old_vauxhall_button != VauxhallStalk.Button )
   {
-    VauxhallStalk.TimeHeld = 0;
+    VauxhallStalk.ChangedAt = TimerNow();
     old_vauxhall_button = VauxhallStalk.Button;
   }
 }
@@ -10,20 +10,56 @@ typedef enum
   BUTTON_TRACKUP,
   BUTTON_TRACKDOWN,
   BUTTON_HANGUP,
-  BUTTON_VOICE
+  BUTTON_VOICE,
+  BUTTON_PICKUP,            // these two never come from the stalk itself, only from gestures
+  BUTTON_PHONEHANGUP
 }BUTTON;
 
+// Steering wheel codings, see StalkVariants[]. Never renumber these, the choice is kept in the flash store.
+typedef enum
+{
+  STALKVARIANT_ANY,         // every coding we know of, the default
+  STALKVARIANT_9X,          // presses coded 0x90 - 0x9f only
+  STALKVARIANT_8X,          // presses coded 0x81 - 0x8f, volume on the 0x08 0x93 wheel frame
+  STALKVARIANT_END
+}STALKVARIANT;
+
+// A stalk frame mapping is STALKMAPLEN bytes, [data0][data1][data2][STALKMAP_ flags][BUTTON or STALKMAP_KEEP].
+// The first mapping that matches the frame decides the button, a frame nothing matches releases it.
+#define STALKMAPLEN         5
+#define STALKMAP_ANY1       0x01      // don't compare data1
+#define STALKMAP_DATA2      0x02      // compare data2 as well
+#define STALKMAP_TIMED      0x04      // the stalk sends no release for this one, let go after KEY_RELEASE_TIMEOUT ms
+#define STALKMAP_KEEP       0xff      // leave the button as it is
+#define STALKUSERMAPMAX     3         // user mappings, so they fit in one flash store value
+
+// Gesture thresholds are STALKGESTURELEN bytes, [long press][tap gap][chord window], each a big endian u16 in ms
+// upto STALKGESTUREMAX. A long press is held that long, the taps of a double or triple tap are no further apart than
+// the tap gap, and the two buttons of a chord are pressed within the chord window of each other.
+#define STALKGESTURELEN     6
+#define STALKGESTUREMAX     10000
+
 typedef struct 
 {
   BUTTON Button;
-  u16 TimeHeld;
+  u16 ChangedAt;            // TimerNow() when Button last changed
 }VAUXHALL_STALK;
 
 extern VAUXHALL_STALK VauxhallStalk;
 
+// ms VauxhallStalk.Button has been as it is, wraps after 65s
+extern u16 VauxhallStalkHeld(void);
+
 extern void VauxhallStalkInit(void);
 extern void VauxhallStalkSide(void);
 extern void process_stalk_packet( TCANPacket * canpkt );
+// Picks the built in mapping table. Returns false if there isn't one for variant.
+extern bool VauxhallStalkVariant(u8 variant);
+// Upto STALKUSERMAPMAX mappings that are looked at before the variant's, so a new steering wheel can be supported from
+// diagnostics. Length 0 clears them. Returns false, changing nothing, if any of them is no good.
+extern bool VauxhallStalkUserMap(const u8 * data, u8 length);
+// Sets the gesture thresholds, length 0 puts the defaults back. Returns false, changing nothing, if they are no good.
+extern bool VauxhallStalkGestureTiming(const u8 * data, u8 length);
 
 #endif
 
@@ -1,8 +1,11 @@
 #ifndef VAUXHALLSTALK_INTERNAL_H
 #define VAUXHALLSTALK_INTERNAL_H
 #include "vauxhall_stalk.h"
+#include "events.h"
+#include "timer.h"
 
-#define KEY_RELEASE_TIMEOUT   350
+#define KEY_RELEASE_TIMEOUT   350         // ms
+#define KEY_EXTEND_TIME       200         // ms a button done on release is held for on the head unit side
 
 typedef enum
 {
@@ -17,19 +20,160 @@ typedef enum
   MENUNAVI_OK
 }TMENUNAVI_BUTTON;
 
+// The layout of a mapping in the user map, see STALKMAPLEN
+typedef struct
+{
+  u8 Data[3];
+  u8 Flags;
+  u8 Button;                                // BUTTON or STALKMAP_KEEP
+}TSTALKMAP;
+
+#define STALKMAP_FLAGS      ( STALKMAP_ANY1 | STALKMAP_DATA2 | STALKMAP_TIMED )
+
+// Every press is [0x01][code], anything else on 0x206 is a release. A press we don't know keeps the button we have.
+#define STALKMAP_PRESSES_9X \
+  { { 0x01, 0x9f, 0x00 }, 0, BUTTON_HANGUP }, \
+  { { 0x01, 0x90, 0x00 }, 0, BUTTON_VOICE }, \
+  { { 0x01, 0x91, 0x00 }, 0, BUTTON_TRACKUP }, \
+  { { 0x01, 0x92, 0x00 }, 0, BUTTON_TRACKDOWN }, \
+  { { 0x01, 0x9d, 0x00 }, 0, BUTTON_VOLUP }, \
+  { { 0x01, 0x9e, 0x00 }, 0, BUTTON_VOLDOWN }
+#define STALKMAP_PRESSES_8X \
+  { { 0x01, 0x82, 0x00 }, 0, BUTTON_HANGUP }, \
+  { { 0x01, 0x81, 0x00 }, 0, BUTTON_VOICE }, \
+  { { 0x01, 0x8e, 0x00 }, 0, BUTTON_TRACKUP }, \
+  { { 0x01, 0x8f, 0x00 }, 0, BUTTON_TRACKDOWN }
+// new astra volume packet, one per click of the wheel and no release
+#define STALKMAP_VOLUMEWHEEL \
+  { { 0x08, 0x93, 0x01 }, STALKMAP_DATA2 | STALKMAP_TIMED, BUTTON_VOLUP }, \
+  { { 0x08, 0x93, 0xff }, STALKMAP_DATA2 | STALKMAP_TIMED, BUTTON_VOLDOWN }, \
+  { { 0x08, 0x93, 0x00 }, 0, STALKMAP_KEEP }
+#define STALKMAP_OTHERPRESS \
+  { { 0x01, 0x00, 0x00 }, STALKMAP_ANY1, STALKMAP_KEEP }
+
+static const TSTALKMAP StalkMapAny[] = { STALKMAP_PRESSES_9X, STALKMAP_PRESSES_8X, STALKMAP_VOLUMEWHEEL, STALKMAP_OTHERPRESS };
+static const TSTALKMAP StalkMap9x[] = { STALKMAP_PRESSES_9X, STALKMAP_OTHERPRESS };
+static const TSTALKMAP StalkMap8x[] = { STALKMAP_PRESSES_8X, STALKMAP_VOLUMEWHEEL, STALKMAP_OTHERPRESS };
+
+static const struct
+{
+  const TSTALKMAP * Map;
+  u8 Length;
+}StalkVariants[STALKVARIANT_END] =
+{
+  { StalkMapAny, sizeof(StalkMapAny) / sizeof(TSTALKMAP) },
+  { StalkMap9x, sizeof(StalkMap9x) / sizeof(TSTALKMAP) },
+  { StalkMap8x, sizeof(StalkMap8x) / sizeof(TSTALKMAP) }
+};
+
+// What goes out on 0x201 for each menu/navi button. Held ones are sent again every NAVIREPEATTIME with a count in
+// data2, then released with a 0x00 frame carrying the count. The rest go once.
+#define NAVIREPEATTIME        100
+
+typedef struct
+{
+  u8 Type;
+  u8 Code;
+  u8 Value;                                 // data2 of the first frame
+  bool Held;
+}TMENUNAVIKEY;
+
+static const TMENUNAVIKEY MenuNaviKeys[] =
+{
+  { 0x00, 0x00, 0x00, false },              // MENUNAVI_NONE
+  { 0x01, 0xe0, 0x00, true },               // MENUNAVI_MAIN
+  { 0x01, 0xff, 0x00, true },               // MENUNAVI_SETTINGS
+  { 0x08, 0x6a, 0x01, false },              // MENUNAVI_WHEELRIGHT
+  { 0x08, 0x6a, 0xff, false },              // MENUNAVI_WHEELLEFT
+  { 0x01, 0x6d, 0x00, true },               // MENUNAVI_LEFT_ARROW
+  { 0x01, 0x6c, 0x00, true },               // MENUNAVI_RIGHT_ARROW
+  { 0x01, 0x01, 0x00, true },               // MENUNAVI_BC
+  { 0x01, 0x6f, 0x00, true }                // MENUNAVI_OK
+};
+
+// What the stalk buttons do when the display is showing the BC or settings menus. HANGUP is done by hand, a long
+// press is settings.
+static const TMENUNAVI_BUTTON NaviButtons[] =
+{
+  MENUNAVI_NONE,                            // BUTTON_NONE
+  MENUNAVI_OK,                              // BUTTON_VOLUP
+  MENUNAVI_MAIN,                            // BUTTON_VOLDOWN
+  MENUNAVI_RIGHT_ARROW,                     // BUTTON_TRACKUP
+  MENUNAVI_LEFT_ARROW,                      // BUTTON_TRACKDOWN
+  MENUNAVI_NONE,                            // BUTTON_HANGUP
+  MENUNAVI_NONE,                            // BUTTON_VOICE
+  MENUNAVI_NONE,                            // BUTTON_PICKUP
+  MENUNAVI_NONE                             // BUTTON_PHONEHANGUP
+};
+
+// Gestures are picked out as the stalk frames arrive. A press always does its own thing straight away, and a long press
+// or the second half of a chord takes over from it. Presses of a button with tap gestures are counted as well, and the
+// later taps do the gesture rather than the press: straight away on the tap that can't lead to anything more, or TapGap
+// after a double tap that could still have been a triple. Taps go to the head unit, Navi is for long presses and chords.
+typedef enum
+{
+  GESTURE_DOUBLETAP,
+  GESTURE_TRIPLETAP,
+  GESTURE_LONGPRESS,
+  GESTURE_CHORD                             // Button then With, or the other way round
+}TGESTURE_KIND;
+
+#define GESTURE_RADIO       0x01            // only when the display is showing the radio
+#define GESTURE_NOPHONEKIT  0x02            // the phone kit has these when it is fitted
+
+typedef struct
+{
+  TGESTURE_KIND Kind;
+  BUTTON Button;
+  BUTTON With;
+  u8 Flags;
+  BUTTON Action;                            // to the head unit, or BUTTON_NONE for
+  TMENUNAVI_BUTTON Navi;                    // a menu/navi key to the display
+}TGESTURE;
+
+// The first one that matches is taken
+static const TGESTURE Gestures[] =
+{
+  { GESTURE_LONGPRESS,  BUTTON_HANGUP,  BUTTON_NONE,      0,                                  BUTTON_NONE,        MENUNAVI_SETTINGS },
+  { GESTURE_CHORD,      BUTTON_TRACKUP, BUTTON_TRACKDOWN, GESTURE_RADIO,                      BUTTON_NONE,        MENUNAVI_BC },
+  { GESTURE_DOUBLETAP,  BUTTON_VOICE,   BUTTON_NONE,      GESTURE_RADIO | GESTURE_NOPHONEKIT, BUTTON_PICKUP,      MENUNAVI_NONE },
+  { GESTURE_TRIPLETAP,  BUTTON_VOICE,   BUTTON_NONE,      GESTURE_RADIO | GESTURE_NOPHONEKIT, BUTTON_PHONEHANGUP, MENUNAVI_NONE }
+};
+
+typedef struct
+{
+  u16 LongPress;                            // ms
+  u16 TapGap;
+  u16 ChordWindow;
+}TGESTURETIMING;
+
+static const TGESTURETIMING GestureTimingDefault = { 2000, 400, 200 };
+
 typedef struct
 {
   BUTTON button;
-  BUTTON old_button;
-  BUTTON last_button;
+  BUTTON last_button;                       // released, or BUTTON_NONE if a gesture took it
   TMENUNAVI_BUTTON menunavi_button;
   TMENUNAVI_BUTTON old_menunavi_button;
-  u16 button_held_timer;
-  u16 key_release_timer;
+  u16 pressed_at;                           // TimerNow()
   u16 last_button_time;
-  u8 navibutton_timer;
+  TTimer release_timer;                     // running while a STALKMAP_TIMED button is held
+  TTimer navibutton_timer;                  // till the next repeat of a held menu/navi key
   u8 navibutton_counter;
-  u8 extend_button_timer;
+  TTimer extend_timer;                      // running while a button done on release is held for the head unit
+  u8 wait_for_release;                      // set by a display mode change
+  const TSTALKMAP * map;                    // the variant's
+  u8 map_length;
+  u8 user_map_length;
+  TSTALKMAP user_map[STALKUSERMAPMAX];
+  const TGESTURE * gesture;                 // taken over the button held now
+  TGESTURETIMING timing;
+  BUTTON tap_button;
+  u8 taps;                                  // of tap_button, still being counted
+  BUTTON tapped;                            // what a double tap came to after TapGap, to go out on the next pass
+  TTimer long_timer;                        // running while a long press could still happen
+  TTimer tap_timer;                         // and the next press could be another tap
+  TTimer chord_timer;                       // or the other half of a chord
 }TVX_STALK;
 
 TVX_STALK vx_stalk;
@@ -40,6 +184,12 @@ static void process_input_keys(void);
 static void process_menunavi_buttons(void);
 static void send_key_can_packet (u8 byte1,u8 byte2,u8 byte3);
 static void process_keypresses(void);
+static void DisplayModeChanged(EVENT event, u16 value);
+static const TSTALKMAP * StalkLookup(const TSTALKMAP * map, u8 length, const u8 * data);
+static void StalkButtonChanged(BUTTON button);
+static const TGESTURE * GestureFind(TGESTURE_KIND kind, BUTTON button, BUTTON with);
+static bool GestureTaps(BUTTON button);
+static void StalkTapsDone(void);
 
 #endif
 
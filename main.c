@@ -7,20 +7,48 @@
 #include "main.h"
 #include "radioside.h"
 #include "diags.h"
+#include "flash_store.h"
+#include "timer.h"
+#include "scheduler.h"
+#include "events.h"
+#include "speed_pulse.h"
+#include "button_out.h"
+#include "can_trace.h"
+#include "vauxhall_stalk.h"
 
 static void ConfigureClock(void);
 static void ConfigurePorts(void);
+static void ConfigureCANPins(void);
 static void ConfigureTimers(void);
-static void MSFunctions(void);
+static void ConfigureSleepTimer(void);
+static void TickEnd(void);
 
 struct global_def global;
-volatile u8 timer_flag,delay;
+static volatile bool IgnitionWake;
+static volatile bool Asleep;                // timer RA has become the sleep tick
 
 __no_init volatile u32 WakeByIgnitionToken @ 0xffc;
 
-// approx 1000 per second
-#define IGNONDELAY          2000
-#define IGNACTIVEDELAY      10000
+// in sleep the ignition line is looked at on the timer RA tick, these are in ticks
+#define SLEEPTICK           10                      // ms
+#define IGNONDELAY          ( 2000 / SLEEPTICK )
+#define IGNACTIVEDELAY      ( 10000 / SLEEPTICK )
+
+const TTASK Tasks[TASK_END] =
+{
+  { CarSideReceive,       true },   // TASK_CANRX, on the tick too so the controller status gets looked at
+  { EventsRun,            false },  // TASK_EVENTS
+  { CarSideNM,            true },   // TASK_NM
+  { CANSide,              true },   // TASK_CAN
+  { VauxhallStalkSide,    true },   // TASK_STALK
+  { SetButton,            true },   // TASK_RADIO
+  { CarSideISO,           true },   // TASK_ISO
+  { CarSideDiags,         true },   // TASK_DIAGS
+  { CarSideDisplay,       true },   // TASK_DISPLAY
+  { CarSideProgramming,   true },   // TASK_PROGRAM
+  { FlashStoreRun,        true },   // TASK_FLASH
+  { TickEnd,              true }    // TASK_TICKEND
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -29,13 +57,34 @@ __no_init volatile u32 WakeByIgnitionToken @ 0xffc;
 
 void main( void )
 {
+  bool WarmBoot;
+
   __disable_interrupt();
-  InitDiags();
-  DEBUG("\r\nVauxhall CAN Stalk to Pioneer Software Start\r\n");
   ConfigureClock();
+  WarmBoot = CarSideWarmBoot();
+  if ( WarmBoot )
+  {
+    // we have come out of our own sleep, the bus is waking up so get on it before doing anything else
+    ConfigureCANPins();
+    InitCarSideCAN();
+  }
+  InitDiags();
+  if ( WarmBoot )
+  {
+    DEBUG("\r\nWarm Boot\r\n");
+  }
+  else
+  {
+    DEBUG("\r\nVauxhall CAN Stalk to Pioneer Software Start\r\n");
+  }
+  DiagsLog(LOG_BOOT,WarmBoot,0);
+  CanTraceInit();
   ConfigurePorts();
   ConfigureTimers();
+  FlashStoreInit();
   InitCarSide();
+  InitRadioSide();
+  SchedulerInit();
   __enable_interrupt();
   cspro = 0;
   cspro = 1;
@@ -44,36 +93,44 @@ void main( void )
 
   for(;;)
   {
-    while( !timer_flag)
+    if ( timer_flag )
+    {
+      timer_flag = 0;     // reset flag
+      // reset watchdog
+      wdtr = 0x00;
+      wdtr = 0xFF;
+      global.timeout++;
+      TaskReadyTick();
+    }
+    if ( CANRxPending() )
     {
-      can_int(); // check for any received packets
-      DiagsProcessing(); // send out any diags
-      // wait here for timer to interrupt and set flag
+      TaskReady(TASK_CANRX);
+      TimerEndTick(); // something has come in part way through a long tick, it can't wait for the end of it
+    }
+    if ( !SchedulerRun() )
+    {
+      // nothing ready, wait here for the timer to interrupt or a CAN frame to come in. Look again with the interrupts
+      // off so anything that has just turned up is dealt with now. Only an interrupt in the one instruction between
+      // enabling them and the wait can still get in first, then we wait for the next one, which could be a whole
+      // TIMER_MAXTICK tick away. The watchdog is kicked here so that still leaves it well inside its ~32ms.
+      __disable_interrupt();
+      if ( !timer_flag && !CANRxPending() && SchedulerIdle() )
+      {
+        wdtr = 0x00;
+        wdtr = 0xFF;
+        __enable_interrupt();
+        __wait_for_interrupt();
+      }
+      __enable_interrupt();
     }
-    timer_flag = 0;     // reset flag
-    MSFunctions();
   }
 }
 /********************************************************************************************************************************/
 
-static void MSFunctions(void)
+// Task, runs after everything else on the tick
+static void TickEnd(void)
 {
-    static bool IgnitionWakeActive = false;
-    static bool IgnitionWake = false;
-    static u32 IgnitionOnTime = 0;
-    static u32 IgnitionOffTime = 0;
-
-    // reset watchdog
-    wdtr = 0x00;
-    wdtr = 0xFF;
-
-    global.timeout++;
-
-    SetButton();
-    CANSide();
-    CarSide();
-
-    if (global.sleep)
+    if ( global.sleep && !FlashStoreBusy() ) // an erase has to finish before the clock goes
     {
       CANSleep ();
       STB = 1;                  // switch off CAN tranceiver
@@ -82,8 +139,9 @@ static void MSFunctions(void)
       REVERSE = 0;
       SPEED = 0;
       PARK = 0;
-      PD1_bit.PD1_2 = 0;  // set stalk lines back to inputs
-      PD1_bit.PD1_1 = 0;
+      ButtonOutStop();    // set stalk lines back to inputs
+      PD1_bit.PD1_2 = 0;
+      CarSidePrepareWarmBoot();
       ////////////////////////// not actually sleep , but run in slow mode on internal oscillator /////////////
       __disable_interrupt();    // switch interrupts off for now
       prcr = 3;                 // unprotect CM0, CM1 and OCD registers ( and PM0 & PM1 for watchdog)
@@ -92,43 +150,28 @@ static void MSFunctions(void)
       ocd2 = 1;                 // select internal oscillator
       cm05 = 1;                 // switch external oscillator off
       prcr = 0;                 // protect registers
-//      __enable_interrupt();
 
+      // only the CAN wake-up interrupt and the sleep timer are allowed to get us out of wait mode
+      TRBIC = 0;
+      TRBCR = 0;
+      TRD0IC = 0;
+      TRDSTR = 0;
+      DiagsSleep();
       IgnitionWake = false;
-      IgnitionWakeActive = false;
+      Asleep = true;
+      ConfigureSleepTimer();
+      __enable_interrupt();
+
       while (P6_bit.P6_2 && (!IgnitionWake) )
       {
-        // wait here till the CAN receive line changes( pulls low)
-        // reset watchdog
+        // wait here till the CAN receive line changes( pulls low), the CPU stops till the next interrupt.
+        // The watchdog keeps counting in wait mode (count source protection) so it gets kicked every tick.
         wdtr = 0x00;
         wdtr = 0xFF;
-        if ( P3_bit.P3_7 ) // Ign on ( ATT line )
-        {
-          IgnitionOffTime = 0;
-          IgnitionOnTime++;
-          if ( !IgnitionOnTime )
-          {
-            IgnitionOnTime--;
-          }
-        }
-        else
-        {
-          IgnitionOnTime = 0;
-          if ( IgnitionOffTime < IGNACTIVEDELAY )
-          {
-            IgnitionOffTime++;
-          }
-          else
-          {
-            IgnitionWakeActive = true;
-          }
-        }
-        if ( IgnitionWakeActive && ( IgnitionOnTime > IGNONDELAY ) )
-        {
-          IgnitionWake = true;
-          WakeByIgnitionToken = IGNITIONWAKETOKEN;
-        }
+        __wait_for_interrupt();
       }
+      __disable_interrupt();
+      TRACR = 0;
       while (1)
       {
         PRCR = 0x02;
@@ -137,6 +180,11 @@ static void MSFunctions(void)
       }
     }
 
+    if ( !CANIdle() )
+    {
+      TimerKeepTicking();
+    }
+    TimerNextTick();
 }
 /********************************************************************************************************************************/
 
@@ -210,6 +258,12 @@ static void ConfigurePorts(void)
   IGNITION = 0;
   PD3_bit.PD3_5 = 1;      // Park brake drive output
   PARK = 0;
+  ConfigureCANPins();
+}
+/********************************************************************************************************************************/
+
+static void ConfigureCANPins(void)
+{
   // CAN Tranceiver pins
   PD3_bit.PD3_0 = 1;      // Standby output pin
   STB = 0;
@@ -219,36 +273,70 @@ static void ConfigurePorts(void)
 static void ConfigureTimers(void)
 {
   // Timers will depend on which radio we using. Use TimerRB for main program flow and IR generation.
-  // Use TimerRA for Speed pulse generation.
-
-  // Pioneer will run main loop round a 1mS timer
-  TRBMR  = 0x10;    // select f8 as a source
-  TRBPRE = 7;       // 8 loops of
-  TRBPR = 249;      // 250 counts
-  TRBIC = 1;        // enable interrupt
-  TRBCR = 1  ;      // start timer
+  // Use TimerRD for Speed pulse generation, and TimerRA for the button sequencer till it becomes the sleep tick.
+
+  // Pioneer will run main loop round a 1mS timer, stretched out by the timer service when nothing needs it
+  TimerInit();
   // The speed pulse timer will only be started when it needs to be!
-  TRDSTR = 0;           // don't start the timer yet!
-  TRDMR = 0;            // leave mode register as default
-  TRDPMR = 0;           // leave PWM mode register as default
-  TRDFCR = 0x80;        // upper bit must be set
-  TRDOER1 = 0xFF;       // set pins as I/O
-  TRDOER2 = 0;          // leave output master enable register 2 as default
-  TRDOCR = 0;           // leave output control regaster as default
-  TRDCR0 = 0x04;        // select f32 as a count source
-  TRDIORA0 = 8;         // set bit 3
-  TRDIORC0 = 0x88;      // set pins as I/O
-  TRDGRA0 = 0xA2C3;     // value equates to 1Hz. set this as the default
-  TRDIER0 = 0x01;       // set the interrupt enable register to trigger on bit A compare only
-  TRD0IC = 1;           // enable timer RD channel 0 interrupt
-  TRDSTR = 1;           // start the timer now!
+  SpeedPulseInit();
+  ButtonOutInit();
 }
 /********************************************************************************************************************************/
 
-#pragma vector = 24
-static __interrupt void TimerRbIntr (void)
+// Only used while we sleep. The CPU is on the low speed on-chip oscillator by then, so f8 is about 15.6kHz
+static void ConfigureSleepTimer(void)
 {
-  timer_flag = 1;
+  TRACR = 0;        // stop it while we set it up
+  TRAIOC = 0;
+  TRAMR = 0x10;     // timer mode, f8 as a source
+  TRAPRE = 155;     // 156 counts of
+  TRA = 0;          // 1 gives a SLEEPTICK of about 10ms
+  TRAIC = 1;        // enable interrupt
+  TRACR = 1;        // start timer
+}
+/********************************************************************************************************************************/
+
+// Ignition debounce while we sleep. The ATT line has to have been off for IGNACTIVEDELAY before it counts, then on
+// for IGNONDELAY to wake us. P3_7 has no external interrupt so it is sampled here, the CPU sleeps in between.
+// While we are awake timer RA belongs to the button sequencer.
+#pragma vector = 22
+static __interrupt void TimerRaIntr (void)
+{
+  static bool IgnitionWakeActive = false;
+  static u16 IgnitionOnTime = 0;
+  static u16 IgnitionOffTime = 0;
+
+  if ( !Asleep )
+  {
+    ButtonOutTick();
+    return;
+  }
+
+  if ( P3_bit.P3_7 ) // Ign on ( ATT line )
+  {
+    IgnitionOffTime = 0;
+    if ( IgnitionOnTime < IGNONDELAY )
+    {
+      IgnitionOnTime++;
+    }
+    else if ( IgnitionWakeActive )
+    {
+      IgnitionWake = true;
+      WakeByIgnitionToken = IGNITIONWAKETOKEN;
+    }
+  }
+  else
+  {
+    IgnitionOnTime = 0;
+    if ( IgnitionOffTime < IGNACTIVEDELAY )
+    {
+      IgnitionOffTime++;
+    }
+    else
+    {
+      IgnitionWakeActive = true;
+    }
+  }
 }
 /********************************************************************************************************************************/
 
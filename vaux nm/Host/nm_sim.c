@@ -0,0 +1,508 @@
+// Host side simulation of an NM ring. Every node, ours and the modelled display, radio, phone etc., is a copy of the
+// real vaux_nm.c state machine in its own NMContext, all on one virtual bus that can lose frames and delay them.
+// Each run wakes the ring from cold, lets it settle, then turns the ignition off and waits for it all to go to sleep,
+// then wakes everyone but us and brings us in last to time the join. Runs are repeatable for a given seed.
+// After each converge every frame is checked to come from the node the last one addressed, so only one token goes
+// round, and the exit code is 2 if any run had a second one going round or fell apart.
+//
+//   gcc -o nm_sim -I.. -I../../Misc -I"../../R8C CAN" -I../../Timer -I../../Diags nm_sim.c ../vaux_nm.c
+//   nm_sim [-n 1,6,7,3] [-l loss%] [-d delay ms] [-j wake jitter ms] [-r runs] [-s seed] [-f] [-v]
+//          [-C TxCheckMulti] [-c TxCheckSingle] [-D TxStatusDelay] [-S Sleep] [-N DeadNetwork]
+//
+// The first node in -n is ours ( address 1 by default ), -f wakes it with NMC_FORCEWAKE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vaux_nm.h"
+
+#define SIMMAXFRAMES      64              // in flight on the bus at once
+#define SIMSETTLE         5000            // ms the ring has to hold together after converging, messages are counted over it
+#define SIMTIMEOUT        30000           // ms to give up waiting for anything
+
+typedef struct
+{
+  TCANPacket Pkt;
+  u32 Due;                                // SimNow it arrives at the other nodes
+}SIMFRAME;
+
+static struct
+{
+  u32 Now;                                // ms, TimerNow() is the bottom 16 bits of this
+  u8 Nodes;
+  u8 Addr[NMMAXNODES];
+  NMPlatform Platform[NMMAXNODES];
+  NMContext Node[NMMAXNODES];
+  bool Awake[NMMAXNODES];                 // told to wake and not told to sleep since
+  NMTiming Timing;
+  SIMFRAME Frame[SIMMAXFRAMES];
+  u8 In, Out;
+  u32 Sent;
+  u32 Lost;
+  bool Watch;                             // checking every frame comes from the node the one before addressed, from two
+                                          // TxStatusDelays after converging, time enough to drop the tokens it started with
+  bool Watching;                          // and the first frame since Watch was set has been seen
+  u8 TokenFrom;                           // the node the last frame on the bus came from, it can skip on to another
+  u8 TokenAt;                             // and the node it addressed
+  u32 Stray;                              // frames from anyone else while watching, a second token
+  u32 StrayAt;                            // SimNow of the last one
+  u8 StrayRun;                            // strays in a row, each within two TxStatusDelays of the last
+  u32 Going;                              // and runs of three, it made two hops rather than merging on the first
+  u32 Random;
+  u16 Loss;                               // per receiver, 1/10 %
+  u16 Delay;
+  u16 Jitter;
+  bool ForceWake;
+  bool Verbose;
+}Sim;
+
+// What a run measures, ms unless it says otherwise
+typedef struct
+{
+  u32 Converge;                           // cold wake to every node ACTIVE with the same netlist
+  u32 Rate;                               // NM frames a second once it has
+  bool Stable;                            // and it was still converged SIMSETTLE later
+  bool OneToken;                          // and only one token went round the ring, then and after our join
+  bool Blip;                              // a lost frame can still make one for a hop or so
+  u32 Sleep;                              // ignition off to the last node off the bus
+  u32 SleepSpread;                        // first node off the bus to the last
+  u32 Join;                               // our wake to us ACTIVE, with the rest of the ring already running
+  u32 Seen;                               // and to every other node having us in its netlist
+}SIMRESULT;
+
+/********************************************************************************************************************************/
+
+// The timer service the NM code is built against, running on simulated time. There is no chain, SimTimers() does the
+// job of TimerNextTick() and marks every NM timer that has fallen due, as it has to before the clock wraps.
+
+u16 TimerNow(void)
+{
+  return (u16)Sim.Now;
+}
+u16 TimerSince(u16 then)
+{
+  return (u16)Sim.Now - then;
+}
+void TimerArm(TTimer * timer, u16 ms)
+{
+  timer->Expiry = (u16)Sim.Now + ms;
+  timer->Armed = true;
+  timer->Due = false;
+}
+void TimerStop(TTimer * timer)
+{
+  timer->Armed = false;
+  timer->Due = false;
+}
+static void SimCheckDue(TTimer * timer)
+{
+  if ( timer->Armed && !timer->Due && ( (sint16)( timer->Expiry - (u16)Sim.Now ) <= 0 ) )
+  {
+    timer->Due = true;
+  }
+}
+bool TimerRunning(TTimer * timer)
+{
+  SimCheckDue(timer);
+  return timer->Armed && !timer->Due;
+}
+bool TimerExpired(TTimer * timer)
+{
+  SimCheckDue(timer);
+  if ( timer->Due )
+  {
+    timer->Armed = false;
+    timer->Due = false;
+    return true;
+  }
+  return false;
+}
+static void SimTimers(NMContext * nm)
+{
+  SimCheckDue(&nm->NetCacheTimer);
+  SimCheckDue(&nm->SleepTimer);
+  SimCheckDue(&nm->TXCheckTimer);
+  SimCheckDue(&nm->TXStatusDelay);
+  SimCheckDue(&nm->RXNetHoldDelay);
+  SimCheckDue(&nm->DeadNetwork);
+}
+/********************************************************************************************************************************/
+
+// nm_init() points every node at CANTx(), they all share the bus here so it just queues the frame
+CANErr CANTx(TCANPacket * pkt)
+{
+  SIMFRAME * frame = &Sim.Frame[Sim.In];
+
+  if ( (u8)( Sim.In + 1 ) % SIMMAXFRAMES == Sim.Out )
+  {
+    fprintf(stderr, "%7lu bus queue full\n", (unsigned long)Sim.Now);
+    return CANERR_TX_BUFOVFLOW;
+  }
+  frame->Pkt = *pkt;
+  frame->Due = Sim.Now + ( Sim.Delay ? Sim.Delay : 1 );
+  Sim.In = ( Sim.In + 1 ) % SIMMAXFRAMES;
+  Sim.Sent++;
+  if ( Sim.Verbose )
+  {
+    printf("%7lu  %03x  %x>%x  list %02x%02x  status %02x\n", (unsigned long)Sim.Now, pkt->id, pkt->data[0] & 0x0f,
+           pkt->data[0] >> 4, pkt->data[1], pkt->data[2], pkt->data[3]);
+  }
+  return CANERR_TX_OK;
+}
+/********************************************************************************************************************************/
+
+// xorshift, so a seed gives the same run on any host
+static u32 SimRandom(void)
+{
+  Sim.Random ^= Sim.Random << 13;
+  Sim.Random ^= Sim.Random >> 17;
+  Sim.Random ^= Sim.Random << 5;
+  return Sim.Random;
+}
+
+// One ms: frames that are due go to every node but the sender, then every node has its tick
+static void SimStep(void)
+{
+  u8 n, from, to;
+
+  while ( ( Sim.Out != Sim.In ) && ( (sint32)( Sim.Frame[Sim.Out].Due - Sim.Now ) <= 0 ) )
+  {
+    from = Sim.Frame[Sim.Out].Pkt.data[0] & 0x0f;
+    to = Sim.Frame[Sim.Out].Pkt.data[0] >> 4;
+    // addressing the node that has the token is a shout up, it makes no new one
+    if ( Sim.Watching && ( from != Sim.TokenAt ) && ( from != Sim.TokenFrom ) && ( to != Sim.TokenAt ) )
+    {
+      Sim.StrayRun = ( Sim.Stray && ( Sim.Now - Sim.StrayAt <= 2u * Sim.Timing.TxStatusDelay ) ) ? Sim.StrayRun + 1 : 1;
+      if ( Sim.StrayRun == 3 )
+      {
+        Sim.Going++;
+      }
+      Sim.Stray++;
+      Sim.StrayAt = Sim.Now;
+      if ( Sim.Verbose )
+      {
+        printf("%7lu  second token\n", (unsigned long)Sim.Now);
+      }
+    }
+    Sim.Watching = Sim.Watch;
+    Sim.TokenFrom = from;
+    Sim.TokenAt = to;
+    for ( n = 0 ; n < Sim.Nodes ; n++ )
+    {
+      if ( Sim.Frame[Sim.Out].Pkt.id == Sim.Platform[n].BaseId + Sim.Addr[n] )
+      {
+        continue;
+      }
+      if ( ( SimRandom() % 1000 ) < Sim.Loss )
+      {
+        Sim.Lost++;
+        continue;
+      }
+      nm_can(&Sim.Node[n], &Sim.Frame[Sim.Out].Pkt);
+    }
+    Sim.Out = ( Sim.Out + 1 ) % SIMMAXFRAMES;
+  }
+  for ( n = 0 ; n < Sim.Nodes ; n++ )
+  {
+    nm_1ms(&Sim.Node[n]);
+    SimTimers(&Sim.Node[n]);
+  }
+  Sim.Now++;
+}
+
+// Every node that is awake is ACTIVE and has exactly the awake nodes in its netlist
+static bool SimConverged(void)
+{
+  u16 awake = 0;
+  u8 n;
+
+  for ( n = 0 ; n < Sim.Nodes ; n++ )
+  {
+    if ( Sim.Awake[n] )
+    {
+      awake |= 1 << Sim.Addr[n];
+    }
+  }
+  for ( n = 0 ; n < Sim.Nodes ; n++ )
+  {
+    if ( Sim.Awake[n] && ( ( nm_status(&Sim.Node[n]) != NME_ACTIVE ) || ( nm_netlist(&Sim.Node[n]) != awake ) ) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool SimAllAsleep(void)
+{
+  u8 n;
+
+  for ( n = 0 ; n < Sim.Nodes ; n++ )
+  {
+    if ( nm_status(&Sim.Node[n]) != NME_SLEEPING )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Each node in [first, last) gets cmd somewhere in the next Jitter ms, the way they all see the ignition change at
+// slightly different times. Runs the bus while it does. Returns when the last one has had it.
+static void SimCommand(u8 first, u8 last, NMCommand cmd)
+{
+  u32 at[NMMAXNODES];
+  u32 end = Sim.Now;
+  u8 n;
+
+  for ( n = first ; n < last ; n++ )
+  {
+    at[n] = Sim.Now + ( Sim.Jitter ? SimRandom() % Sim.Jitter : 0 );
+    if ( at[n] > end )
+    {
+      end = at[n];
+    }
+  }
+  for ( ;; )
+  {
+    for ( n = first ; n < last ; n++ )
+    {
+      if ( at[n] == Sim.Now )
+      {
+        nm_cmd(&Sim.Node[n], ( ( cmd == NMC_WAKE ) && ( n == 0 ) && Sim.ForceWake ) ? NMC_FORCEWAKE : cmd);
+        Sim.Awake[n] = ( cmd != NMC_SLEEP );
+      }
+    }
+    if ( Sim.Now == end )
+    {
+      return;
+    }
+    SimStep();
+  }
+}
+
+// Run until test() is true, returns how long that took or SIMTIMEOUT
+static u32 SimUntil(bool (*test)(void))
+{
+  u32 start = Sim.Now;
+
+  while ( !test() )
+  {
+    if ( Sim.Now - start >= SIMTIMEOUT )
+    {
+      return SIMTIMEOUT;
+    }
+    SimStep();
+  }
+  return Sim.Now - start;
+}
+/********************************************************************************************************************************/
+
+static void SimRun(SIMRESULT * result)
+{
+  u32 start, sent, first;
+  u8 n;
+
+  for ( n = 0 ; n < Sim.Nodes ; n++ )
+  {
+    nm_init(&Sim.Node[n], &Sim.Platform[n]);
+    Sim.Awake[n] = false;
+  }
+  Sim.In = Sim.Out = 0;
+
+  // cold start, everyone
+  start = Sim.Now;
+  SimCommand(0, Sim.Nodes, NMC_WAKE);
+  SimUntil(SimConverged);
+  result->Converge = Sim.Now - start;
+  sent = Sim.Sent;
+  Sim.Stray = 0;
+  Sim.StrayRun = 0;
+  Sim.Going = 0;
+  Sim.Watching = false;
+  for ( start = Sim.Now ; Sim.Now - start < SIMSETTLE ; )
+  {
+    Sim.Watch = ( Sim.Now - start >= 2u * Sim.Timing.TxStatusDelay );
+    SimStep();
+  }
+  Sim.Watch = false;
+  result->Rate = ( ( Sim.Sent - sent ) * 1000 ) / SIMSETTLE;
+  result->Stable = SimConverged();
+
+  // ignition off
+  start = Sim.Now;
+  first = 0;
+  SimCommand(0, Sim.Nodes, NMC_SLEEP);
+  while ( !SimAllAsleep() && ( Sim.Now - start < SIMTIMEOUT ) )
+  {
+    if ( !first )
+    {
+      for ( n = 0 ; n < Sim.Nodes ; n++ )
+      {
+        if ( nm_status(&Sim.Node[n]) == NME_SLEEPING )
+        {
+          first = Sim.Now;
+        }
+      }
+    }
+    SimStep();
+  }
+  result->Sleep = Sim.Now - start;
+  result->SleepSpread = first ? Sim.Now - first : 0;
+
+  // the rest of the ring comes up without us, then we join it
+  SimCommand(1, Sim.Nodes, NMC_WAKE);
+  SimUntil(SimConverged);
+  for ( start = Sim.Now ; Sim.Now - start < 1000 ; )
+  {
+    SimStep();
+  }
+  start = Sim.Now;
+  SimCommand(0, 1, NMC_WAKE);
+  while ( ( nm_status(&Sim.Node[0]) != NME_ACTIVE ) && ( Sim.Now - start < SIMTIMEOUT ) )
+  {
+    SimStep();
+  }
+  result->Join = Sim.Now - start;
+  result->Seen = SimUntil(SimConverged) + result->Join;
+  Sim.Watching = false;
+  for ( start = Sim.Now ; Sim.Now - start < SIMSETTLE ; )
+  {
+    Sim.Watch = ( Sim.Now - start >= 2u * Sim.Timing.TxStatusDelay );
+    SimStep();
+  }
+  Sim.Watch = false;
+  result->OneToken = !Sim.Going;
+  result->Blip = ( Sim.Stray != 0 );
+
+  // and back to sleep, ready for the next run
+  SimCommand(0, Sim.Nodes, NMC_SLEEP);
+  SimUntil(SimAllAsleep);
+  for ( start = Sim.Now ; Sim.Now - start < 5000 ; )
+  {
+    SimStep();
+  }
+}
+/********************************************************************************************************************************/
+
+static void Usage(void)
+{
+  fprintf(stderr, "nm_sim [-n 1,6,7,3] [-l loss%%] [-d delay ms] [-j wake jitter ms] [-r runs] [-s seed] [-f] [-v]\n"
+                  "       [-C TxCheckMulti] [-c TxCheckSingle] [-D TxStatusDelay] [-S Sleep] [-N DeadNetwork]\n");
+  exit(1);
+}
+
+static void Report(const char * name, u32 * values, int runs)
+{
+  u32 min = 0xffffffff, max = 0, total = 0;
+  int i;
+
+  for ( i = 0 ; i < runs ; i++ )
+  {
+    total += values[i];
+    min = ( values[i] < min ) ? values[i] : min;
+    max = ( values[i] > max ) ? values[i] : max;
+  }
+  printf("%-28s %7lu %7lu %7lu\n", name, (unsigned long)min, (unsigned long)( total / runs ), (unsigned long)max);
+}
+
+int main(int argc, char ** argv)
+{
+  const char * nodes = "1,6,7,3";
+  int runs = 10, i, unstable = 0, tokens = 0, blips = 0;
+  u32 * converge, * rate, * sleep, * spread, * join, * seen;
+  SIMRESULT result;
+  char * p;
+
+  Sim.Random = 1;
+  Sim.Timing = *NMPlatformVauxhall.Timing;
+  for ( i = 1 ; i < argc ; i++ )
+  {
+    if ( ( argv[i][0] != '-' ) || !argv[i][1] || argv[i][2] )
+    {
+      Usage();
+    }
+    switch ( argv[i][1] )
+    {
+    case 'f':
+      Sim.ForceWake = true;
+      continue;
+    case 'v':
+      Sim.Verbose = true;
+      continue;
+    }
+    if ( ++i >= argc )
+    {
+      Usage();
+    }
+    switch ( argv[i - 1][1] )
+    {
+    case 'n': nodes = argv[i]; break;
+    case 'l': Sim.Loss = (u16)( atof(argv[i]) * 10 ); break;
+    case 'd': Sim.Delay = atoi(argv[i]); break;
+    case 'j': Sim.Jitter = atoi(argv[i]); break;
+    case 'r': runs = atoi(argv[i]); break;
+    case 's': Sim.Random = strtoul(argv[i], 0, 0); break;
+    case 'C': Sim.Timing.TxCheckMulti = atoi(argv[i]); break;
+    case 'c': Sim.Timing.TxCheckSingle = atoi(argv[i]); break;
+    case 'D': Sim.Timing.TxStatusDelay = atoi(argv[i]); break;
+    case 'S': Sim.Timing.Sleep = atoi(argv[i]); break;
+    case 'N': Sim.Timing.DeadNetwork = atoi(argv[i]); break;
+    default: Usage();
+    }
+  }
+  if ( !Sim.Random || ( runs < 1 ) )
+  {
+    Usage();
+  }
+
+  for ( p = (char *)nodes ; *p && ( Sim.Nodes < NMMAXNODES ) ; )
+  {
+    Sim.Addr[Sim.Nodes] = (u8)strtoul(p, &p, 0) & 0x0f;
+    Sim.Platform[Sim.Nodes] = NMPlatformVauxhall;
+    Sim.Platform[Sim.Nodes].Addr = Sim.Addr[Sim.Nodes];
+    Sim.Platform[Sim.Nodes].Timing = &Sim.Timing;
+    Sim.Nodes++;
+    if ( *p == ',' )
+    {
+      p++;
+    }
+  }
+  if ( Sim.Nodes < 2 )
+  {
+    Usage();
+  }
+
+  converge = malloc(runs * sizeof(u32));
+  rate = malloc(runs * sizeof(u32));
+  sleep = malloc(runs * sizeof(u32));
+  spread = malloc(runs * sizeof(u32));
+  join = malloc(runs * sizeof(u32));
+  seen = malloc(runs * sizeof(u32));
+  for ( i = 0 ; i < runs ; i++ )
+  {
+    SimRun(&result);
+    converge[i] = result.Converge;
+    rate[i] = result.Rate;
+    sleep[i] = result.Sleep;
+    spread[i] = result.SleepSpread;
+    join[i] = result.Join;
+    seen[i] = result.Seen;
+    unstable += !result.Stable;
+    tokens += !result.OneToken;
+    blips += result.Blip && result.OneToken;
+  }
+
+  printf("%d nodes, %d runs, loss %d.%d%%, delay %dms, jitter %dms\n", Sim.Nodes, runs, Sim.Loss / 10, Sim.Loss % 10,
+         Sim.Delay, Sim.Jitter);
+  printf("%-28s %7s %7s %7s\n", "", "min", "avg", "max");
+  Report("converge from cold, ms", converge, runs);
+  Report("NM frames a second", rate, runs);
+  Report("ignition off to asleep, ms", sleep, runs);
+  Report("first to last off bus, ms", spread, runs);
+  Report("our join to ACTIVE, ms", join, runs);
+  Report("our join to all agree, ms", seen, runs);
+  printf("%d frames sent, %d lost, %d runs fell apart after converging\n", (int)Sim.Sent, (int)Sim.Lost, unstable);
+  printf("%d runs had more than one token going round, %d more had one for a hop or so\n", tokens, blips);
+  return ( unstable || tokens ) ? 2 : 0;
+}
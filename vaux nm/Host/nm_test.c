@@ -0,0 +1,229 @@
+// Host side test of the NM state machine. vaux_nm.c is built in to this file so its NMTransitions[] table and the
+// actions behind it can be driven directly: every state is put through every event and checked against the table
+// below, written out from how the ring is meant to behave rather than copied from the code, then each action is
+// checked for what it leaves behind.
+//
+//   gcc -o nm_test -I.. -I../../Misc -I"../../R8C CAN" -I../../Timer -I../../Diags nm_test.c
+//   nm_test
+//
+// Prints each failure and exits 1 if there were any.
+
+#include <stdio.h>
+#include "../vaux_nm.c"
+
+#define NOCHANGE  ( (NMInternalState)0xfe )
+
+static const char * const StateName[] = { "SLEEPING", "GOINGTOSLEEP", "READYFORSLEEP", "RUNNING", "STARTUP" };
+static const char * const EventName[] = { "WANTSLEEP", "WANTWAKE", "SLEEPTIMER", "DEADNETWORK", "STATUSDUE", "WAKEFRAME",
+                                          "ADDRESSED" };
+
+#define TESTSTATES  ( sizeof(StateName) / sizeof(StateName[0]) )
+#define TESTEVENTS  ( sizeof(EventName) / sizeof(EventName[0]) )
+
+// Where each state goes on each event
+static const NMInternalState Expected[TESTSTATES][TESTEVENTS] =
+{
+  //                   WANTSLEEP           WANTWAKE      SLEEPTIMER        DEADNETWORK  STATUSDUE     WAKEFRAME    ADDRESSED
+  /* SLEEPING */      { NOCHANGE,          NMI_STARTUP,  NOCHANGE,         NMI_STARTUP, NOCHANGE,     NMI_RUNNING, NOCHANGE },
+  /* GOINGTOSLEEP */  { NOCHANGE,          NOCHANGE,     NOCHANGE,         NMI_STARTUP, NMI_SLEEPING, NOCHANGE,    NOCHANGE },
+  /* READYFORSLEEP */ { NOCHANGE,          NMI_STARTUP,  NMI_GOINGTOSLEEP, NMI_STARTUP, NOCHANGE,     NOCHANGE,    NOCHANGE },
+  /* RUNNING */       { NMI_READYFORSLEEP, NOCHANGE,     NOCHANGE,         NMI_STARTUP, NOCHANGE,     NOCHANGE,    NOCHANGE },
+  /* STARTUP */       { NMI_READYFORSLEEP, NOCHANGE,     NOCHANGE,         NMI_STARTUP, NOCHANGE,     NOCHANGE,    NMI_RUNNING }
+};
+
+static u32 TestNow = 1000;
+static int Failures;
+static int Checks;
+
+#define CHECK(what, ok)   Check(__LINE__, what, ok)
+
+static void Check(int line, const char * what, bool ok)
+{
+  Checks++;
+  if ( !ok )
+  {
+    Failures++;
+    printf("line %d: %s\n", line, what);
+  }
+}
+
+/********************************************************************************************************************************/
+
+// Just enough of the timer service for one context. The clock stands still, each action is looked at as it leaves things
+
+u16 TimerNow(void)
+{
+  return (u16)TestNow;
+}
+u16 TimerSince(u16 then)
+{
+  return (u16)TestNow - then;
+}
+void TimerArm(TTimer * timer, u16 ms)
+{
+  timer->Expiry = (u16)TestNow + ms;
+  timer->Armed = true;
+  timer->Due = false;
+}
+void TimerStop(TTimer * timer)
+{
+  timer->Armed = false;
+  timer->Due = false;
+}
+bool TimerRunning(TTimer * timer)
+{
+  return timer->Armed && ( (sint16)( timer->Expiry - (u16)TestNow ) > 0 );
+}
+bool TimerExpired(TTimer * timer)
+{
+  if ( timer->Armed && ( (sint16)( timer->Expiry - (u16)TestNow ) <= 0 ) )
+  {
+    timer->Armed = false;
+    return true;
+  }
+  return false;
+}
+
+// Nothing goes on a bus, the actions are looked at directly
+CANErr CANTx(TCANPacket * pkt)
+{
+  (void)pkt;
+  return CANERR_TX_OK;
+}
+
+/********************************************************************************************************************************/
+
+static void TestFresh(NMContext * nm, NMInternalState state)
+{
+  nm_init(nm, &NMPlatformVauxhall);
+  nm->CurrentState = state;
+  nm->WantedState = state;
+}
+
+// Every state against every event, what the table does with it and whether it says it did anything
+static void TestTable(void)
+{
+  NMContext nm;
+  NMInternalState want;
+  char what[80];
+  bool took;
+  u8 s, e;
+
+  for ( s = 0 ; s < TESTSTATES ; s++ )
+  {
+    for ( e = 0 ; e < TESTEVENTS ; e++ )
+    {
+      TestFresh(&nm, (NMInternalState)s);
+      took = nm_event(&nm, (NMEvent)e);
+      want = ( Expected[s][e] == NOCHANGE ) ? (NMInternalState)s : Expected[s][e];
+      sprintf(what, "%s on %s went to %s, not %s", StateName[s], EventName[e], StateName[nm.CurrentState],
+              StateName[want]);
+      CHECK(what, nm.CurrentState == want);
+      sprintf(what, "%s on %s %s", StateName[s], EventName[e], took ? "was taken" : "was not taken");
+      CHECK(what, took == ( Expected[s][e] != NOCHANGE ));
+    }
+  }
+}
+
+// What each action leaves behind
+static void TestActions(void)
+{
+  NMContext nm;
+
+  // nothing heard for DeadNetwork, start again talking to ourselves
+  TestFresh(&nm, NMI_RUNNING);
+  nm.Succ = 6;
+  nm.NetList = 0x0042;
+  nm_event(&nm, NMEV_DEADNETWORK);
+  CHECK("restart talks to itself", nm.Succ == NMPlatformVauxhall.Addr);
+  CHECK("restart sends a skip", nm.StatusByte == ( NMSB_SKIP | NMSB_NETWANTED ));
+  CHECK("restart frame is due now", TimerExpired(&nm.TXStatusDelay));
+  CHECK("restart rearms dead network", TimerRunning(&nm.DeadNetwork));
+
+  // ready for sleep, then the sleep timer
+  TestFresh(&nm, NMI_RUNNING);
+  nm.StatusByte = NMSB_NETWANTED;
+  nm_event(&nm, NMEV_WANTSLEEP);
+  CHECK("ready for sleep drops net wanted", !( nm.StatusByte & NMSB_NETWANTED ));
+  CHECK("ready for sleep keeps running", nm.StatusByte & NMSB_RUNNING);
+  CHECK("ready for sleep starts the sleep timer", TimerRunning(&nm.SleepTimer));
+  nm_event(&nm, NMEV_SLEEPTIMER);
+  CHECK("going to sleep acks", nm.StatusByte & NMSB_SLEEPACK);
+
+  // and our last frame takes us off the bus
+  TestFresh(&nm, NMI_GOINGTOSLEEP);
+  nm.NetList = 0x0042;
+  nm.ExtState = NME_ACTIVE;
+  TimerArm(&nm.DeadNetwork, NMTimingVauxhall.DeadNetwork);
+  TimerArm(&nm.TXCheckTimer, NMTimingVauxhall.TxCheckMulti);
+  nm_event(&nm, NMEV_STATUSDUE);
+  CHECK("off bus is sleeping", nm.ExtState == NME_SLEEPING);
+  CHECK("off bus leaves the netlist", nm.NetList == 0x0040);
+  CHECK("off bus stops dead network", !TimerRunning(&nm.DeadNetwork));
+  CHECK("off bus stops the tx check", !TimerRunning(&nm.TXCheckTimer));
+
+  // wake on a quiet bus, talk to ourselves straight away
+  TestFresh(&nm, NMI_SLEEPING);
+  nm_event(&nm, NMEV_WANTWAKE);
+  CHECK("wake is awake", nm.ExtState == NME_AWAKE);
+  CHECK("wake wants the net", nm.StatusByte == NMSB_NETWANTED);
+  CHECK("wake puts us in the netlist", nm.NetList & ( 1 << NMPlatformVauxhall.Addr ));
+  CHECK("wake on a quiet bus talks now", TimerExpired(&nm.TXStatusDelay));
+  CHECK("wake on our own checks for an answer", TimerRunning(&nm.TXCheckTimer));
+
+  // force wake says so in the first frame
+  TestFresh(&nm, NMI_SLEEPING);
+  nm.ForceWake = true;
+  nm_event(&nm, NMEV_WANTWAKE);
+  CHECK("force wake frame", nm.StatusByte == NMSB_FORCEWAKE);
+  CHECK("force wake only once", !nm.ForceWake);
+
+  // wake with the ring talking, wait to be let in rather than start a second token
+  TestFresh(&nm, NMI_SLEEPING);
+  nm.RingLive = true;
+  nm.LastHeardAt = TimerNow() - ( NMTimingVauxhall.TxStatusDelay / 2 );
+  nm.NetList = 0x00c2;
+  nm.Succ = 6;
+  nm_event(&nm, NMEV_WANTWAKE);
+  CHECK("wake into a running ring waits", !TimerRunning(&nm.TXStatusDelay) && !TimerExpired(&nm.TXStatusDelay));
+  CHECK("wake into a running ring keeps the succ", nm.Succ == 6);
+
+  // and once it has been quiet for a TxStatusDelay, go in to the succ we know
+  TestFresh(&nm, NMI_SLEEPING);
+  nm.RingLive = true;
+  nm.LastHeardAt = TimerNow() - NMTimingVauxhall.TxStatusDelay;
+  nm.NetList = 0x00c2;
+  nm.Succ = 6;
+  nm_event(&nm, NMEV_WANTWAKE);
+  CHECK("wake into a quiet ring talks now", TimerExpired(&nm.TXStatusDelay));
+  CHECK("wake into a quiet ring doesn't wait on itself", !TimerRunning(&nm.TXCheckTimer));
+
+  // back from ready for sleep, we are still talking
+  TestFresh(&nm, NMI_READYFORSLEEP);
+  nm.StatusByte = NMSB_RUNNING;
+  TimerArm(&nm.TXStatusDelay, NMTimingVauxhall.TxStatusDelay);
+  nm_event(&nm, NMEV_WANTWAKE);
+  CHECK("resume wants the net", nm.StatusByte == NMSB_NETWANTED);
+  CHECK("resume is awake", nm.ExtState == NME_AWAKE);
+  CHECK("resume leaves our slot alone", TimerRunning(&nm.TXStatusDelay));
+
+  // woken by another node, we go to sleep again when it does
+  TestFresh(&nm, NMI_SLEEPING);
+  nm_event(&nm, NMEV_WAKEFRAME);
+  CHECK("woken goes back to ready for sleep", nm.WantedState == NMI_READYFORSLEEP);
+  CHECK("woken wants the net", nm.StatusByte == NMSB_NETWANTED);
+
+  // the ring comes round to us
+  TestFresh(&nm, NMI_STARTUP);
+  nm.StatusByte = NMSB_NETWANTED;
+  nm_event(&nm, NMEV_ADDRESSED);
+  CHECK("joined is running", nm.StatusByte == ( NMSB_NETWANTED | NMSB_RUNNING ));
+}
+
+int main(void)
+{
+  TestTable();
+  TestActions();
+  printf("%d checks, %d failed\n", Checks, Failures);
+  return Failures ? 1 : 0;
+}
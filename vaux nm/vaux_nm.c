@@ -1,315 +1,457 @@
-#include "vaux_nm.h"
+#include "vaux_nm_internal.h"
 #include <string.h>
 #include "diags.h"
 
 // HISTORY
 
+// 19-10-26
+// only one token goes round the ring. On wake we only start talking if the ring has been quiet for a TxStatusDelay,
+// otherwise we go in when we hear our pred address our succ. A second token, from nodes waking together, is dropped by
+// whichever of the two holders has the higher address, and its pred doesn't skip it for that while the ring is talking
+
+// 19-10-26
+// per node last seen, status and fault count, so presence has a time limit on it rather than waiting for the ring to
+// drop the node
+
+// 19-10-26
+// netlists that check out are cached for NetCacheHold, so on wake into a quiet ring we start it to the right succ
+// instead of waiting for DeadNetwork. A running ring we still join when our pred next addresses our succ, and are
+// addressed ourselves once it has gone round again
+
+// 19-10-26
+// state changes are now the NMTransitions[] table, and all the state is in an NMContext so the ring address, size,
+// base id and timing come from an NMPlatform rather than #defines
+
 // 26-01-09
 // added ability to set the extra 4 data bytes sent out with every NM frame
 
-#define OURADDR 1
+const NMPlatform NMPlatformVauxhall = { 0x500, 1, 16, &NMTimingVauxhall };
 
-// When we are sleeping, we still sniff the bus and grab the netlist. It expires after we don't see any NM
-// for this amount of time. This allows for speedier wakeup, as we already know who to talk to.
-#define RXNETHOLDTIME 200
+// Local functions //
 
-// Delay between being told to go sleep and actually doing it. Delay for display and radio is 10 seconds,
-// so we copy that here.
-#define SLEEPTIME 10000
+// Runs the first transition in the table for this state and event. Returns false if there isn't one.
+static bool nm_event (NMContext * nm, NMEvent event)
+{
+  const NMTransition * t;
 
-// NM Status packet delays. Singlenode = Only us on the network. Multinode = at least one other node talking to us.
-// (Multinode should never expire if the network is running properly, if it does, we lost our succ)
-#define TXCHECKTIME_SINGLENODE 100
-#define TXCHECKTIME_NORMAL 100
-#define TXCHECKTIME_MULTINODE 150
+  for (t = NMTransitions; t < &NMTransitions[sizeof(NMTransitions) / sizeof(NMTransitions[0])]; t++)
+  {
+    if ((t->Event == event) && ((t->State == nm->CurrentState) || (t->State == NMI_ANY)))
+    {
+      if (t->Action)
+        t->Action(nm);
+      nm->CurrentState = t->Next;
+      return true;
+    }
+  }
+  return false;
+}
 
-// By default we talk 100ms after we have been addressed. However, if we have been skipped, then we talk ASAP
-#define TXSTATUSDELAY_NORMAL 100
-#define TXSTATUSDELAY_NOW 1
+// Next address round the ring after addr that is in list, or addr if the list is empty
+static u8 NextInList (NMContext * nm, u16 list, u8 Addr)
+{
+  if (!(list & nm->RingMask))
+    return Addr;
+  for (;;)
+  {
+    Addr ++;
+    if (Addr >= nm->Platform->RingSize)
+      Addr = 0;
+    if (list & (1 << Addr))
+      return Addr;
+  }
+}
 
-// If no network traffic for this period with an active network list, we reinit the network.
-#define DEADNETWORKDELAY 1700
+// Find succ to addr in NetList
+static u8 FindSucc (NMContext * nm, u8 Addr)
+{
+  // We are in the list ourselves unless we have left the bus, and NextInList() copes with the list being empty then.
+  return NextInList (nm, nm->NetList, Addr);
+}
 
-static NMInternalState CurrentState = NMI_SLEEPING, WantedState = NMI_SLEEPING;
-static NMExternalState ExtCurrentState = NME_SLEEPING;
-static u16 NetList = 1 << OURADDR;        // By default, there's only us on the network
-static u16 FaultyNetList = 0;             // List of faulty nodes on the net (Inverted, 0 = Faulty)
-static const u8 OurAddr = OURADDR;
-static u8 Succ = OURADDR;                 // and our succ will be ourselves until we find out differently
-static u8 NextSucc = 0;
+// Keeps track of the ring while we listen. A netlist is only cached once two frames in a row have carried it, and
+// only from a frame that has its sender and the node it addresses in the list and isn't a node leaving the ring.
+static void nm_cache_frame (NMContext * nm, TCANPacket * msg, u8 msgsucc)
+{
+  u16 list = ((msg->data[1] << 8) | msg->data[2]) & nm->RingMask;
+  u8 sender = msg->id - nm->Platform->BaseId;
 
-static u16 SleepTimer = 0;                // Used for transition from "ready to sleep" to "sleep" and off-bus
-static u16 TXCheckTimer = 0;              // Ensures our packets are replied to
-static u16 TXStatusDelay = 0;             // How long to wait before sending out our status
-static u16 RXNetHoldDelay = 0;            // We still sniff bus traffic when sleeping - this is how long we hold onto the info for.
-static u16 DeadNetwork = 0;
+  nm->RingLive = true;
+  nm->LastHeardAt = TimerNow();
+  nm->LastHeardTo = msgsucc;
 
-static u8 CurrentStatusByte = 0x02;       // Our node status
-static u8 NMData[4] = {0,0,0,0};
+  if ((msg->dlc >= 4) && (msgsucc < nm->Platform->RingSize) && (list & (1 << sender)) && (list & (1 << msgsucc)) &&
+      !(msg->data[3] & NMSB_SLEEPACK))
+  {
+    if (list == nm->NetCacheCandidate)
+    {
+      nm->NetCache = list;
+      TimerArm(&nm->NetCacheTimer, nm->Platform->Timing->NetCacheHold);
+    }
+    nm->NetCacheCandidate = list;
+  }
+}
 
-static u8 FindSucc (u8 Addr);
-static void CalcNetList (u8 *NewList);
-static u8 vaux_nm_canwake (TCANPacket *msg);
-static bool ForceNetworkWake = false;
+// A frame from node. A sleep ack is the node leaving the ring, so it goes straight away rather than timing out.
+static void nm_node_heard (NMContext * nm, u8 node, u8 status)
+{
+  nm->Nodes[node].LastSeen = TimerNow();
+  nm->Nodes[node].Status = status;
+  if ((status & NMSB_SLEEPACK) || (node == nm->Platform->Addr))
+    nm->Present &= ~(1 << node);
+  else
+    nm->Present |= (1 << node);
+}
 
-// Local functions //
+// node was addressed and didn't answer
+static void nm_node_fault (NMContext * nm, u8 node)
+{
+  if (nm->Nodes[node].Faults < 0xff)
+    nm->Nodes[node].Faults++;
+}
 
-// Find succ to addr in global NetList
-static u8 FindSucc (u8 Addr)
+static void nm_node_timeouts (NMContext * nm)
 {
-  // We will always be in the list ourselves, so no need for any getout clauses.
-  for (;;)
+  u8 node;
+
+  for (node = 0; node < nm->Platform->RingSize; node++)
   {
-    Addr ++;
-    Addr &= 15;
-    if (NetList & (1 << Addr))
-      return Addr;
+    if ((nm->Present & (1 << node)) && (TimerSince(nm->Nodes[node].LastSeen) >= nm->Platform->Timing->NodeTimeout))
+      nm->Present &= ~(1 << node);
   }
 }
 
-static void CalcNetList (u8 *NewList)
+// A frame from sender to msgsucc that shows there is another token going round as well as ours, and ours is the one
+// that should go. Of two holders the higher address drops out, so each compares itself with the node the other frame
+// addressed. Nobody else should talk while we hold the token, ie. have a frame due or are talking to ourselves. Nor
+// should anyone have talked to another node just before we were addressed. And the token we passed on can't be back
+// with us this soon, it has to go through at least one other node's TxStatusDelay first.
+static bool nm_second_token (NMContext * nm, u8 sender, u8 msgsucc)
+{
+  const u8 OurAddr = nm->Platform->Addr;
+  const u16 Soon = nm->Platform->Timing->TxStatusDelay >> 1;
+
+  if (msgsucc == OurAddr)
+  {
+    if (TimerSince(nm->SentAt) < Soon)
+      return sender < OurAddr;
+    return nm->RingLive && (nm->LastHeardTo < OurAddr) && (TimerSince(nm->LastHeardAt) < Soon);
+  }
+  return (msgsucc < OurAddr) && (TimerRunning(&nm->TXStatusDelay) || ((nm->Succ == OurAddr) && TimerRunning(&nm->TXCheckTimer)));
+}
+
+static void CalcNetList (NMContext * nm, u8 *NewList)
 {
   // Rebuild netlist
-  NetList = NewList[0] << 8;
-  NetList |= NewList[1];
-  NetList |= ( 1 << OurAddr); // Ensure we are in the list ourself.
+  nm->NetList = NewList[0] << 8;
+  nm->NetList |= NewList[1];
+  nm->NetList &= nm->RingMask;
+  nm->NetList |= ( 1 << nm->Platform->Addr ); // Ensure we are in the list ourself.
 
   // Calculate new successor (previously, we would calculate the predecessor too for the purpose of checking whether or not we
   // have been missed out of the loop. It can cause problems however if our pred is intermittant, so we just check succ now)
-  Succ = FindSucc (OurAddr);
+  nm->Succ = FindSucc (nm, nm->Platform->Addr);
+}
+
+// Transition actions //
+
+// No nodes talking at all? Attempt to restart the network.
+static void nm_restart (NMContext * nm)
+{
+  nm->Succ = nm->Platform->Addr;
+  nm->NextSucc = nm->Succ;
+  nm->StatusByte = NMSB_SKIP | NMSB_NETWANTED;
+  nm->NetList |= ( 1 << nm->Platform->Addr );
+  nm->FaultyNetList = nm->NetList;
+  TimerArm(&nm->DeadNetwork, nm->Platform->Timing->DeadNetwork);
+  TimerStop(&nm->TXCheckTimer);
+  TimerArm(&nm->TXStatusDelay, TXSTATUSDELAY_NOW);
+}
+
+static void nm_sleep_ack (NMContext * nm)
+{
+  nm->StatusByte |= NMSB_SLEEPACK;
+}
+
+static void nm_ready_for_sleep (NMContext * nm)
+{
+  nm->StatusByte &= ~NMSB_NETWANTED;
+  nm->StatusByte |= NMSB_RUNNING;
+  TimerArm(&nm->SleepTimer, nm->Platform->Timing->Sleep);
+}
+
+static void nm_wake (NMContext * nm)
+{
+  if ((nm->Succ == nm->Platform->Addr) && !nm->RingLive && TimerRunning(&nm->NetCacheTimer))
+  {
+    // The netlist we heard has gone, but the cached one is still good
+    nm->NetList = nm->NetCache | (1 << nm->Platform->Addr);
+    nm->Succ = FindSucc (nm, nm->Platform->Addr);
+  }
+
+  // If the ring has been quiet for a TxStatusDelay, then talk now, to ourselves or the cached succ. Otherwise there is a
+  // token going round already, so leave it to nm_can() to put us in when it hears our pred addressing our succ.
+  nm->SentAt = TimerNow() - nm->Platform->Timing->TxStatusDelay;   // nothing sent yet
+  if (nm->RingLive && (TimerSince(nm->LastHeardAt) < nm->Platform->Timing->TxStatusDelay))
+  {
+    TimerStop(&nm->TXStatusDelay);
+  }
+  else
+  {
+    if (nm->Succ == nm->Platform->Addr)
+      TimerArm(&nm->TXCheckTimer, nm->Platform->Timing->TxCheckSingle);
+    TimerArm(&nm->TXStatusDelay, TXSTATUSDELAY_NOW);
+  }
+  nm->StatusByte = NMSB_NETWANTED;
+  if (nm->ForceWake)
+  {
+    nm->ForceWake = false;
+    nm->StatusByte = NMSB_FORCEWAKE;
+  }
+  nm->ExtState = NME_AWAKE;
+  nm->NetList |= ( 1 << nm->Platform->Addr );
+  nm->FaultyNetList = nm->NetList;
+  nm->NextSucc = nm->Succ;
+  TimerArm(&nm->DeadNetwork, nm->Platform->Timing->DeadNetwork);
+}
+
+// No need to setup any timers, as we are already talking.
+static void nm_resume (NMContext * nm)
+{
+  nm->StatusByte = NMSB_NETWANTED;
+  nm->ExtState = NME_AWAKE;
+}
+
+// Remove ourselves from the network
+static void nm_off_bus (NMContext * nm)
+{
+  TimerStop(&nm->DeadNetwork); // Don't try to recover from this. We don't care if the network dies from now on.
+  TimerStop(&nm->TXCheckTimer); // nor if our succ answers
+  nm->ExtState = NME_SLEEPING;
+  nm->NetList &= ~(1 << nm->Platform->Addr);
+}
+
+static void nm_woken (NMContext * nm)
+{
+  // We leave WantedState at ready for sleep so we can sleep again in Sleep ms.
+  // Our netlist should have already been rebuilt by this point, so we are sending to the right person and
+  // no need to do anything else here apart from setting the status byte.
+  nm->WantedState = NMI_READYFORSLEEP;
+  nm->StatusByte = NMSB_NETWANTED; // Not sure whether this should be NETWANTED or RUNNING.
+  DEBUG("NM Wake\r\n");
+}
+
+static void nm_joined (NMContext * nm)
+{
+  nm->StatusByte |= NMSB_RUNNING;
 }
 
 // Global functions //
 
-void vaux_nm_1ms (void)
+void nm_init (NMContext * nm, const NMPlatform * platform)
+{
+  nm->Platform = platform;
+  nm->Transmit = CANTx;
+  nm->CurrentState = NMI_SLEEPING;
+  nm->WantedState = NMI_SLEEPING;
+  nm->ExtState = NME_SLEEPING;
+  nm->RingMask = ( platform->RingSize >= 16 ) ? 0xffff : ( ( 1 << platform->RingSize ) - 1 );
+  nm->NetList = 1 << platform->Addr;        // By default, there's only us on the network
+  nm->FaultyNetList = 0;
+  nm->Succ = platform->Addr;                // and our succ will be ourselves until we find out differently
+  nm->NextSucc = 0;
+  nm->StatusByte = NMSB_NETWANTED;
+  memset(nm->Data, 0, sizeof(nm->Data));
+  nm->ForceWake = false;
+  nm->RingLive = false;
+  nm->LastHeardAt = 0;
+  nm->LastHeardTo = platform->Addr;
+  nm->SentAt = 0;
+  nm->NetCache = 0;
+  nm->NetCacheCandidate = 0;
+  TimerStop(&nm->NetCacheTimer);
+  nm->Present = 0;
+  memset(nm->Nodes, 0, sizeof(nm->Nodes));
+  TimerStop(&nm->SleepTimer);
+  TimerStop(&nm->TXCheckTimer);
+  TimerStop(&nm->TXStatusDelay);
+  TimerStop(&nm->RXNetHoldDelay);
+  TimerStop(&nm->DeadNetwork);
+}
+
+void nm_1ms (NMContext * nm)
 {
-  if (DeadNetwork)
+  const u8 OurAddr = nm->Platform->Addr;
+  TCANPacket statuspkt;
+  u8 to;
+
+  if (TimerExpired(&nm->DeadNetwork))
   {
-    DeadNetwork --;
-    if (!DeadNetwork)
-    {
-      // No nodes talking at all? Attempt to restart the network.
-      Succ = OurAddr;
-      NextSucc = Succ;
-      CurrentState = NMI_STARTUP;
-      CurrentStatusByte = 0x22;
-      NetList |= ( 1 << OurAddr );
-      FaultyNetList = NetList;
-      DeadNetwork = DEADNETWORKDELAY;
-      TXCheckTimer = 0;
-      TXStatusDelay = TXSTATUSDELAY_NOW;
-    }
+    nm_event(nm, NMEV_DEADNETWORK);
   }
 
-  if (RXNetHoldDelay)
+  if (TimerExpired(&nm->RXNetHoldDelay))
   {
-    RXNetHoldDelay --;
-    if (!RXNetHoldDelay)
+    nm->RingLive = false;
+    if (nm->CurrentState == NMI_SLEEPING)
     {
-      if (CurrentState == NMI_SLEEPING)
-      {
-        Succ = OurAddr;
-        NetList = 1 << OurAddr;
-      }
+      nm->Succ = OurAddr;
+      nm->NetList = 1 << OurAddr;
     }
   }
 
-  if (SleepTimer)
+  if (TimerExpired(&nm->SleepTimer))
   {
-    SleepTimer --;
-    if (!SleepTimer)
-    {
-      if (CurrentState == NMI_READYFORSLEEP)
-      {
-        CurrentState = NMI_GOINGTOSLEEP;
-        CurrentStatusByte |= 8;
-      }
-    }
+    nm_event(nm, NMEV_SLEEPTIMER);
   }
 
-  if (TXCheckTimer)
+  // Off the bus we don't care who answers, and mustn't send anything
+  if (TimerExpired(&nm->TXCheckTimer) && (nm->CurrentState != NMI_SLEEPING))
   {
-    TXCheckTimer --;
-    if (!TXCheckTimer)
+    if (nm->Succ == OurAddr)
     {
-      if ((Succ == OurAddr) && (CurrentState != NMI_SLEEPING))
-      {
-        // We are talking to ourselves
-        TXStatusDelay = TXSTATUSDELAY_NOW;
-        ExtCurrentState = NME_ACTIVE;
-      }
+      // We are talking to ourselves
+      TimerArm(&nm->TXStatusDelay, TXSTATUSDELAY_NOW);
+      nm->ExtState = NME_ACTIVE;
+    }
+    else
+    {
+      u16 SuccBit = 1 << nm->NextSucc;
+      nm_node_fault (nm, nm->NextSucc);
+      // We talked to someone, but they didn't.
+      // Skip them for now, but give them another chance next time around the ring
+      nm->NextSucc = FindSucc (nm, nm->NextSucc);
+      if (nm->FaultyNetList & SuccBit)  // Marked as a known good node?
+        nm->FaultyNetList &= ~SuccBit;  // Then mark as an intermittant node
       else
       {
-        u16 SuccBit = 1 << NextSucc;
-        // We talked to someone, but they didn't.
-        // Skip them for now, but give them another chance next time around the ring
-        NextSucc = FindSucc (NextSucc);
-        if (FaultyNetList & SuccBit)  // Marked as a known good node?
-          FaultyNetList &= ~SuccBit;  // Then mark as an intermittant node
-        else
-        {
-          NetList &= ~SuccBit;        // Two attempts, no response, your outa here
-          Succ = NextSucc;            // and we have a new succ.
-        }
-        CurrentStatusByte |= 0x20;
-        TXStatusDelay = TXSTATUSDELAY_NOW;
+        nm->NetList &= ~SuccBit;        // Two attempts, no response, your outa here
+        nm->Succ = nm->NextSucc;        // and we have a new succ.
       }
+      nm->StatusByte |= NMSB_SKIP;
+      TimerArm(&nm->TXStatusDelay, TXSTATUSDELAY_NOW);
     }
   }
 
-  if (CurrentState != WantedState)
+  nm_node_timeouts (nm);
+
+  if (nm->CurrentState != nm->WantedState)
   {
-    switch (WantedState)
-    {
-      case NMI_READYFORSLEEP:
-        if ((CurrentState == NMI_RUNNING) || (CurrentState == NMI_STARTUP))
-        {
-          CurrentStatusByte &= ~2;
-          CurrentStatusByte |= 0x10;
-          SleepTimer = SLEEPTIME;
-          CurrentState = NMI_READYFORSLEEP;
-        }
-        break;
-      case NMI_STARTUP:
-        if (CurrentState == NMI_SLEEPING)
-        {
-          // If we are talking to ourselves, then talk now, else wait for our position in the network.
-          if (Succ == OurAddr)
-          {
-            TXCheckTimer = TXCHECKTIME_SINGLENODE;
-            TXStatusDelay = TXSTATUSDELAY_NOW;
-          }
-          CurrentStatusByte = 0x02;
-          if (ForceNetworkWake)
-          {
-            ForceNetworkWake = false;
-            CurrentStatusByte = 0x01;
-          } 
-          CurrentState = NMI_STARTUP;
-          ExtCurrentState = NME_AWAKE;
-          NetList |= ( 1 << OurAddr );
-          FaultyNetList = NetList;
-          NextSucc = Succ;
-          DeadNetwork = DEADNETWORKDELAY;
-        }
-        else if (CurrentState == NMI_READYFORSLEEP)
-        {
-          // No need to setup any timers, as we are already talking.
-          CurrentStatusByte = 0x02;
-          CurrentState = NMI_STARTUP;
-          ExtCurrentState = NME_AWAKE;
-        }
-        break;
-    }
+    if (nm->WantedState == NMI_READYFORSLEEP)
+      nm_event(nm, NMEV_WANTSLEEP);
+    else if (nm->WantedState == NMI_STARTUP)
+      nm_event(nm, NMEV_WANTWAKE);
   }
 
   // Do we need to send a status packet out?
-  if (TXStatusDelay)
+  if (TimerExpired(&nm->TXStatusDelay))
   {
-    TXStatusDelay --;
-    if (!TXStatusDelay)
+    to = (nm->StatusByte & NMSB_SKIP) ? nm->NextSucc : nm->Succ;
+    if (!nm_event(nm, NMEV_STATUSDUE))
     {
-      TCANPacket statuspkt;
-
-      if (CurrentState == NMI_GOINGTOSLEEP)
-      {
-        // Remove ourselves from the network
-        DeadNetwork = 0; // Don't try to recover from this. We don't care if the network dies from now on.
-        CurrentState = NMI_SLEEPING;
-        ExtCurrentState = NME_SLEEPING;
-        NetList &= ~(1 << OurAddr);
-      }
-      else
-      {
-        TXCheckTimer = ((CurrentStatusByte & 0x20 ? NextSucc : Succ) != OurAddr ? TXCHECKTIME_MULTINODE : TXCHECKTIME_SINGLENODE);
-        DeadNetwork = DEADNETWORKDELAY;
-      }
+      TimerArm(&nm->TXCheckTimer, (to != OurAddr) ? nm->Platform->Timing->TxCheckMulti : nm->Platform->Timing->TxCheckSingle);
+      TimerArm(&nm->DeadNetwork, nm->Platform->Timing->DeadNetwork);
+    }
 
-      statuspkt.cplen = sizeof(TCANPacket);
-      statuspkt.id = 0x500 + OurAddr;
-      statuspkt.tag = (u16)-1;
-      statuspkt.dlc = 8;
-      statuspkt.data[0] = ((CurrentStatusByte & 0x20 ? NextSucc : Succ) << 4) | OurAddr;
-      statuspkt.data[1] = NetList >> 8;
-      statuspkt.data[2] = NetList & 0xFF;
-      statuspkt.data[3] = CurrentStatusByte;
-      statuspkt.data[4] = NMData[0];
-      statuspkt.data[5] = NMData[1];
-      statuspkt.data[6] = NMData[2];
-      statuspkt.data[7] = NMData[3];
-      CANTx(&statuspkt);
-      CurrentStatusByte &= (~0x20);
-      if ( CurrentStatusByte & 0x01 )
-      {
-        CurrentStatusByte &= ~0x01;
-        CurrentStatusByte |= 0x02;
-      }
+    statuspkt.cplen = sizeof(TCANPacket);
+    statuspkt.id = nm->Platform->BaseId + OurAddr;
+    statuspkt.tag = (u16)-1;
+    statuspkt.dlc = 8;
+    statuspkt.data[0] = (to << 4) | OurAddr;
+    statuspkt.data[1] = nm->NetList >> 8;
+    statuspkt.data[2] = nm->NetList & 0xFF;
+    statuspkt.data[3] = nm->StatusByte;
+    statuspkt.data[4] = nm->Data[0];
+    statuspkt.data[5] = nm->Data[1];
+    statuspkt.data[6] = nm->Data[2];
+    statuspkt.data[7] = nm->Data[3];
+    nm->Transmit(&statuspkt);
+    nm->SentAt = TimerNow();
+    nm->StatusByte &= (~NMSB_SKIP);
+    if ( nm->StatusByte & NMSB_FORCEWAKE )
+    {
+      nm->StatusByte &= ~NMSB_FORCEWAKE;
+      nm->StatusByte |= NMSB_NETWANTED;
     }
   }
 }
 
-int vaux_nm_can (TCANPacket *msg)
+int nm_can (NMContext * nm, TCANPacket *msg)
 {
-  if ((msg->id & 0x7F0) == 0x500)
+  const u8 OurAddr = nm->Platform->Addr;
+
+  if ((u16)(msg->id - nm->Platform->BaseId) < nm->Platform->RingSize)
   {
     u8 msgsucc = (msg->data[0] >> 4);
     u8 msgpred = (msg->data[0] & 0xF);
-
-    CalcNetList(&msg->data[1]);
-    RXNetHoldDelay = RXNETHOLDTIME;
-    if ((CurrentState == NMI_SLEEPING) && (msg->dlc >= 4) && vaux_nm_canwake(msg))
+    // Worked out before this frame moves anything on.
+    bool drop = (nm->CurrentState != NMI_SLEEPING) && nm_second_token(nm, msgpred, msgsucc);
+
+    nm_cache_frame(nm, msg, msgsucc);
+    if (msg->dlc >= 4)
+      nm_node_heard(nm, msg->id - nm->Platform->BaseId, msg->data[3]);
+    CalcNetList(nm, &msg->data[1]);
+    TimerArm(&nm->RXNetHoldDelay, nm->Platform->Timing->RxNetHold);
+    if ((msg->dlc >= 4) && vaux_nm_canwake(msg))
     {
-      CurrentState = NMI_RUNNING;
-      WantedState = NMI_READYFORSLEEP;
-      // We leave WantedState alone so we can sleep again in SLEEPTIME ms. 
-      // Our netlist should have already been rebuilt by this point, so we are sending to the right person and
-      // no need to do anything else here apart from setting the CurrentStatusByte. 
-      CurrentStatusByte = 0x02; // Not sure whether this should be 0x02 or 0x10. 
-      DEBUG("NM Wake\r\n");
+      nm_event(nm, NMEV_WAKEFRAME);
     }
 
     if (msgsucc == OurAddr)
     {
       // We have been addressed.
-      if (CurrentState != NMI_SLEEPING)
+      if (nm->CurrentState != NMI_SLEEPING)
       {
-        ExtCurrentState = NME_ACTIVE;
-        DeadNetwork = DEADNETWORKDELAY;
-        TXStatusDelay = TXSTATUSDELAY_NORMAL;
-        TXCheckTimer = 0; // No longer waiting for anything
-        NextSucc = Succ;  // Reset potentially failing succ (but don't reset any possible faults)
-        CurrentStatusByte &= (~0x20);
-        if (CurrentState == NMI_STARTUP)
-        {
-          CurrentState = NMI_RUNNING;
-          CurrentStatusByte |= 0x10;
-        }
+        nm->ExtState = NME_ACTIVE;
+        TimerArm(&nm->DeadNetwork, nm->Platform->Timing->DeadNetwork);
+        TimerArm(&nm->TXStatusDelay, nm->Platform->Timing->TxStatusDelay);
+        TimerStop(&nm->TXCheckTimer); // No longer waiting for anything
+        nm->NextSucc = nm->Succ;  // Reset potentially failing succ (but don't reset any possible faults)
+        nm->StatusByte &= (~NMSB_SKIP);
+        nm_event(nm, NMEV_ADDRESSED);
+        if (drop)
+          TimerStop(&nm->TXStatusDelay);  // the sender keeps the token it already had
       }
     }
-    else if (msgsucc == Succ)
+    else
     {
-      // Someone is talking to our successor, shout up that we should be doing this and not them.
-      if (CurrentState != NMI_SLEEPING)
-        TXStatusDelay = TXSTATUSDELAY_NOW;
+      if (drop)
+      {
+        TimerStop(&nm->TXStatusDelay);    // theirs goes on, ours doesn't
+        TimerStop(&nm->TXCheckTimer);
+      }
+      else if ((nm->NextSucc != OurAddr) && (msgpred != nm->NextSucc) && TimerRunning(&nm->TXCheckTimer))
+      {
+        // Our succ hasn't answered but there is a token going round, so it dropped ours for that one or we missed its
+        // frame. Only skip them once the ring goes quiet.
+        TimerArm(&nm->TXCheckTimer, nm->Platform->Timing->TxCheckMulti);
+      }
+      if (msgsucc == nm->Succ)
+      {
+        // Someone is talking to our successor, shout up that we should be doing this and not them.
+        // This addresses the node they just did, so it doesn't start another token.
+        if (nm->CurrentState != NMI_SLEEPING)
+          TimerArm(&nm->TXStatusDelay, TXSTATUSDELAY_NOW);
+      }
     }
 
-    if (CurrentStatusByte & 0x20)
+    if (nm->StatusByte & NMSB_SKIP)
     {
       // We are skipping someone out, so succ may not actually be our succ at this time (but we need to keep them in the netlist for now)
-      if (msgpred == NextSucc)
+      if (msgpred == nm->NextSucc)
       {
-        TXCheckTimer = 0; // The node was decided to speak to has spoken, everything ok.
-        NextSucc = Succ;  // Reset failing succ (but don't reset fault)
+        TimerStop(&nm->TXCheckTimer); // The node was decided to speak to has spoken, everything ok.
+        nm->NextSucc = nm->Succ;  // Reset failing succ (but don't reset fault)
       }
     }
     else
     {
-      if (msgpred == Succ)
+      if (msgpred == nm->Succ)
       {
         // Our successor is talking
-        FaultyNetList = NetList;
-        NextSucc = Succ;
-        TXCheckTimer = 0;
+        nm->FaultyNetList = nm->NetList;
+        nm->NextSucc = nm->Succ;
+        TimerStop(&nm->TXCheckTimer);
       }
     }
     return 1;
@@ -318,42 +460,79 @@ int vaux_nm_can (TCANPacket *msg)
     return 0;
 }
 
-void vaux_nm_cmd (NMCommand cmd)
+void nm_cmd (NMContext * nm, NMCommand cmd)
 {
   switch (cmd)
   {
     case NMC_WAKE:
-      WantedState = NMI_STARTUP;
+      nm->WantedState = NMI_STARTUP;
       break;
     case NMC_SLEEP:
-      WantedState = NMI_READYFORSLEEP;
+      nm->WantedState = NMI_READYFORSLEEP;
       break;
     case NMC_FORCEWAKE:
-      WantedState = NMI_STARTUP;
-      ForceNetworkWake = true;
+      nm->WantedState = NMI_STARTUP;
+      nm->ForceWake = true;
       break;
   }
 }
 
-NMExternalState vaux_nm_status (void)
+NMExternalState nm_status (NMContext * nm)
 {
-  return ExtCurrentState;
+  return nm->ExtState;
 }
 
 // Check if node is available on network.
 // Network must be active before this will work correctly!
 // (It is possible that this will return true even in sleeping state, as the network list is kept for a limited time in sleep)
-u8 vaux_node_avail (u8 node)
+u8 nm_node_avail (NMContext * nm, u8 node)
 {
-  return !!(NetList & (1 << node));
+  return !!(nm->NetList & (1 << node));
 }
 
-void SetNMData( u8 * data_array )
+void nm_set_data (NMContext * nm, u8 * data_array)
+{
+  memcpy ( nm->Data , data_array , 4 );
+}
+
+u16 nm_netlist (NMContext * nm)
+{
+  return nm->NetList;
+}
+
+u8 nm_node_present (NMContext * nm, u8 node)
 {
-  memcpy ( NMData , data_array , 4 );
+  return !!(nm->Present & (1 << node));
+}
+
+u16 nm_present (NMContext * nm)
+{
+  return nm->Present;
+}
+
+const NMNode * nm_node (NMContext * nm, u8 node)
+{
+  if (node < nm->Platform->RingSize)
+    return &nm->Nodes[node];
+  return 0;
+}
+
+void nm_seed_netlist (NMContext * nm, u16 netlist)
+{
+  if ((nm->CurrentState == NMI_SLEEPING) && !TimerRunning(&nm->RXNetHoldDelay))
+  {
+    nm->NetList = ( netlist & nm->RingMask ) | (1 << nm->Platform->Addr);
+    nm->Succ = FindSucc (nm, nm->Platform->Addr);
+    TimerArm(&nm->RXNetHoldDelay, nm->Platform->Timing->SeedNetHold);
+    if (!TimerRunning(&nm->NetCacheTimer))
+    {
+      nm->NetCache = nm->NetList;
+      TimerArm(&nm->NetCacheTimer, nm->Platform->Timing->SeedNetHold);
+    }
+  }
 }
 
-u8 vaux_nm_canwake (TCANPacket *msg)
+static u8 vaux_nm_canwake (TCANPacket *msg)
 {
   if ( ( ( msg->data[4] & 0x0f ) == 0x1 ) && ( msg->data[6] & 0x02) )
     return 1;
@@ -361,3 +540,65 @@ u8 vaux_nm_canwake (TCANPacket *msg)
 
   return 0;
 }
+
+// Our own node //
+
+void vaux_nm_init (const NMPlatform * platform)
+{
+  nm_init(&VauxNM, platform);
+}
+
+void vaux_nm_1ms (void)
+{
+  nm_1ms(&VauxNM);
+}
+
+int vaux_nm_can (TCANPacket *msg)
+{
+  return nm_can(&VauxNM, msg);
+}
+
+void vaux_nm_cmd (NMCommand cmd)
+{
+  nm_cmd(&VauxNM, cmd);
+}
+
+NMExternalState vaux_nm_status (void)
+{
+  return nm_status(&VauxNM);
+}
+
+u8 vaux_node_avail (u8 node)
+{
+  return nm_node_avail(&VauxNM, node);
+}
+
+void SetNMData( u8 * data_array )
+{
+  nm_set_data(&VauxNM, data_array);
+}
+
+u16 vaux_nm_netlist (void)
+{
+  return nm_netlist(&VauxNM);
+}
+
+u8 vaux_node_present (u8 node)
+{
+  return nm_node_present(&VauxNM, node);
+}
+
+u16 vaux_nm_present (void)
+{
+  return nm_present(&VauxNM);
+}
+
+const NMNode * vaux_nm_node (u8 node)
+{
+  return nm_node(&VauxNM, node);
+}
+
+void vaux_nm_seed_netlist (u16 netlist)
+{
+  nm_seed_netlist(&VauxNM, netlist);
+}
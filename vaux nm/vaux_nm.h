@@ -2,6 +2,7 @@
 #define VAUX_NM_INCLUDED
 
 #include "can.h"
+#include "timer.h"
 
 // Internal use only
 typedef enum {NMI_SLEEPING, NMI_GOINGTOSLEEP, NMI_READYFORSLEEP, NMI_RUNNING, NMI_STARTUP} NMInternalState;
@@ -13,6 +14,90 @@ typedef enum {NME_SLEEPING = 0, NME_AWAKE = 1, NME_ACTIVE = 2 } NMExternalState;
 // NMC_WAKE - Wake up
 typedef enum {NMC_SLEEP, NMC_WAKE, NMC_FORCEWAKE} NMCommand;
 
+// Ring timing, all in ms
+typedef struct
+{
+  u16 RxNetHold;        // how long a netlist sniffed while we are asleep is kept
+  u16 SeedNetHold;      // and one preloaded from flash, the network may not have started talking yet
+  u16 NetCacheHold;     // a netlist two frames in a row agreed on is kept for wake up, upto 32767
+  u16 Sleep;            // ready for sleep to off bus
+  u16 TxCheckSingle;    // waiting for our succ to answer when it's only us on the ring
+  u16 TxCheckMulti;     // and when there is someone else
+  u16 TxStatusDelay;    // from being addressed to sending our own frame
+  u16 DeadNetwork;      // nothing heard for this long with the ring up and we restart it
+  u16 NodeTimeout;      // a node we haven't heard from for this long is no longer present
+}NMTiming;
+
+// One vehicle's ring. Node addresses run 0 to RingSize - 1 ( upto 16 ) and each node talks on BaseId + address.
+typedef struct
+{
+  u16 BaseId;
+  u8 Addr;              // ours
+  u8 RingSize;
+  const NMTiming * Timing;
+}NMPlatform;
+
+// The ring this gateway was written for, us at address 1 on 0x500
+extern const NMPlatform NMPlatformVauxhall;
+
+#define NMMAXNODES    16
+
+// What we know about each of the other nodes, from their own NM frames
+typedef struct
+{
+  u16 LastSeen;         // TimerNow() of its last frame
+  u8 Status;            // the status byte in it
+  u8 Faults;            // times it hasn't answered when addressed, sticks at 0xff
+}NMNode;
+
+// One node's worth of NM state. Internal use only, apart from the host simulation which runs several of them.
+typedef struct
+{
+  const NMPlatform * Platform;
+  CANErr (*Transmit)(TCANPacket * pkt);       // CANTx() unless set otherwise after nm_init()
+  NMInternalState CurrentState;
+  NMInternalState WantedState;
+  NMExternalState ExtState;
+  u16 NetList;                                // one bit per node address
+  u16 FaultyNetList;                          // Inverted, 0 = Faulty
+  u16 RingMask;                               // every address on the ring
+  u8 Succ;
+  u8 NextSucc;
+  u8 StatusByte;
+  u8 Data[4];
+  bool ForceWake;
+  bool RingLive;                              // heard an NM frame in the last RxNetHold
+  u16 LastHeardAt;                            // and when, TimerNow()
+  u8 LastHeardTo;                             // and the node it addressed
+  u16 SentAt;                                 // TimerNow() of our last frame
+  u16 NetCache;                               // the last netlist that checked out, see nm_cache_frame()
+  u16 NetCacheCandidate;
+  TTimer NetCacheTimer;                       // running while NetCache is good
+  u16 Present;                                // one bit per node heard within NodeTimeout, never ourselves
+  NMNode Nodes[NMMAXNODES];
+  TTimer SleepTimer;                          // Used for transition from "ready to sleep" to "sleep" and off-bus
+  TTimer TXCheckTimer;                        // Ensures our packets are replied to
+  TTimer TXStatusDelay;                       // How long to wait before sending out our status
+  TTimer RXNetHoldDelay;                      // We still sniff bus traffic when sleeping - this is how long we hold onto the info for.
+  TTimer DeadNetwork;
+}NMContext;
+
+// The same as the vaux_nm_ calls below, for any node. nm_init() puts it to sleep with only itself in the netlist.
+void nm_init (NMContext * nm, const NMPlatform * platform);
+void nm_1ms (NMContext * nm);
+int nm_can (NMContext * nm, TCANPacket * msg);
+void nm_cmd (NMContext * nm, NMCommand cmd);
+NMExternalState nm_status (NMContext * nm);
+u8 nm_node_avail (NMContext * nm, u8 node);
+void nm_set_data (NMContext * nm, u8 * data_array);
+u16 nm_netlist (NMContext * nm);
+u8 nm_node_present (NMContext * nm, u8 node);
+u16 nm_present (NMContext * nm);
+const NMNode * nm_node (NMContext * nm, u8 node);
+void nm_seed_netlist (NMContext * nm, u16 netlist);
+
+// Pick the ring we are on, before anything else here is called
+void vaux_nm_init (const NMPlatform * platform);
 // Call this every 1ms
 void vaux_nm_1ms (void);
 // Call this with every can packet received. Returns 1 if can packet eaten.
@@ -21,11 +106,23 @@ int vaux_nm_can (TCANPacket *msg);
 void vaux_nm_cmd (NMCommand cmd);
 // Get internal status
 NMExternalState vaux_nm_status (void);
-// Check if node is available on network. 
+// Check if node is available on network.
 // Returns 1 if node was marked as active in the last 200ms. (Netlist only, so the actual node might not have been seen on the network for upto 3.2s)
 u8 vaux_node_avail (u8 node);
 // use this to set the extra 4 data bytes attached to the end of every NM packet sent out
 // create the 4 bytes of data in a 4 byte array of u8 then pass as a pointer
 void SetNMData( u8 * data_array );
+// Current netlist, one bit per node address
+u16 vaux_nm_netlist (void);
+// Returns 1 if the node has sent an NM frame in the last NodeTimeout ms and hasn't since left the ring. Unlike
+// vaux_node_avail() this goes as soon as the node does, not when the ring gets round to dropping it.
+u8 vaux_node_present (u8 node);
+// The same for every node, one bit per address. Changes are published as EV_NMNODES by carside.
+u16 vaux_nm_present (void);
+// Last seen, status and fault count for a node, or null if the address is off the end of the ring
+const NMNode * vaux_nm_node (u8 node);
+// Preload the netlist (eg. from flash) so on wake we already know who our successor is. Ignored if we have already
+// heard the network, and anything heard on the bus replaces it.
+void vaux_nm_seed_netlist (u16 netlist);
 
 #endif
@@ -0,0 +1,94 @@
+#ifndef VAUX_NM_INTERNAL_H
+#define VAUX_NM_INTERNAL_H
+
+#include "vaux_nm.h"
+
+// Bits in our status byte, data[3] of the NM frame
+#define NMSB_FORCEWAKE      0x01      // the first frame after NMC_FORCEWAKE, gets the other nodes up
+#define NMSB_NETWANTED      0x02      // we want the network kept up
+#define NMSB_SLEEPACK       0x08      // the last frame before we leave the ring
+#define NMSB_RUNNING        0x10      // the ring has come round to us, kept through ready for sleep
+#define NMSB_SKIP           0x20      // our succ didn't answer, this frame is addressed past it
+
+// Timing as it was when these were #defines:
+//  When we are sleeping, we still sniff the bus and grab the netlist. It expires after we don't see any NM for RxNetHold.
+//  This allows for speedier wakeup, as we already know who to talk to. A checked copy is kept for NetCacheHold after that,
+//  so waking into a quiet network we can start the ring in the right order.
+//  Delay between being told to go sleep and actually doing it. Delay for display and radio is 10 seconds, so we copy that.
+//  TxCheck, Singlenode = Only us on the network. Multinode = at least one other node talking to us. (Multinode should never
+//  expire if the network is running properly, if it does, we lost our succ)
+//  By default we talk 100ms after we have been addressed. However, if we have been skipped, then we talk straight away.
+static const NMTiming NMTimingVauxhall =
+{
+  200,      // RxNetHold
+  2000,     // SeedNetHold
+  30000,    // NetCacheHold
+  10000,    // Sleep
+  100,      // TxCheckSingle
+  150,      // TxCheckMulti
+  100,      // TxStatusDelay
+  1700,     // DeadNetwork
+  1500      // NodeTimeout, a few times round a ring of 4 or 5
+};
+
+#define TXSTATUSDELAY_NOW   0         // due straight away, so it goes out on this pass
+
+// Everything that moves CurrentState. nm_event() takes the first row that matches.
+typedef enum
+{
+  NMEV_WANTSLEEP,           // nm_cmd(NMC_SLEEP) not acted on yet, looked at every ms
+  NMEV_WANTWAKE,            // the same for NMC_WAKE / NMC_FORCEWAKE
+  NMEV_SLEEPTIMER,          // Sleep ms since ready for sleep
+  NMEV_DEADNETWORK,         // nothing heard for DeadNetwork ms
+  NMEV_STATUSDUE,           // our frame is going out
+  NMEV_WAKEFRAME,           // another node has asked the network to wake
+  NMEV_ADDRESSED            // the ring has come round to us
+}NMEvent;
+
+#define NMI_ANY   ( (NMInternalState)0xff )
+
+typedef struct
+{
+  NMInternalState State;
+  NMEvent Event;
+  NMInternalState Next;
+  void (*Action)(NMContext * nm);
+}NMTransition;
+
+static void nm_restart (NMContext * nm);
+static void nm_sleep_ack (NMContext * nm);
+static void nm_ready_for_sleep (NMContext * nm);
+static void nm_wake (NMContext * nm);
+static void nm_resume (NMContext * nm);
+static void nm_off_bus (NMContext * nm);
+static void nm_woken (NMContext * nm);
+static void nm_joined (NMContext * nm);
+
+static const NMTransition NMTransitions[] =
+{
+  // State              Event               Next                Action
+  { NMI_ANY,            NMEV_DEADNETWORK,   NMI_STARTUP,        nm_restart },
+  { NMI_READYFORSLEEP,  NMEV_SLEEPTIMER,    NMI_GOINGTOSLEEP,   nm_sleep_ack },
+  { NMI_RUNNING,        NMEV_WANTSLEEP,     NMI_READYFORSLEEP,  nm_ready_for_sleep },
+  { NMI_STARTUP,        NMEV_WANTSLEEP,     NMI_READYFORSLEEP,  nm_ready_for_sleep },
+  { NMI_SLEEPING,       NMEV_WANTWAKE,      NMI_STARTUP,        nm_wake },
+  { NMI_READYFORSLEEP,  NMEV_WANTWAKE,      NMI_STARTUP,        nm_resume },
+  { NMI_GOINGTOSLEEP,   NMEV_STATUSDUE,     NMI_SLEEPING,       nm_off_bus },
+  { NMI_SLEEPING,       NMEV_WAKEFRAME,     NMI_RUNNING,        nm_woken },
+  { NMI_STARTUP,        NMEV_ADDRESSED,     NMI_RUNNING,        nm_joined }
+};
+
+static bool nm_event (NMContext * nm, NMEvent event);
+static u8 NextInList (NMContext * nm, u16 list, u8 Addr);
+static u8 FindSucc (NMContext * nm, u8 Addr);
+static void nm_cache_frame (NMContext * nm, TCANPacket * msg, u8 msgsucc);
+static bool nm_second_token (NMContext * nm, u8 sender, u8 msgsucc);
+static void nm_node_heard (NMContext * nm, u8 node, u8 status);
+static void nm_node_fault (NMContext * nm, u8 node);
+static void nm_node_timeouts (NMContext * nm);
+static void CalcNetList (NMContext * nm, u8 *NewList);
+static u8 vaux_nm_canwake (TCANPacket *msg);
+
+static NMContext VauxNM;
+
+#endif